@@ -1,10 +1,12 @@
 // SPDX-License-Identifier: GPL-2.0-only
 // SPDX-FileCopyrightText: 2010 Marc Kleine-Budde <mkl@pengutronix.de>
+#define _GNU_SOURCE
 #include "config.h"
 
 #include <stdlib.h>
 #include <string.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <net/if.h>
@@ -16,58 +18,466 @@
 #include <sys/types.h>
 
 #include <linux/can.h>
+#include <linux/can/error.h>
 #include <linux/can/raw.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#ifdef HAVE_LINUX_CAN_ISOTP_H
+#include <linux/can/isotp.h>
+#endif
 
 #include "microcom.h"
 
+/* larger writes are split, older kernels can't send more in one PDU */
+#define ISOTP_MAX_TX_PDU 4095
+
+/* frames per sendmmsg()/recvmmsg() call */
+#define CAN_BATCH 64
+
+#define CAN_MAX_CHANNELS 32
+#define CAN_TAG_MAX 16
+
+/* "(seconds.microseconds) [tag] " in front of each line */
+#define CAN_PREFIX_MAX (32 + CAN_TAG_MAX + 3)
+
+/*
+ * Received data not yet passed to the caller: a full ISO-TP PDU or a batch
+ * of frames with line prefixes. In the worst case each payload byte is
+ * preceded by a prefix and each frame by a line break.
+ */
+#define CAN_RX_BUF_SIZE (CAN_BATCH * (CANFD_MAX_DLEN * (CAN_PREFIX_MAX + 1) + 2))
+
+/* control messages per received frame: timestamps and drop counter */
+#define CAN_CMSG_SIZE (CMSG_SPACE(sizeof(struct scm_timestamping)) + \
+		       CMSG_SPACE(sizeof(uint32_t)))
+
+/* bits of a data frame with 11-bit ID besides the payload, without stuffing */
+#define CAN_FRAME_OVERHEAD_BITS 47
+
+struct can_channel {
+	canid_t rx_id;
+	canid_t tx_id;
+	char tag[CAN_TAG_MAX + 1];
+	int logfd;
+	bool bol;	/* next output of this channel starts a new line */
+};
+
+struct can_counters {
+	unsigned long long rx_frames, rx_bytes;
+	unsigned long long tx_frames, tx_bytes;
+};
+
 struct can_data {
-	int can_id;
+	struct ios_ops ios;
+	bool fd;	/* use CAN FD frames */
+	bool brs;	/* switch bitrate for the data phase */
+	bool isotp;	/* use ISO 15765-2 transport protocol */
+	int bs;		/* ISO-TP block size */
+	int stmin;	/* ISO-TP minimum separation time */
+	int pad;	/* ISO-TP padding byte, -1 for no padding */
+	bool timestamp;	/* prefix lines with the receive time */
+	bool hwtimestamp;	/* switch on hardware timestamping of the interface */
+	bool prefix;	/* output lines are prefixed, see can_put_lines() */
+	unsigned long bitrate;	/* for the bus load estimate */
+	char ifname[IFNAMSIZ];
+	const char *state;	/* error state reported by the controller */
+	unsigned long bus_errors;
+	time_t last_bus_error;
+	uint32_t dropped;	/* frames dropped by the socket */
+	/* statistics, rates are computed between two canstats commands */
+	struct can_counters console, last_console, last_iface;
+	struct timespec last_stats;
+	struct can_channel channels[CAN_MAX_CHANNELS];
+	int num_channels;
+	int tx_channel;		/* keyboard input goes here */
+	int last_channel;	/* channel of the last output */
+	size_t rx_pos, rx_len;
+	unsigned char rx_buf[CAN_RX_BUF_SIZE];
+	/* raw frames sent or received in one go */
+	struct canfd_frame frames[CAN_BATCH];
+	struct iovec iov[CAN_BATCH];
+	struct mmsghdr msgs[CAN_BATCH];
+	unsigned char cmsgs[CAN_BATCH][CAN_CMSG_SIZE];
 };
 
-static struct can_data data;
+/* additional channels from the command line, see can_add_channel() */
+static char *channel_specs[CAN_MAX_CHANNELS - 1];
+static int num_channel_specs;
+
+/*
+ * CAN FD frames can only carry 0..8, 12, 16, 20, 24, 32, 48 or 64 bytes.
+ * Other lengths would be padded by the kernel and the receiver couldn't tell
+ * padding from data, so split into valid lengths instead.
+ */
+static size_t canfd_chunk_len(size_t count)
+{
+	static const unsigned char len[] = { 64, 48, 32, 24, 20, 16, 12 };
+	int i;
+
+	if (count <= CAN_MAX_DLEN)
+		return count;
 
+	for (i = 0; i < ARRAY_SIZE(len); i++)
+		if (count >= len[i])
+			return len[i];
+
+	return CAN_MAX_DLEN;
+}
+
+/*
+ * The frames are sent in batches of up to CAN_BATCH frames with a single
+ * sendmmsg() call. sendmmsg() fails with ENOBUFS while the tx queue of the
+ * interface is full, the bytes sent so far are returned then, or -1 with
+ * EAGAIN if nothing went out, so the caller retries later.
+ */
 static ssize_t can_write(struct ios_ops *ios, const unsigned char *buf, size_t count)
+{
+	struct can_data *can = container_of(ios, struct can_data, ios);
+	canid_t can_id = can->channels[can->tx_channel].tx_id;
+	size_t loopcount, mtu;
+	ssize_t ret = 0;
+	int i, n, sent;
+	size_t bytes;
+
+	mtu = can->fd ? CANFD_MTU : CAN_MTU;
+
+	while (count > 0) {
+		for (n = 0; n < CAN_BATCH && count > 0; n++) {
+			struct canfd_frame *to_can = &can->frames[n];
+
+			if (can->fd)
+				loopcount = canfd_chunk_len(count);
+			else
+				loopcount = min(count, (size_t)CAN_MAX_DLEN);
+
+			to_can->can_id = can_id;
+			to_can->flags = can->brs ? CANFD_BRS : 0;
+			to_can->len = loopcount;
+			memcpy(to_can->data, buf, loopcount);
+
+			can->iov[n].iov_base = to_can;
+			can->iov[n].iov_len = mtu;
+			memset(&can->msgs[n], 0, sizeof(can->msgs[n]));
+			can->msgs[n].msg_hdr.msg_iov = &can->iov[n];
+			can->msgs[n].msg_hdr.msg_iovlen = 1;
+
+			buf += loopcount;
+			count -= loopcount;
+		}
+
+		sent = sendmmsg(ios->fd, can->msgs, n, 0);
+		if (sent > 0) {
+			for (i = 0, bytes = 0; i < sent; i++)
+				bytes += can->frames[i].len;
+
+			can->console.tx_frames += sent;
+			can->console.tx_bytes += bytes;
+			ret += bytes;
+		}
+
+		if (sent < n) {
+			if (ret)
+				return ret;
+			if (!sent || errno == ENOBUFS)
+				errno = EAGAIN;
+			return -1;
+		}
+	}
+
+	return ret;
+}
+
+static struct can_channel *can_find_channel(struct can_data *can, canid_t can_id)
+{
+	int i;
+
+	for (i = 0; i < can->num_channels; i++)
+		if (can->channels[i].rx_id == can_id)
+			return &can->channels[i];
+
+	return NULL;
+}
+
+static unsigned char *can_put(unsigned char *out, const void *buf, size_t len)
+{
+	memcpy(out, buf, len);
+
+	return out + len;
+}
+
+/*
+ * Append the payload of a frame to out and prefix each line with the receive
+ * time and the tag of its channel, as configured. A line of another channel
+ * that is still open is terminated first so the output of different channels
+ * doesn't mix within one line.
+ */
+static unsigned char *can_put_lines(struct can_data *can, struct can_channel *ch,
+				    unsigned char *out, const unsigned char *buf,
+				    size_t len, const struct timespec *ts)
+{
+	struct can_channel *last = &can->channels[can->last_channel];
+
+	if (ch->logfd >= 0)
+		write(ch->logfd, buf, len);
+
+	if (last != ch && !last->bol) {
+		out = can_put(out, "\r\n", 2);
+		last->bol = true;
+	}
+	can->last_channel = ch - can->channels;
+
+	while (len) {
+		const unsigned char *nl = memchr(buf, '\n', len);
+		size_t n = nl ? nl - buf + 1 : len;
+
+		if (ch->bol && can->timestamp)
+			out += sprintf((char *)out, "(%lld.%06ld) ",
+				       (long long)ts->tv_sec, ts->tv_nsec / 1000);
+
+		if (ch->bol && can->num_channels > 1)
+			out += sprintf((char *)out, "[%s] ", ch->tag);
+
+		out = can_put(out, buf, n);
+		ch->bol = !!nl;
+		buf += n;
+		len -= n;
+	}
+
+	return out;
+}
+
+static const char *can_bus_error_str(const struct canfd_frame *frame)
+{
+	canid_t err = frame->can_id;
+
+	if (err & CAN_ERR_ACK)
+		return "no ACK";
+	if (err & CAN_ERR_TRX)
+		return "transceiver error";
+	if (frame->data[2] & CAN_ERR_PROT_STUFF)
+		return "stuff error";
+	if (frame->data[2] & CAN_ERR_PROT_FORM)
+		return "form error";
+	if (frame->data[2] & (CAN_ERR_PROT_BIT | CAN_ERR_PROT_BIT0 | CAN_ERR_PROT_BIT1))
+		return "bit error";
+
+	return "bus error";
+}
+
+/*
+ * Report state changes of the controller as events. Bus errors may come with
+ * every frame on a broken bus, these are reported once per second at most.
+ */
+static void can_error_frame(struct can_data *can, const struct canfd_frame *frame)
+{
+	canid_t err = frame->can_id;
+	const char *state = NULL;
+	time_t now;
+
+	if (err & CAN_ERR_RESTARTED)
+		state = "error-active";
+
+	if (err & CAN_ERR_CRTL) {
+		unsigned char ctrl = frame->data[1];
+
+		if (ctrl & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE))
+			state = "error-passive";
+		else if (ctrl & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING))
+			state = "error-warning";
+		else if (ctrl & CAN_ERR_CRTL_ACTIVE)
+			state = "error-active";
+
+		if (ctrl & (CAN_ERR_CRTL_RX_OVERFLOW | CAN_ERR_CRTL_TX_OVERFLOW))
+			mux_event("%s: controller buffer overflow", can->ifname);
+	}
+
+	if (err & CAN_ERR_BUSOFF)
+		state = "bus-off";
+
+	if (state && state != can->state) {
+		can->state = state;
+		mux_event("%s: %s", can->ifname, state);
+	}
+
+	if (err & CAN_ERR_TX_TIMEOUT)
+		mux_event("%s: TX timeout", can->ifname);
+
+	if (!(err & (CAN_ERR_PROT | CAN_ERR_ACK | CAN_ERR_BUSERROR | CAN_ERR_TRX)))
+		return;
+
+	can->bus_errors++;
+
+	now = time(NULL);
+	if (now != can->last_bus_error) {
+		can->last_bus_error = now;
+		mux_event("%s: %s (%lu bus errors)", can->ifname,
+			  can_bus_error_str(frame), can->bus_errors);
+	}
+}
+
+static void can_parse_cmsgs(struct can_data *can, struct msghdr *msg,
+			    struct timespec *ts)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET)
+			continue;
+
+		if (cmsg->cmsg_type == SO_TIMESTAMPING) {
+			struct scm_timestamping *tss = (void *)CMSG_DATA(cmsg);
+
+			/* prefer the hardware timestamp if the driver provides one */
+			if (tss->ts[2].tv_sec || tss->ts[2].tv_nsec)
+				*ts = tss->ts[2];
+			else
+				*ts = tss->ts[0];
+		} else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+			memcpy(&can->dropped, CMSG_DATA(cmsg), sizeof(can->dropped));
+		}
+	}
+}
+
+static ssize_t can_read_buffered(struct can_data *can, unsigned char *buf, size_t count)
+{
+	count = min(count, can->rx_len - can->rx_pos);
+	memcpy(buf, can->rx_buf + can->rx_pos, count);
+	can->rx_pos += count;
+
+	return count;
+}
+
+/*
+ * Without line prefixes the payload goes straight to buf. Otherwise, or if
+ * buf can't hold a single frame, the output is assembled in rx_buf first,
+ * whatever doesn't fit into buf is returned by the next calls (see
+ * can_pending()).
+ */
+static ssize_t can_read(struct ios_ops *ios, unsigned char *buf, size_t count)
+{
+	struct can_data *can = container_of(ios, struct can_data, ios);
+	size_t maxlen = can->fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	bool staged = can->prefix || count < maxlen;
+	unsigned char *out;
+	int i, n;
+
+	if (!count) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (can->rx_pos != can->rx_len)
+		return can_read_buffered(can, buf, count);
+
+	/* only fetch as many frames as surely fit into buf */
+	n = staged ? CAN_BATCH : min(count / maxlen, (size_t)CAN_BATCH);
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *msg = &can->msgs[i].msg_hdr;
+
+		can->iov[i].iov_base = &can->frames[i];
+		can->iov[i].iov_len = sizeof(can->frames[i]);
+		memset(&can->msgs[i], 0, sizeof(can->msgs[i]));
+		msg->msg_iov = &can->iov[i];
+		msg->msg_iovlen = 1;
+		msg->msg_control = can->cmsgs[i];
+		msg->msg_controllen = sizeof(can->cmsgs[i]);
+	}
+
+	/* classic frames are received as struct can_frame even on FD sockets */
+	n = recvmmsg(ios->fd, can->msgs, n, MSG_DONTWAIT, NULL);
+	if (n < 0)
+		return n;
+
+	out = staged ? can->rx_buf : buf;
+
+	for (i = 0; i < n; i++) {
+		struct canfd_frame *from_can = &can->frames[i];
+		size_t len = min((size_t)from_can->len, maxlen);
+		struct timespec ts = { 0 };
+		struct can_channel *ch;
+
+		can_parse_cmsgs(can, &can->msgs[i].msg_hdr, &ts);
+
+		if (from_can->can_id & CAN_ERR_FLAG) {
+			can_error_frame(can, from_can);
+			continue;
+		}
+
+		can->console.rx_frames++;
+		can->console.rx_bytes += len;
+
+		if (!can->prefix) {
+			out = can_put(out, from_can->data, len);
+			continue;
+		}
+
+		ch = can_find_channel(can, from_can->can_id);
+		if (ch)
+			out = can_put_lines(can, ch, out, from_can->data, len, &ts);
+	}
+
+	if (staged) {
+		can->rx_pos = 0;
+		can->rx_len = out - can->rx_buf;
+		out = buf + can_read_buffered(can, buf, count);
+	}
+
+	if (out == buf) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return out - buf;
+}
+
+static int can_pending(struct ios_ops *ios)
+{
+	struct can_data *can = container_of(ios, struct can_data, ios);
+
+	return can->rx_pos != can->rx_len;
+}
+
+#ifdef HAVE_LINUX_CAN_ISOTP_H
+/* each write is sent as one flow controlled ISO-TP message */
+static ssize_t isotp_write(struct ios_ops *ios, const unsigned char *buf, size_t count)
 {
 	size_t loopcount;
 	ssize_t ret = 0, err;
 
-	struct can_frame to_can = {
-		.can_id = data.can_id,
-	};
-
 	while (count > 0) {
-		loopcount = min(count, sizeof(to_can.data));
-		memcpy(to_can.data, buf, loopcount);
-		to_can.can_dlc = loopcount;
-		err = write(ios->fd, &to_can, sizeof(to_can));
+		loopcount = min(count, (size_t)ISOTP_MAX_TX_PDU);
+		err = write(ios->fd, buf, loopcount);
 
 		if (err < 0)
 			return err;
 
-		assert(err == sizeof(to_can));
-		buf += loopcount;
-		count -= loopcount;
-		ret += loopcount;
+		buf += err;
+		count -= err;
+		ret += err;
 	}
 
 	return ret;
 }
 
-static ssize_t can_read(struct ios_ops *ios, unsigned char *buf, size_t count)
+static ssize_t isotp_read(struct ios_ops *ios, unsigned char *buf, size_t count)
 {
-	struct can_frame from_can;
+	struct can_data *can = container_of(ios, struct can_data, ios);
 	ssize_t ret;
 
-	ret = read(ios->fd, &from_can, sizeof(from_can));
-
-	if (ret < 0)
-		return ret;
+	if (can->rx_pos == can->rx_len) {
+		ret = read(ios->fd, can->rx_buf, sizeof(can->rx_buf));
+		if (ret <= 0)
+			return ret;
 
-	assert(count >= from_can.can_dlc);
-	memcpy(buf, from_can.data, from_can.can_dlc);
+		can->rx_pos = 0;
+		can->rx_len = ret;
+	}
 
-	return from_can.can_dlc;
+	return can_read_buffered(can, buf, count);
 }
+#endif
 
 static int can_set_speed(struct ios_ops *ios, unsigned long speed)
 {
@@ -86,75 +496,492 @@ static int can_send_break(struct ios_ops *ios)
 
 static void can_exit(struct ios_ops *ios)
 {
+	struct can_data *can = container_of(ios, struct can_data, ios);
+	int i;
+
+	for (i = 0; i < can->num_channels; i++)
+		if (can->channels[i].logfd >= 0)
+			close(can->channels[i].logfd);
+
 	close(ios->fd);
 }
 
+static int cmd_channel(int argc, char *argv[])
+{
+	struct can_data *can = container_of(ios, struct can_data, ios);
+	char *end;
+	int i;
+
+	if (argc < 2) {
+		for (i = 0; i < can->num_channels; i++) {
+			struct can_channel *ch = &can->channels[i];
+
+			printf("%c %d: [%s] rx_id=%x tx_id=%x\n",
+			       i == can->tx_channel ? '*' : ' ', i, ch->tag,
+			       ch->rx_id & CAN_EFF_MASK, ch->tx_id & CAN_EFF_MASK);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < can->num_channels; i++) {
+		if (!strcmp(argv[1], can->channels[i].tag)) {
+			can->tx_channel = i;
+			return 0;
+		}
+	}
+
+	i = strtoul(argv[1], &end, 0);
+	if (*end || i >= can->num_channels) {
+		printf("no such channel: %s\n", argv[1]);
+		return 1;
+	}
+
+	can->tx_channel = i;
+
+	return 0;
+}
+
+static unsigned long long can_read_ifstat(struct can_data *can, const char *name)
+{
+	unsigned long long val = 0;
+	char path[128];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s",
+		 can->ifname, name);
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%llu", &val) != 1)
+		val = 0;
+	fclose(f);
+
+	return val;
+}
+
+static void can_print_counters(const char *name, const struct can_counters *now,
+			       const struct can_counters *last, double secs)
+{
+	printf("%-8s rx %10.0f %10.0f %14llu %14llu\n", name,
+	       (now->rx_frames - last->rx_frames) / secs,
+	       (now->rx_bytes - last->rx_bytes) / secs,
+	       now->rx_frames, now->rx_bytes);
+	printf("%-8s tx %10.0f %10.0f %14llu %14llu\n", "",
+	       (now->tx_frames - last->tx_frames) / secs,
+	       (now->tx_bytes - last->tx_bytes) / secs,
+	       now->tx_frames, now->tx_bytes);
+}
+
+/*
+ * Rates are averaged since the previous call. The console counters only
+ * cover the frames of our channels, the interface counters all frames on the
+ * bus, so the bus load is estimated from these.
+ */
+static int cmd_canstats(int argc, char *argv[])
+{
+	struct can_data *can = container_of(ios, struct can_data, ios);
+	struct can_counters iface;
+	struct timespec now;
+	double secs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - can->last_stats.tv_sec +
+		(now.tv_nsec - can->last_stats.tv_nsec) / 1e9;
+	if (secs <= 0)
+		secs = 1;
+
+	iface.rx_frames = can_read_ifstat(can, "rx_packets");
+	iface.rx_bytes = can_read_ifstat(can, "rx_bytes");
+	iface.tx_frames = can_read_ifstat(can, "tx_packets");
+	iface.tx_bytes = can_read_ifstat(can, "tx_bytes");
+
+	printf("over the last %.1f seconds:\n", secs);
+	printf("            %10s %10s %14s %14s\n", "frames/s", "bytes/s", "frames", "bytes");
+	can_print_counters("console", &can->console, &can->last_console, secs);
+	can_print_counters(can->ifname, &iface, &can->last_iface, secs);
+
+	if (can->bitrate) {
+		unsigned long long frames, bytes;
+
+		frames = iface.rx_frames + iface.tx_frames -
+			can->last_iface.rx_frames - can->last_iface.tx_frames;
+		bytes = iface.rx_bytes + iface.tx_bytes -
+			can->last_iface.rx_bytes - can->last_iface.tx_bytes;
+
+		printf("bus load: %.1f%% (estimated, without stuff bits)\n",
+		       (frames * CAN_FRAME_OVERHEAD_BITS + bytes * 8) * 100.0 /
+		       (secs * can->bitrate));
+	} else {
+		printf("bus load: unknown, use the bitrate= option\n");
+	}
+
+	printf("state: %s, bus errors: %lu, dropped frames: %u, unsent bytes: %llu\n",
+	       can->state ? can->state : "unknown", can->bus_errors, can->dropped,
+	       keyboard_dropped());
+
+	can->last_console = can->console;
+	can->last_iface = iface;
+	can->last_stats = now;
+
+	return 0;
+}
+
+static struct cmd can_cmds[] = {
+	{
+		.name = "channel",
+		.fn = cmd_channel,
+		.info = "show CAN channels or select the one to send to",
+		.help = "channel [<number>|<tag>]",
+	}, {
+		.name = "canstats",
+		.fn = cmd_canstats,
+		.info = "show CAN frame rates and estimated bus load",
+		.help = "canstats",
+	},
+};
+
+/*
+ * Like cansend, IDs of exactly eight hex digits are extended IDs, and so are
+ * those too large for 11 bits. Others, e.g. 0x200, stay standard IDs.
+ */
+static canid_t can_parse_id(const char *str)
+{
+	unsigned long id;
+	char *end;
+
+	id = strtoul(str, &end, 16);
+
+	if (end - str == 8 || id > CAN_SFF_MASK)
+		return (id & CAN_EFF_MASK) | CAN_EFF_FLAG;
+
+	return id;
+}
+
+/* remember a "rx_id:tx_id[:tag[:logfile]]" channel for can_init() */
+int can_add_channel(char *spec)
+{
+	if (num_channel_specs == ARRAY_SIZE(channel_specs)) {
+		fprintf(stderr, "too many CAN channels\n");
+		return -EINVAL;
+	}
+
+	channel_specs[num_channel_specs++] = spec;
+
+	return 0;
+}
+
+static int can_setup_channel(struct can_data *can, char *spec)
+{
+	struct can_channel *ch = &can->channels[can->num_channels];
+	char *rx, *tx, *tag, *logfile;
+
+	rx = strsep(&spec, ":");
+	tx = strsep(&spec, ":");
+	tag = strsep(&spec, ":");
+	logfile = spec;
+
+	if (!tx) {
+		fprintf(stderr, "CAN channel '%s' needs rx_id:tx_id\n", rx);
+		return -EINVAL;
+	}
+
+	ch->rx_id = can_parse_id(rx);
+	ch->tx_id = can_parse_id(tx);
+	ch->bol = true;
+	ch->logfd = -1;
+
+	if (tag && *tag)
+		snprintf(ch->tag, sizeof(ch->tag), "%s", tag);
+	else
+		snprintf(ch->tag, sizeof(ch->tag), "%x", ch->rx_id & CAN_EFF_MASK);
+
+	if (logfile && *logfile) {
+		ch->logfd = open(logfile, O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644);
+		if (ch->logfd < 0) {
+			fprintf(stderr, "Cannot open logfile '%s': %s\n", logfile, strerror(errno));
+			return -errno;
+		}
+	}
+
+	can->num_channels++;
+
+	return 0;
+}
+
+static int can_parse_options(struct can_data *can, char *options)
+{
+	char *opt;
+
+	while ((opt = strsep(&options, ","))) {
+		if (!strcmp(opt, "fd")) {
+			can->fd = true;
+		} else if (!strcmp(opt, "brs")) {
+			can->fd = true;
+			can->brs = true;
+		} else if (!strcmp(opt, "isotp")) {
+			can->isotp = true;
+		} else if (!strncmp(opt, "bs=", 3)) {
+			can->bs = strtoul(opt + 3, NULL, 0);
+		} else if (!strncmp(opt, "stmin=", 6)) {
+			can->stmin = strtoul(opt + 6, NULL, 0);
+		} else if (!strncmp(opt, "pad=", 4)) {
+			can->pad = strtoul(opt + 4, NULL, 16) & 0xff;
+		} else if (!strcmp(opt, "timestamp")) {
+			can->timestamp = true;
+		} else if (!strcmp(opt, "hwtimestamp")) {
+			can->timestamp = true;
+			can->hwtimestamp = true;
+		} else if (!strncmp(opt, "bitrate=", 8)) {
+			can->bitrate = strtoul(opt + 8, NULL, 0);
+		} else if (*opt) {
+			fprintf(stderr, "unknown CAN option '%s'\n", opt);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/* switch to CAN FD frames if the interface supports them */
+static void can_enable_fd(struct can_data *can, struct ifreq *ifr)
+{
+	int fd = can->ios.fd;
+	int one = 1;
+	int ret;
+
+	ret = ioctl(fd, SIOCGIFMTU, ifr);
+	if (!ret && ifr->ifr_mtu != CANFD_MTU)
+		ret = -1;
+
+	if (!ret && can->isotp) {
+#ifdef HAVE_LINUX_CAN_ISOTP_H
+		struct can_isotp_ll_options ll = {
+			.mtu = CANFD_MTU,
+			.tx_dl = CANFD_MAX_DLEN,
+			.tx_flags = can->brs ? CANFD_BRS : 0,
+		};
+
+		ret = setsockopt(fd, SOL_CAN_ISOTP, CAN_ISOTP_LL_OPTS, &ll, sizeof(ll));
+#endif
+	} else if (!ret) {
+		ret = setsockopt(fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &one, sizeof(one));
+	}
+
+	if (ret) {
+		printf("%s: CAN FD not supported, using classic CAN\n", ifr->ifr_name);
+		can->fd = false;
+		can->brs = false;
+	}
+}
+
+#ifdef HAVE_LINUX_CAN_ISOTP_H
+static int isotp_socket(struct can_data *can, struct sockaddr_can *addr)
+{
+	struct ios_ops *ios = &can->ios;
+	struct can_isotp_options opts = { 0 };
+	struct can_isotp_fc_options fc = {
+		.bs = can->bs,
+		.stmin = can->stmin,
+	};
+
+	/* an ISO-TP socket is bound to exactly one rx/tx pair */
+	if (can->num_channels > 1) {
+		fprintf(stderr, "ISO-TP supports a single CAN channel only\n");
+		return -EINVAL;
+	}
+
+	ios->read = isotp_read;
+	ios->write = isotp_write;
+
+	ios->fd = socket(PF_CAN, SOCK_DGRAM, CAN_ISOTP);
+	if (ios->fd < 0) {
+		perror("socket");
+		return -errno;
+	}
+
+	if (can->pad >= 0) {
+		opts.flags |= CAN_ISOTP_TX_PADDING;
+		opts.txpad_content = can->pad;
+	}
+
+	if (setsockopt(ios->fd, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts)) ||
+	    setsockopt(ios->fd, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc, sizeof(fc))) {
+		perror("setsockopt");
+		return -errno;
+	}
+
+	addr->can_addr.tp.rx_id = can->channels[0].rx_id;
+	addr->can_addr.tp.tx_id = can->channels[0].tx_id;
+
+	return 0;
+}
+#else
+static int isotp_socket(struct can_data *can, struct sockaddr_can *addr)
+{
+	fprintf(stderr, "ISO-TP not supported\n");
+	return -ENOSYS;
+}
+#endif
+
+/*
+ * Timestamp received frames. Hardware timestamps are reported if the
+ * interface already generates them, the kernel's software timestamps
+ * otherwise. Switching hardware timestamping on changes the configuration of
+ * the interface for all its users, so that is only done with hwtimestamp. It
+ * needs CAP_NET_ADMIN and may fail, the software timestamps are used then.
+ */
+static void can_enable_timestamps(struct can_data *can)
+{
+	struct hwtstamp_config config = {
+		.rx_filter = HWTSTAMP_FILTER_ALL,
+	};
+	struct ifreq ifr;
+	int flags = SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_RX_SOFTWARE |
+		    SOF_TIMESTAMPING_SOFTWARE;
+
+	if (can->hwtimestamp) {
+		strcpy(ifr.ifr_name, can->ifname);
+		ifr.ifr_data = (void *)&config;
+		if (ioctl(can->ios.fd, SIOCSHWTSTAMP, &ifr))
+			dbg_printf("SIOCSHWTSTAMP: %s\n", strerror(errno));
+		flags |= SOF_TIMESTAMPING_RX_HARDWARE;
+	}
+
+	if (setsockopt(can->ios.fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags))) {
+		printf("%s: timestamps not supported\n", can->ifname);
+		can->timestamp = false;
+	}
+}
+
+/*
+ * A raw socket receiving the rx_id of every channel and the error frames of
+ * the controller, except for lost arbitration which is no error.
+ */
+static int raw_socket(struct can_data *can)
+{
+	struct ios_ops *ios = &can->ios;
+	struct can_filter filter[CAN_MAX_CHANNELS];
+	can_err_mask_t err_mask = CAN_ERR_MASK & ~CAN_ERR_LOSTARB;
+	int one = 1;
+	int i;
+
+	ios->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	if (ios->fd < 0) {
+		perror("socket");
+		return -errno;
+	}
+
+	for (i = 0; i < can->num_channels; i++) {
+		canid_t rx_id = can->channels[i].rx_id;
+
+		/* match the frame format too, 0x123 and 0x00000123 differ */
+		filter[i].can_id = rx_id;
+		filter[i].can_mask = CAN_EFF_FLAG | CAN_RTR_FLAG |
+			((rx_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+	}
+
+	if (setsockopt(ios->fd, SOL_CAN_RAW, CAN_RAW_FILTER,
+		       filter, can->num_channels * sizeof(filter[0])) ||
+	    setsockopt(ios->fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER,
+		       &err_mask, sizeof(err_mask))) {
+		perror("setsockopt");
+		return -errno;
+	}
+
+	/* count frames dropped because we didn't keep up */
+	if (setsockopt(ios->fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)))
+		dbg_printf("SO_RXQ_OVFL: %s\n", strerror(errno));
+
+	return 0;
+}
+
 struct ios_ops *can_init(char *interface_id)
 {
+	struct can_data *can;
 	struct ios_ops *ios;
 	struct ifreq ifr;
-	struct can_filter filter[] = {
-		{
-			.can_mask = CAN_SFF_MASK,
-		},
-	};
 	struct sockaddr_can addr = {
 		.can_family = PF_CAN,
 	};
 	char *interface = interface_id;
 	char *id_str = NULL;
+	char ids[32];
+	int i;
 
-	ios = malloc(sizeof(*ios));
-	if (!ios)
+	can = calloc(1, sizeof(*can));
+	if (!can)
 		return NULL;
 
+	can->pad = -1;
+
+	ios = &can->ios;
 	ios->write = can_write;
 	ios->read = can_read;
 	ios->set_speed = can_set_speed;
 	ios->set_flow = can_set_flow;
 	ios->send_break = can_send_break;
 	ios->exit = can_exit;
+	ios->pending = can_pending;
 
 	/*
 	 * the string is supposed to be formated this way:
-	 * interface:rx:tx
+	 * interface:rx:tx[:option,...]
 	 */
 	if (interface_id)
 		id_str = strchr(interface, ':');
 
 	if (id_str) {
+		char *rx;
+
 		*id_str = 0x0;
-		id_str++;
-		filter->can_id = strtol(id_str, NULL, 16) & CAN_SFF_MASK;
+		rx = ++id_str;
 
 		id_str = strchr(id_str, ':');
-	} else {
-		filter->can_id = DEFAULT_CAN_ID;
+		if (id_str) {
+			id_str = strchr(id_str + 1, ':');
+			if (id_str)
+				*id_str++ = 0x0;
+		} else {
+			/* no tx_id, send with the rx_id */
+			snprintf(ids, sizeof(ids), "%s:%s", rx, rx);
+			rx = ids;
+		}
+
+		if (can_setup_channel(can, rx))
+			return NULL;
+	} else if (!num_channel_specs) {
+		/* no default if the channels are given with --can-channel */
+		snprintf(ids, sizeof(ids), "%x:%x", DEFAULT_CAN_ID, DEFAULT_CAN_ID);
+		if (can_setup_channel(can, ids))
+			return NULL;
 	}
 
-	if (id_str) {
-		*id_str = 0x0;
-		id_str++;
-		data.can_id = strtol(id_str, NULL, 16) & CAN_SFF_MASK;
-	} else {
-		data.can_id = filter->can_id;
-	}
+	if (id_str && can_parse_options(can, id_str))
+		return NULL;
+
+	for (i = 0; i < num_channel_specs; i++)
+		if (can_setup_channel(can, channel_specs[i]))
+			return NULL;
 
 	if (!interface || *interface == 0x0)
 		interface = DEFAULT_CAN_INTERFACE;
+	snprintf(can->ifname, sizeof(can->ifname), "%s", interface);
 
 	/* no cleanups on failure, we exit anyway */
 
-	ios->fd = socket(PF_CAN, SOCK_RAW, CAN_RAW);
-	if (ios->fd < 0) {
-		perror("socket");
+	if (can->isotp && can->timestamp) {
+		fprintf(stderr, "timestamps are not supported with ISO-TP\n");
 		return NULL;
 	}
 
-	if (setsockopt(ios->fd, SOL_CAN_RAW, CAN_RAW_FILTER,
-		       filter, sizeof(filter))) {
-		perror("setsockopt");
-		return NULL;
+	if (can->isotp) {
+		if (isotp_socket(can, &addr))
+			return NULL;
+	} else {
+		if (raw_socket(can))
+			return NULL;
 	}
 
 	strcpy(ifr.ifr_name, interface);
@@ -164,13 +991,29 @@ struct ios_ops *can_init(char *interface_id)
 	}
 	addr.can_ifindex = ifr.ifr_ifindex;
 
+	if (can->fd)
+		can_enable_fd(can, &ifr);
+
+	if (can->timestamp)
+		can_enable_timestamps(can);
+
+	can->prefix = can->timestamp || can->num_channels > 1;
+	clock_gettime(CLOCK_MONOTONIC, &can->last_stats);
+
 	if (bind(ios->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		perror("bind");
 		return NULL;
 	}
 
-	printf("connected to %s (rx_id=%x, tx_id=%x)\n",
-	       interface, filter->can_id, data.can_id);
+	for (i = 0; i < can->num_channels; i++)
+		printf("connected to %s (rx_id=%x, tx_id=%x%s%s)\n", interface,
+		       can->channels[i].rx_id & CAN_EFF_MASK,
+		       can->channels[i].tx_id & CAN_EFF_MASK,
+		       can->fd ? (can->brs ? ", CAN FD with BRS" : ", CAN FD") : "",
+		       can->isotp ? ", ISO-TP" : "");
+
+	for (i = 0; i < ARRAY_SIZE(can_cmds); i++)
+		register_command(&can_cmds[i]);
 
 	return ios;
 }
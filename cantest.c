@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Regression and throughput test of the CAN backend, run by "make check".
+ *
+ * The backend is driven with generated frames over a SOCK_SEQPACKET
+ * socketpair standing in for the CAN socket: each message is one frame like
+ * on a raw CAN socket. The framing of classic and FD frames in both
+ * directions, the channel lookup and the batched receive path are checked,
+ * and the frames/s and bytes/s the backend handles are reported.
+ *
+ * Given a vcan interface (see cantest.sh), the same is done on the real
+ * socket set up by can_init(), which also checks the rx ID filter of the
+ * kernel.
+ */
+#include "can.c"
+#include "test.h"
+
+#include <poll.h>
+
+#define THROUGHPUT_FRAMES 1000000
+
+/* a backend on one end of a socketpair, the other end is returned in peer */
+static struct can_data *pair_setup(bool fd, const char *const *channels, int *peer)
+{
+	struct can_data *can = calloc(1, sizeof(*can));
+	int sv[2];
+
+	assert(can);
+	assert(!socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, sv));
+
+	can->pad = -1;
+	can->fd = fd;
+	can->ios.fd = sv[0];
+	can->ios.write = can_write;
+	can->ios.read = can_read;
+	can->ios.pending = can_pending;
+	snprintf(can->ifname, sizeof(can->ifname), "pair");
+
+	for (; *channels; channels++) {
+		char *spec = strdup(*channels);
+
+		assert(!can_setup_channel(can, spec));
+		free(spec);
+	}
+	can->prefix = can->num_channels > 1;
+
+	*peer = sv[1];
+
+	return can;
+}
+
+static void pair_free(struct can_data *can, int peer)
+{
+	close(can->ios.fd);
+	close(peer);
+	free(can);
+}
+
+/* send frames from the generator side, FD frames if fd */
+static void gen_send(int sock, bool fd, struct canfd_frame *frames, int n)
+{
+	struct mmsghdr msgs[CAN_BATCH];
+	struct iovec iov[CAN_BATCH];
+	int i, sent;
+
+	assert(n <= CAN_BATCH);
+
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = &frames[i];
+		iov[i].iov_len = fd ? CANFD_MTU : CAN_MTU;
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	sent = sendmmsg(sock, msgs, n, 0);
+	assert(sent == n);
+}
+
+/* receive a frame on the generator side, returns its size or -1 */
+static int gen_recv(int sock, struct canfd_frame *frame, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+	if (poll(&pfd, 1, timeout_ms) != 1)
+		return -1;
+
+	return recv(sock, frame, sizeof(*frame), MSG_DONTWAIT);
+}
+
+/* read from the backend until len bytes came or nothing more does */
+static size_t backend_read(struct ios_ops *ios, unsigned char *buf, size_t len,
+			   int timeout_ms)
+{
+	struct pollfd pfd = { .fd = ios->fd, .events = POLLIN };
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		if (!ios->pending(ios) && poll(&pfd, 1, timeout_ms) != 1)
+			break;
+
+		ret = ios->read(ios, buf + done, len - done);
+		if (ret < 0 && errno == EAGAIN)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	return done;
+}
+
+static void fill_pattern(unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = 'a' + i % 26;
+}
+
+/* data written to the backend is split into valid frames with the tx_id */
+static void test_tx_framing(bool fd)
+{
+	static const char *const channels[] = { "123:321", NULL };
+	static const unsigned char fd_lens[] = { 64, 32, 4 };
+	unsigned char data[100], got[sizeof(data)];
+	struct canfd_frame frame;
+	struct can_data *can;
+	size_t done = 0;
+	int peer, i, size;
+
+	can = pair_setup(fd, channels, &peer);
+	fill_pattern(data, sizeof(data));
+
+	check(can_write(&can->ios, data, sizeof(data)) == sizeof(data),
+	      "short write");
+
+	for (i = 0; (size = gen_recv(peer, &frame, 0)) > 0; i++) {
+		check(size == (fd ? CANFD_MTU : CAN_MTU), "frame size %d", size);
+		check(frame.can_id == 0x321, "tx_id %x", frame.can_id);
+		if (fd)
+			check(i < ARRAY_SIZE(fd_lens) && frame.len == fd_lens[i],
+			      "FD frame %d has %d bytes", i, frame.len);
+		else
+			check(frame.len == min(sizeof(data) - done, (size_t)CAN_MAX_DLEN),
+			      "frame %d has %d bytes", i, frame.len);
+		if (done + frame.len <= sizeof(got))
+			memcpy(got + done, frame.data, frame.len);
+		done += frame.len;
+	}
+
+	check(done == sizeof(data) && !memcmp(got, data, sizeof(data)),
+	      "%zu bytes sent as frames, expected %zu", done, sizeof(data));
+	check(i == (fd ? 3 : 13), "%d frames", i);
+
+	printf("%s tx framing: %d frames\n", fd ? "FD" : "classic", i);
+
+	pair_free(can, peer);
+}
+
+/* received payloads are passed on in order, also when batched */
+static void test_rx_framing(bool fd)
+{
+	static const char *const channels[] = { "123:321", NULL };
+	static const unsigned char fd_lens[] = {
+		0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+	};
+	struct canfd_frame frames[CAN_BATCH];
+	unsigned char data[CAN_BATCH * CANFD_MAX_DLEN], got[sizeof(data)];
+	size_t maxlen = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN, len = 0, n;
+	struct can_data *can;
+	int peer, i;
+
+	can = pair_setup(fd, channels, &peer);
+	fill_pattern(data, sizeof(data));
+
+	memset(frames, 0, sizeof(frames));
+	for (i = 0; i < CAN_BATCH; i++) {
+		/* all valid lengths, the last frames full */
+		frames[i].can_id = 0x123;
+		frames[i].len = fd ? fd_lens[i % ARRAY_SIZE(fd_lens)] :
+				     i % (CAN_MAX_DLEN + 1);
+		if (i >= CAN_BATCH - 4)
+			frames[i].len = maxlen;
+		memcpy(frames[i].data, data + len, frames[i].len);
+		len += frames[i].len;
+	}
+	gen_send(peer, fd, frames, CAN_BATCH);
+
+	n = backend_read(&can->ios, got, sizeof(got), 0);
+	check(n == len && !memcmp(got, data, len), "received %zu of %zu bytes", n, len);
+
+	printf("%s rx framing: %d frames, %zu bytes\n", fd ? "FD" : "classic",
+	       CAN_BATCH, len);
+
+	pair_free(can, peer);
+}
+
+/* a buffer smaller than a frame gets the payload in pieces */
+static void test_rx_small_buffer(void)
+{
+	static const char *const channels[] = { "123:321", NULL };
+	unsigned char data[4 * CANFD_MAX_DLEN], got[sizeof(data)];
+	struct canfd_frame frames[4];
+	struct can_data *can;
+	size_t done = 0;
+	ssize_t ret;
+	int peer, i;
+
+	can = pair_setup(true, channels, &peer);
+	fill_pattern(data, sizeof(data));
+
+	memset(frames, 0, sizeof(frames));
+	for (i = 0; i < ARRAY_SIZE(frames); i++) {
+		frames[i].can_id = 0x123;
+		frames[i].len = CANFD_MAX_DLEN;
+		memcpy(frames[i].data, data + i * CANFD_MAX_DLEN, CANFD_MAX_DLEN);
+	}
+	gen_send(peer, true, frames, ARRAY_SIZE(frames));
+
+	ret = can->ios.read(&can->ios, got, 0);
+	check(ret < 0 && errno == EINVAL, "empty read returned %zd", ret);
+
+	while (done < sizeof(got)) {
+		ret = can->ios.read(&can->ios, got + done, min(sizeof(got) - done, (size_t)5));
+		if (ret <= 0)
+			break;
+		done += ret;
+	}
+
+	check(done == sizeof(data) && !memcmp(got, data, sizeof(data)),
+	      "received %zu of %zu bytes", done, sizeof(data));
+
+	printf("small buffer: %zu bytes in 5 byte reads\n", done);
+
+	pair_free(can, peer);
+}
+
+/* with several channels, lines are tagged and unknown IDs are dropped */
+static void test_rx_channels(void)
+{
+	static const char *const channels[] = {
+		"123:321", "18daf110:18da10f1:ecu", NULL
+	};
+	static const char expect[] = "[123] one\r\n[ecu] two\n[123] three\n";
+	struct canfd_frame frames[5] = {
+		{ .can_id = 0x123, .len = 3, .data = "one" },
+		/* the same number as standard ID, and another ID */
+		{ .can_id = 0x110, .len = 3, .data = "bad" },
+		{ .can_id = 0x124, .len = 3, .data = "bad" },
+		{ .can_id = 0x18daf110 | CAN_EFF_FLAG, .len = 4, .data = "two\n" },
+		{ .can_id = 0x123, .len = 6, .data = "three\n" },
+	};
+	unsigned char got[256];
+	struct can_data *can;
+	size_t n;
+	int peer;
+
+	can = pair_setup(false, channels, &peer);
+	gen_send(peer, false, frames, ARRAY_SIZE(frames));
+
+	n = backend_read(&can->ios, got, sizeof(got), 0);
+	check(n == strlen(expect) && !memcmp(got, expect, n),
+	      "got '%.*s'", (int)n, got);
+
+	printf("channels: %zu bytes for 3 of 5 frames\n", n);
+
+	pair_free(can, peer);
+}
+
+/* IDs from the command line, see can_parse_id() */
+static void test_parse_id(void)
+{
+	check(can_parse_id("123") == 0x123, "123");
+	check(can_parse_id("7ff") == 0x7ff, "7ff");
+	check(can_parse_id("18daf110") == (0x18daf110 | CAN_EFF_FLAG), "18daf110");
+	check(can_parse_id("800") == (0x800 | CAN_EFF_FLAG), "800");
+	check(can_parse_id("0x200") == 0x200, "0x200");
+	check(can_parse_id("0200") == 0x200, "0200");
+	check(can_parse_id("00000200") == (0x200 | CAN_EFF_FLAG), "00000200");
+}
+
+static void report(const char *what, unsigned long frames, size_t bytes, double t)
+{
+	printf("%s: %lu frames, %.0f frames/s, %.1f MB/s\n", what, frames,
+	       frames / t, bytes / t / 1e6);
+}
+
+/* the generator sends, the backend reads */
+static void rx_throughput(const char *what, struct ios_ops *ios, int gen, bool fd)
+{
+	size_t maxlen = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	struct canfd_frame frames[CAN_BATCH];
+	unsigned char buf[CAN_BATCH * CANFD_MAX_DLEN];
+	size_t bytes = 0, want = CAN_BATCH * maxlen;
+	unsigned long n;
+	double t;
+	int i;
+
+	memset(frames, 0, sizeof(frames));
+	for (i = 0; i < CAN_BATCH; i++) {
+		frames[i].can_id = 0x123;
+		frames[i].len = maxlen;
+		memset(frames[i].data, 'a' + i % 26, maxlen);
+	}
+
+	t = now();
+	for (n = 0; n < THROUGHPUT_FRAMES; n += CAN_BATCH) {
+		gen_send(gen, fd, frames, CAN_BATCH);
+		bytes += backend_read(ios, buf, want, 1000);
+	}
+	t = now() - t;
+
+	check(bytes == n * maxlen, "%s: received %zu of %zu bytes", what, bytes,
+	      n * maxlen);
+	report(what, n, bytes, t);
+}
+
+/* the backend writes, the generator drains */
+static void tx_throughput(const char *what, struct ios_ops *ios, int gen, bool fd)
+{
+	size_t maxlen = fd ? CANFD_MAX_DLEN : CAN_MAX_DLEN;
+	unsigned char buf[CAN_BATCH * CANFD_MAX_DLEN];
+	size_t bytes = 0, len = CAN_BATCH * maxlen;
+	struct canfd_frame frame;
+	unsigned long n, frames = 0;
+	double t;
+
+	fill_pattern(buf, sizeof(buf));
+
+	t = now();
+	for (n = 0; n < THROUGHPUT_FRAMES; n += CAN_BATCH) {
+		size_t done = 0;
+		ssize_t ret;
+
+		while (done < len) {
+			ret = ios->write(ios, buf + done, len - done);
+			if (ret > 0) {
+				done += ret;
+			} else if (errno != EAGAIN ||
+				   gen_recv(gen, &frame, 1000) <= 0) {
+				break;
+			} else {
+				/* the queue was full, make room */
+				frames++;
+				bytes += frame.len;
+			}
+		}
+		check(done == len, "%s: short write", what);
+		while (frames < n + CAN_BATCH && gen_recv(gen, &frame, 1000) > 0) {
+			frames++;
+			bytes += frame.len;
+		}
+	}
+	t = now() - t;
+
+	check(frames == n, "%s: %lu of %lu frames", what, frames, n);
+	report(what, frames, bytes, t);
+}
+
+static void test_pair_throughput(bool fd)
+{
+	static const char *const channels[] = { "123:321", NULL };
+	struct can_data *can;
+	int peer;
+
+	can = pair_setup(fd, channels, &peer);
+	rx_throughput(fd ? "FD rx" : "classic rx", &can->ios, peer, fd);
+	tx_throughput(fd ? "FD tx" : "classic tx", &can->ios, peer, fd);
+	pair_free(can, peer);
+}
+
+/* a raw socket on the vcan interface as frame generator */
+static int vcan_generator(const char *ifname)
+{
+	struct sockaddr_can addr = { .can_family = AF_CAN };
+	int one = 1, sock;
+
+	sock = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+	assert(sock >= 0);
+	setsockopt(sock, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &one, sizeof(one));
+
+	addr.can_ifindex = if_nametoindex(ifname);
+	assert(addr.can_ifindex);
+	assert(!bind(sock, (struct sockaddr *)&addr, sizeof(addr)));
+
+	return sock;
+}
+
+/* the backend as set up by can_init(), with the kernel's rx ID filter */
+static void test_vcan(const char *ifname)
+{
+	char spec[64], channel[] = "18daf110:18da10f1:ecu";
+	static const char expect[] = "[123] one\r\n[ecu] two\n";
+	struct canfd_frame frames[4] = {
+		{ .can_id = 0x123, .len = 3, .data = "one" },
+		{ .can_id = 0x124, .len = 3, .data = "bad" },
+		{ .can_id = 0x110, .len = 3, .data = "bad" },
+		{ .can_id = 0x18daf110 | CAN_EFF_FLAG, .len = 4, .data = "two\n" },
+	};
+	struct canfd_frame frame;
+	unsigned char got[256];
+	struct ios_ops *can;
+	int gen;
+	size_t n;
+
+	snprintf(spec, sizeof(spec), "%s:123:321:fd", ifname);
+	assert(!can_add_channel(channel));
+	can = can_init(spec);
+	check(can, "can_init %s failed", ifname);
+	if (!can)
+		return;
+
+	gen = vcan_generator(ifname);
+
+	gen_send(gen, false, frames, ARRAY_SIZE(frames));
+	n = backend_read(can, got, strlen(expect), 100);
+	check(n == strlen(expect) && !memcmp(got, expect, n),
+	      "vcan: got '%.*s'", (int)n, got);
+	/* the frames for other IDs must not come late */
+	check(!backend_read(can, got, sizeof(got), 100), "vcan: unexpected data");
+
+	check(can->write(can, (unsigned char *)"hi", 2) == 2, "vcan: write");
+	check(gen_recv(gen, &frame, 100) > 0 && frame.can_id == 0x321 &&
+	      frame.len == 2 && !memcmp(frame.data, "hi", 2), "vcan: tx frame");
+
+	printf("vcan %s: rx filter and channels\n", ifname);
+
+	/* throughput without the line prefixes of several channels */
+	container_of(can, struct can_data, ios)->prefix = false;
+	rx_throughput("vcan FD rx", can, gen, true);
+	tx_throughput("vcan FD tx", can, gen, true);
+
+	close(gen);
+	can_exit(can);
+}
+
+int main(int argc, char *argv[])
+{
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	test_parse_id();
+	test_tx_framing(false);
+	test_tx_framing(true);
+	test_rx_framing(false);
+	test_rx_framing(true);
+	test_rx_small_buffer();
+	test_rx_channels();
+	test_pair_throughput(false);
+	test_pair_throughput(true);
+
+	if (argc > 1)
+		test_vcan(argv[1]);
+	else
+		printf("no vcan interface, socketpair only\n");
+
+	if (failures)
+		printf("%d failures\n", failures);
+
+	return failures ? 1 : 0;
+}
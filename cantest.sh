@@ -0,0 +1,18 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Run cantest, on a vcan interface too if one can be set up here, that needs
+# root and the vcan module. Otherwise the CAN socket is only stood in for by
+# a socketpair.
+
+ifname=mcomtest$$
+
+if ip link add dev $ifname type vcan mtu 72 2>/dev/null; then
+	ip link set dev $ifname up
+	./cantest $ifname
+	ret=$?
+	ip link del dev $ifname
+	exit $ret
+fi
+
+exec ./cantest
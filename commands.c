@@ -163,10 +163,14 @@ static int cmd_help(int argc, char *argv[])
 
 	if (argc == 1) {
 		for_each_command(cmd) {
+			int i;
+
+			printf("%s", cmd->name);
+			for (i = 0; cmd->aliases && cmd->aliases[i]; i++)
+				printf(", %s", cmd->aliases[i]);
 			if (cmd->info)
-				printf("%s - %s\n", cmd->name, cmd->info);
-			else
-				printf("%s\n", cmd->name);
+				printf(" - %s", cmd->info);
+			printf("\n");
 		}
 	} else {
 		microcom_cmd_usage(argv[1]);
@@ -200,6 +204,10 @@ static int cmd_comment(int argc, char *argv[])
 	return 0;
 }
 
+static const char *const flow_values[] = { "hard", "soft", "none", NULL };
+static const char *const line_values[] = { "1", "0", NULL };
+static const char *const help_aliases[] = { "?", NULL };
+
 static struct cmd cmds[] = {
 	{
 		.name = "speed",
@@ -215,16 +223,19 @@ static struct cmd cmds[] = {
 		.fn = cmd_flow,
 		.info = "set flow control",
 		.help = "flow hard|soft|none",
+		.values = flow_values,
 	}, {
 		.name = "dtr",
 		.fn = cmd_set_handshake_line,
 		.info = "set dtr value",
 		.help = "dtr 1|0",
+		.values = line_values,
 	}, {
 		.name = "rts",
 		.fn = cmd_set_handshake_line,
 		.info = "set rts value",
 		.help = "rts 1|0",
+		.values = line_values,
 	}, {
 		.name = "break",
 		.fn = cmd_break,
@@ -241,16 +252,20 @@ static struct cmd cmds[] = {
 		.name = "help",
 		.fn = cmd_help,
 		.info = "show help",
+		.aliases = help_aliases,
+		.complete = complete_command,
 	}, {
 		.name = "x",
 		.fn = cmd_execute,
 		.info = "execute a script",
 		.help = "x <scriptfile>",
+		.complete = complete_file,
 	}, {
 		.name = "log",
 		.fn = cmd_log,
 		.info = "log to file",
 		.help = "log <logfile>",
+		.complete = complete_file,
 	}, {
 		.name = "#",
 		.fn = cmd_comment,
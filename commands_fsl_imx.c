@@ -655,6 +655,7 @@ static struct cmd cmds[] = {
 		.info = "upload image (i.MX specific)",
 		.help = "upload <address> <file> [<imagetype>]\n"
 			"use imagetype = 0xaa for application images",
+		.complete = complete_file,
 	}, {
 		.name = "connect",
 		.fn = fsl_connect,
@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "microcom.h"
+
+/*
+ * Control socket for automation, e.g. a test runner sharing the session with
+ * a user or a daemon's clients. The protocol is line based, requests are:
+ *
+ *   write <string>	send string to the port, not during a transfer
+ *   cmd <command>	run a command like on the prompt
+ *   status		show the speed, flow control, transfer and script
+ *   subscribe		get the received data and the events
+ *   unsubscribe
+ *
+ * Strings may contain the escapes of scripts (\r, \n, \xHH, ...). A request
+ * is answered by its output, one line each starting with "- ", and "ok" or
+ * "error <message>". A subscribed client also gets "rx <data>" lines with the
+ * data escaped the same way and "event <text>" lines, these may come within
+ * an answer. Clients that don't keep up are disconnected.
+ */
+
+#define CONTROL_LINE_MAX	4096
+/* received data per "rx" line, escaped it's at most four times as long */
+#define CONTROL_RX_CHUNK	1024
+
+struct control_client {
+	struct mux_source src;
+	struct control_client *next;
+	bool subscribed;
+	bool overflow;		/* discarding the rest of a too long line */
+	int len;
+	char line[CONTROL_LINE_MAX];
+};
+
+static struct mux_source listener = { .fd = -1 };
+static struct control_client *clients;
+static char *socket_path;
+
+/*
+ * Like daemon_clients_write(), this may run from within another handler, so
+ * a client is shut down and freed by its own handler.
+ */
+static void control_send(struct control_client *client, const char *buf, int len)
+{
+	if (send(client->src.fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+		shutdown(client->src.fd, SHUT_RDWR);
+}
+
+static void control_printf(struct control_client *client, const char *format, ...)
+{
+	char buf[512];
+	va_list args;
+	int len;
+
+	va_start(args, format);
+	len = vsnprintf(buf, sizeof(buf) - 1, format, args);
+	va_end(args);
+
+	len = min(len, (int)sizeof(buf) - 2);
+	buf[len++] = '\n';
+	control_send(client, buf, len);
+}
+
+/* escape buf so str_unescape() gets it back, returns the length */
+static int control_escape(char *out, const unsigned char *buf, int len)
+{
+	char *p = out;
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		if (c == '\\') {
+			*p++ = '\\';
+			*p++ = '\\';
+		} else if (c == '\r') {
+			*p++ = '\\';
+			*p++ = 'r';
+		} else if (c == '\n') {
+			*p++ = '\\';
+			*p++ = 'n';
+		} else if (c >= 0x20 && c < 0x7f) {
+			*p++ = c;
+		} else {
+			p += sprintf(p, "\\x%02x", c);
+		}
+	}
+
+	return p - out;
+}
+
+/* called with everything received from the port */
+void control_receive(const unsigned char *buf, int len)
+{
+	char line[4 + 4 * CONTROL_RX_CHUNK + 1];
+	struct control_client *client;
+
+	while (len > 0) {
+		int n = min(len, CONTROL_RX_CHUNK);
+		int linelen = 0;
+
+		for (client = clients; client; client = client->next) {
+			if (!client->subscribed)
+				continue;
+			if (!linelen) {
+				memcpy(line, "rx ", 3);
+				linelen = 3 + control_escape(line + 3, buf, n);
+				line[linelen++] = '\n';
+			}
+			control_send(client, line, linelen);
+		}
+
+		buf += n;
+		len -= n;
+	}
+}
+
+void control_event(const char *msg, int len)
+{
+	struct control_client *client;
+
+	for (client = clients; client; client = client->next)
+		if (client->subscribed)
+			control_printf(client, "event %.*s", len, msg);
+}
+
+/*
+ * Run a command, its output goes to the client. Only stdout is redirected,
+ * not its fd, events still go to the terminal.
+ */
+static int control_cmd(struct control_client *client, char *cmd)
+{
+	FILE *out, *saved = stdout;
+	char *buf = NULL, *line, *end;
+	size_t size;
+	int ret;
+
+	out = open_memstream(&buf, &size);
+	if (!out)
+		return -errno;
+
+	fflush(stdout);
+	stdout = out;
+	ret = commandline_run(cmd);
+	stdout = saved;
+	fclose(out);
+
+	for (line = buf; *line; line = end + 1) {
+		end = line + strcspn(line, "\n");
+		if (end > line && end[-1] == '\r')
+			end[-1] = 0;
+		control_printf(client, "- %.*s", (int)(end - line), line);
+		if (!*end)
+			break;
+	}
+	free(buf);
+
+	/* a started transfer or script is a success */
+	return ret == MICROCOM_CMD_START ? 0 : ret;
+}
+
+static void control_status(struct control_client *client)
+{
+	static const char *flows[] = {
+		[FLOW_NONE] = "none",
+		[FLOW_SOFT] = "soft",
+		[FLOW_HARD] = "hard",
+	};
+	struct transfer *t = transfer_current();
+	const char *script = script_name();
+
+	control_printf(client, "- speed %lu", current_speed);
+	control_printf(client, "- flow %s", flows[current_flow]);
+	if (t)
+		control_printf(client, "- transfer %s %s %lld/%lld", t->proto,
+			       t->send ? "send" : "receive", (long long)t->done,
+			       (long long)t->size);
+	else
+		control_printf(client, "- transfer none");
+	control_printf(client, "- script %s", script ? script : "none");
+}
+
+static void control_request(struct control_client *client, char *line)
+{
+	char *arg;
+	int len, ret = 0;
+
+	line[strcspn(line, "\r")] = 0;
+
+	arg = line + strcspn(line, " ");
+	if (*arg)
+		*arg++ = 0;
+
+	if (!strcmp(line, "write")) {
+		len = str_unescape(arg);
+		/* like the keyboard, it would disturb a file transfer */
+		if (transfer_active())
+			ret = -EBUSY;
+		else if (ios->write(ios, (unsigned char *)arg, len) < 0)
+			ret = -errno;
+	} else if (!strcmp(line, "cmd")) {
+		ret = control_cmd(client, arg);
+	} else if (!strcmp(line, "status")) {
+		control_status(client);
+	} else if (!strcmp(line, "subscribe")) {
+		client->subscribed = true;
+	} else if (!strcmp(line, "unsubscribe")) {
+		client->subscribed = false;
+	} else if (*line) {
+		control_printf(client, "error unknown request");
+		return;
+	} else {
+		return;
+	}
+
+	if (ret)
+		control_printf(client, "error %s", strerror(-ret));
+	else
+		control_printf(client, "ok");
+}
+
+static void control_client_free(struct control_client *client)
+{
+	struct control_client **p;
+
+	for (p = &clients; *p; p = &(*p)->next) {
+		if (*p == client) {
+			*p = client->next;
+			break;
+		}
+	}
+
+	mux_del_source(&client->src);
+	close(client->src.fd);
+	free(client);
+}
+
+static int control_client_handler(struct mux_source *src)
+{
+	struct control_client *client = container_of(src, struct control_client, src);
+	char buf[1024], *p, *end;
+	ssize_t len;
+
+	len = read(src->fd, buf, sizeof(buf));
+	if (len < 0 && errno == EAGAIN)
+		return 0;
+
+	if (len <= 0) {
+		control_client_free(client);
+		return 0;
+	}
+
+	for (p = buf; p < buf + len; p = end + 1) {
+		int n;
+
+		end = memchr(p, '\n', buf + len - p);
+		n = (end ? end : buf + len) - p;
+
+		if (client->len + n >= CONTROL_LINE_MAX) {
+			client->overflow = true;
+			client->len = 0;
+		} else {
+			memcpy(client->line + client->len, p, n);
+			client->len += n;
+		}
+
+		if (!end)
+			break;
+
+		if (client->overflow) {
+			control_printf(client, "error line too long");
+		} else {
+			client->line[client->len] = 0;
+			control_request(client, client->line);
+		}
+		client->overflow = false;
+		client->len = 0;
+	}
+
+	return 0;
+}
+
+static int control_listener_handler(struct mux_source *src)
+{
+	struct control_client *client;
+	int fd;
+
+	fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return 0;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(fd);
+		return 0;
+	}
+
+	client->src.fd = fd;
+	client->src.handler = control_client_handler;
+	client->next = clients;
+	clients = client;
+	mux_add_source(&client->src);
+
+	return 0;
+}
+
+int control_init(char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -EINVAL;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* replace a socket left over from a previous run, but nothing else */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is no socket\n", path);
+			return -EEXIST;
+		}
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+		fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -errno;
+	}
+
+	socket_path = path;
+	listener.fd = fd;
+	listener.handler = control_listener_handler;
+	mux_add_source(&listener);
+
+	return 0;
+}
+
+void control_exit(void)
+{
+	if (socket_path)
+		unlink(socket_path);
+	socket_path = NULL;
+}
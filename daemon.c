@@ -0,0 +1,301 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "microcom.h"
+
+/*
+ * Daemon mode: run without a terminal, e.g. to capture a console all the
+ * time. Clients attach via a UNIX socket (e.g. with "microcom --unix"), they
+ * get what the terminal would show and their input is sent to the port. A
+ * client that doesn't keep up is disconnected rather than stalling the
+ * capture. While a file transfer or a script runs, the input of the clients
+ * is dropped and counted.
+ *
+ * Under systemd (NOTIFY_SOCKET or LISTEN_FDS set) we don't fork, readiness
+ * is reported with sd_notify() and a passed socket is used for the clients.
+ * SIGHUP reopens the logfile, e.g. after logrotate moved it.
+ */
+
+#define SD_LISTEN_FDS_START 3
+
+struct daemon_client {
+	struct mux_source src;
+	struct daemon_client *next;
+	unsigned long long dropped;	/* during transfers and scripts */
+};
+
+static struct mux_source listener = { .fd = -1 };
+static struct mux_source signals = { .fd = -1 };
+static struct daemon_client *clients;
+static char *socket_path;
+static bool active;
+
+static void daemon_notify(const char *state)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	const char *path = getenv("NOTIFY_SOCKET");
+	socklen_t len;
+	int fd;
+
+	if (!path || (*path != '/' && *path != '@') ||
+	    strlen(path) >= sizeof(addr.sun_path))
+		return;
+
+	strcpy(addr.sun_path, path);
+	/* abstract socket */
+	if (*path == '@')
+		addr.sun_path[0] = 0;
+	len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&addr, len);
+	close(fd);
+}
+
+static void daemon_client_free(struct daemon_client *client)
+{
+	struct daemon_client **p;
+
+	for (p = &clients; *p; p = &(*p)->next) {
+		if (*p == client) {
+			*p = client->next;
+			break;
+		}
+	}
+
+	mux_del_source(&client->src);
+	close(client->src.fd);
+	free(client);
+}
+
+static int daemon_client_handler(struct mux_source *src)
+{
+	struct daemon_client *client = container_of(src, struct daemon_client, src);
+	unsigned char buf[1024];
+	ssize_t len;
+
+	len = read(src->fd, buf, sizeof(buf));
+	if (len < 0 && errno == EAGAIN)
+		return 0;
+
+	if (len <= 0) {
+		if (client->dropped)
+			mux_event("client detached, %llu bytes of its input dropped",
+				  client->dropped);
+		else
+			mux_event("client detached");
+		daemon_client_free(client);
+		return 0;
+	}
+
+	/* the input would disturb a file transfer or a script */
+	if (transfer_active() || script_name())
+		client->dropped += len;
+	else
+		ios->write(ios, buf, len);
+
+	return 0;
+}
+
+static int daemon_listener_handler(struct mux_source *src)
+{
+	struct daemon_client *client;
+	int fd;
+
+	fd = accept4(src->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return 0;
+
+	client = calloc(1, sizeof(*client));
+	if (!client) {
+		close(fd);
+		return 0;
+	}
+
+	client->src.fd = fd;
+	client->src.handler = daemon_client_handler;
+	client->next = clients;
+	clients = client;
+	mux_add_source(&client->src);
+
+	mux_event("client attached");
+
+	return 0;
+}
+
+/*
+ * Called with everything the terminal would get. This may run from within
+ * another mux source's handler, so clients are not freed here: shutting
+ * down the socket makes their own handler see EOF.
+ */
+void daemon_clients_write(const unsigned char *buf, int len)
+{
+	struct daemon_client *client;
+
+	for (client = clients; client; client = client->next)
+		if (send(client->src.fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT) != len)
+			shutdown(client->src.fd, SHUT_RDWR);
+}
+
+static int daemon_signal_handler(struct mux_source *src)
+{
+	struct signalfd_siginfo si;
+
+	if (read(src->fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+
+	if (si.ssi_signo == SIGHUP) {
+		daemon_notify("RELOADING=1");
+		if (logfile_reopen())
+			mux_event("cannot reopen logfile: %s", strerror(errno));
+		daemon_notify("READY=1");
+	}
+
+	return 0;
+}
+
+/* a socket passed by systemd socket activation, -1 if there is none */
+static int daemon_listen_fds(void)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	int fd = SD_LISTEN_FDS_START;
+
+	if (!pid || !fds || strtol(pid, NULL, 10) != getpid() ||
+	    strtol(fds, NULL, 10) < 1)
+		return -1;
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return fd;
+}
+
+static int daemon_listen(char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return -EINVAL;
+	}
+	strcpy(addr.sun_path, path);
+
+	/* replace a socket left over from a previous run, but nothing else */
+	if (!lstat(path, &st)) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is no socket\n", path);
+			return -EEXIST;
+		}
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 4)) {
+		fprintf(stderr, "cannot listen on %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -errno;
+	}
+
+	socket_path = path;
+
+	return fd;
+}
+
+static void daemon_detach(void)
+{
+	pid_t pid;
+	int fd;
+
+	/* systemd wants the main process to stay */
+	if (getenv("NOTIFY_SOCKET") || getenv("LISTEN_FDS"))
+		goto out;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return;
+	}
+	if (pid)
+		_exit(0);
+
+	setsid();
+out:
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0)
+		return;
+
+	dup2(fd, STDIN_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	dup2(fd, STDERR_FILENO);
+	if (fd > STDERR_FILENO)
+		close(fd);
+}
+
+/* detach from the terminal and accept clients on path, if given */
+int daemon_init(char *path)
+{
+	sigset_t mask;
+
+	listener.fd = daemon_listen_fds();
+	if (listener.fd < 0 && path) {
+		listener.fd = daemon_listen(path);
+		if (listener.fd < 0)
+			return listener.fd;
+	}
+
+	if (listener.fd >= 0) {
+		listener.handler = daemon_listener_handler;
+		mux_add_source(&listener);
+	}
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGHUP);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signals.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signals.fd >= 0) {
+		signals.handler = daemon_signal_handler;
+		mux_add_source(&signals);
+	}
+
+	daemon_detach();
+	daemon_notify("READY=1");
+	active = true;
+
+	return 0;
+}
+
+void daemon_exit(void)
+{
+	if (!active)
+		return;
+
+	daemon_notify("STOPPING=1");
+
+	if (socket_path)
+		unlink(socket_path);
+	socket_path = NULL;
+}
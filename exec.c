@@ -0,0 +1,299 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "microcom.h"
+
+/*
+ * Run a command and talk to it via its stdin and stdout, e.g. to reach a
+ * console through "ssh jumphost conserver-cli" or "kubectl exec". The command
+ * is started with /bin/sh -c, either connected via two pipes or, with
+ * exec_pty set, via a pseudo terminal for commands that insist on a tty.
+ */
+
+int exec_pty;
+
+struct exec_data {
+	struct ios_ops ios;
+	pid_t pid;
+	int wfd;
+	bool broken;	/* the command stopped reading its input */
+	bool closed;	/* the command closed its output, ios->fd is a pidfd */
+};
+
+static void exec_reap(struct exec_data *exec, int options)
+{
+	int status;
+
+	if (exec->pid <= 0)
+		return;
+
+	if (waitpid(exec->pid, &status, options) <= 0)
+		return;
+
+	exec->pid = 0;
+
+	if (WIFEXITED(status))
+		fprintf(stderr, "command exited with status %d\n", WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		fprintf(stderr, "command killed by signal %d\n", WTERMSIG(status));
+}
+
+/*
+ * A pipe has no MSG_NOSIGNAL. Block SIGPIPE around the write and take back
+ * the one it raised, the interactive handler would otherwise exit as if
+ * the user had quit.
+ */
+static ssize_t exec_write_nosignal(int fd, const unsigned char *buf, size_t count)
+{
+	struct timespec zero = { 0 };
+	sigset_t pipe_set, old_set, pending;
+	ssize_t ret;
+	int err;
+
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	sigprocmask(SIG_BLOCK, &pipe_set, &old_set);
+	sigpending(&pending);
+
+	ret = write(fd, buf, count);
+	err = errno;
+
+	if (ret < 0 && err == EPIPE && !sigismember(&pending, SIGPIPE))
+		sigtimedwait(&pipe_set, NULL, &zero);
+
+	sigprocmask(SIG_SETMASK, &old_set, NULL);
+	errno = err;
+
+	return ret;
+}
+
+static ssize_t exec_write(struct ios_ops *ios, const unsigned char *buf, size_t count)
+{
+	struct exec_data *exec = container_of(ios, struct exec_data, ios);
+	ssize_t ret;
+
+	ret = exec_write_nosignal(exec->wfd, buf, count);
+	if (ret < 0 && errno == EPIPE && !exec->broken) {
+		fprintf(stderr, "command closed its input\n");
+		exec->broken = true;
+	}
+
+	return ret;
+}
+
+/*
+ * The command closed its output but may still read its input. Poll a pidfd
+ * instead of the output from now on, it gets readable when the command
+ * exits. Without pidfds (before Linux 5.3) the connection ends right away.
+ */
+static int exec_wait_exit(struct exec_data *exec)
+{
+	struct ios_ops *ios = &exec->ios;
+	int pidfd = -1;
+
+#ifdef SYS_pidfd_open
+	pidfd = syscall(SYS_pidfd_open, exec->pid, 0);
+#endif
+	if (pidfd < 0)
+		return -1;
+
+	if (ios->fd != exec->wfd)
+		close(ios->fd);
+	ios->fd = pidfd;
+	exec->closed = true;
+
+	return 0;
+}
+
+static ssize_t exec_read(struct ios_ops *ios, unsigned char *buf, size_t count)
+{
+	struct exec_data *exec = container_of(ios, struct exec_data, ios);
+	ssize_t ret;
+
+	/* the end of the connection, see exec_pending() */
+	if (exec->broken)
+		return 0;
+
+	if (exec->closed) {
+		ret = 0;
+	} else {
+		ret = read(ios->fd, buf, count);
+
+		/* a pty master reports EIO once the last slave fd is closed */
+		if (ret < 0 && errno == EIO && exec_pty)
+			ret = 0;
+		if (ret)
+			return ret;
+	}
+
+	/* never wait for the command here, that would stop the main loop */
+	exec_reap(exec, WNOHANG);
+	if (exec->pid > 0 && (exec->closed || !exec_wait_exit(exec))) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* let the main loop see the EOF even if the command keeps its output open */
+static int exec_pending(struct ios_ops *ios)
+{
+	struct exec_data *exec = container_of(ios, struct exec_data, ios);
+
+	return exec->broken;
+}
+
+static int exec_write_fd(struct ios_ops *ios)
+{
+	struct exec_data *exec = container_of(ios, struct exec_data, ios);
+
+	return exec->wfd;
+}
+
+static int exec_set_speed(struct ios_ops *ios, unsigned long speed)
+{
+	return 0;
+}
+
+static int exec_set_flow(struct ios_ops *ios, int flow)
+{
+	return 0;
+}
+
+static int exec_send_break(struct ios_ops *ios)
+{
+	return 0;
+}
+
+static void exec_exit(struct ios_ops *ios)
+{
+	struct exec_data *exec = container_of(ios, struct exec_data, ios);
+
+	close(ios->fd);
+	if (exec->wfd != ios->fd)
+		close(exec->wfd);
+
+	if (exec->pid > 0) {
+		/* give the command a chance to terminate on its own */
+		exec_reap(exec, WNOHANG);
+		if (exec->pid > 0)
+			kill(exec->pid, SIGTERM);
+		exec_reap(exec, 0);
+	}
+}
+
+static void exec_child(const char *command, int in, int out, int pty_slave)
+{
+	if (pty_slave >= 0) {
+		struct termios ts;
+
+		setsid();
+		ioctl(pty_slave, TIOCSCTTY, 0);
+
+		/* pass the data through unmodified */
+		tcgetattr(pty_slave, &ts);
+		cfmakeraw(&ts);
+		tcsetattr(pty_slave, TCSANOW, &ts);
+
+		in = out = pty_slave;
+		dup2(pty_slave, STDERR_FILENO);
+	}
+
+	dup2(in, STDIN_FILENO);
+	dup2(out, STDOUT_FILENO);
+
+	execl("/bin/sh", "sh", "-c", command, NULL);
+	perror("/bin/sh");
+	_exit(127);
+}
+
+struct ios_ops *exec_init(char *command)
+{
+	struct exec_data *exec;
+	struct ios_ops *ios;
+	int to_child[2], from_child[2];
+	int pty_slave = -1;
+
+	exec = calloc(1, sizeof(*exec));
+	if (!exec)
+		return NULL;
+
+	ios = &exec->ios;
+	ios->write = exec_write;
+	ios->read = exec_read;
+	ios->set_speed = exec_set_speed;
+	ios->set_flow = exec_set_flow;
+	ios->send_break = exec_send_break;
+	ios->exit = exec_exit;
+	ios->write_fd = exec_write_fd;
+	ios->pending = exec_pending;
+
+	if (exec_pty) {
+		int master;
+
+		if (pty_open(&master, &pty_slave)) {
+			perror("pty");
+			free(exec);
+			return NULL;
+		}
+		ios->fd = exec->wfd = master;
+		ios->raw = true;
+	} else {
+		if (pipe2(to_child, O_CLOEXEC)) {
+			perror("pipe");
+			free(exec);
+			return NULL;
+		}
+		if (pipe2(from_child, O_CLOEXEC)) {
+			perror("pipe");
+			close(to_child[0]);
+			close(to_child[1]);
+			free(exec);
+			return NULL;
+		}
+		ios->fd = from_child[0];
+		exec->wfd = to_child[1];
+	}
+
+	exec->pid = fork();
+	if (exec->pid < 0) {
+		perror("fork");
+		if (exec_pty) {
+			close(pty_slave);
+		} else {
+			close(to_child[0]);
+			close(from_child[1]);
+		}
+		exec_exit(ios);
+		free(exec);
+		return NULL;
+	}
+
+	if (!exec->pid) {
+		if (exec_pty)
+			exec_child(command, -1, -1, pty_slave);
+		else
+			exec_child(command, to_child[0], from_child[1], -1);
+	}
+
+	if (exec_pty) {
+		close(pty_slave);
+	} else {
+		close(to_child[0]);
+		close(from_child[1]);
+	}
+
+	printf("connected to command '%s' (pid %d)\n", command, exec->pid);
+
+	return ios;
+}
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include "config.h"
+
+#include "microcom.h"
+
+/*
+ * Multi-pattern matcher for the received data (Aho-Corasick). The patterns
+ * are compiled into a complete DFA: every state has a transition for every
+ * byte, so scanning costs one table lookup per byte no matter how many
+ * patterns there are. The state is kept between calls, so a pattern split
+ * across reads is found as well.
+ */
+
+struct match_node {
+	int next[256];
+	int fail;
+	int id;		/* of the pattern ending here, -1 if none */
+	int dict;	/* next node on the fail chain with a pattern, 0 if none */
+};
+
+struct matcher {
+	struct match_node *nodes;
+	int num_nodes;
+	int state;
+};
+
+static int matcher_new_node(struct matcher *m)
+{
+	struct match_node *nodes;
+	int n = m->num_nodes;
+
+	nodes = realloc(m->nodes, (n + 1) * sizeof(*nodes));
+	if (!nodes)
+		return -ENOMEM;
+
+	memset(&nodes[n], 0, sizeof(*nodes));
+	nodes[n].id = -1;
+	m->nodes = nodes;
+	m->num_nodes++;
+
+	return n;
+}
+
+struct matcher *matcher_new(void)
+{
+	struct matcher *m = calloc(1, sizeof(*m));
+
+	if (!m)
+		return NULL;
+
+	/* the root */
+	if (matcher_new_node(m) < 0) {
+		free(m);
+		return NULL;
+	}
+
+	return m;
+}
+
+void matcher_free(struct matcher *m)
+{
+	if (!m)
+		return;
+
+	free(m->nodes);
+	free(m);
+}
+
+/*
+ * Add a pattern reported with id, which must not be negative. Node 0 is the
+ * root, nothing ever goes to it in the trie, so 0 means "no edge" until
+ * matcher_compile() fills in the missing transitions. Adding a pattern twice
+ * keeps the first id.
+ */
+int matcher_add(struct matcher *m, const unsigned char *pattern, int len, int id)
+{
+	int i, node = 0;
+
+	if (len <= 0 || id < 0)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++) {
+		int next = m->nodes[node].next[pattern[i]];
+
+		if (!next) {
+			next = matcher_new_node(m);
+			if (next < 0)
+				return next;
+			m->nodes[node].next[pattern[i]] = next;
+		}
+		node = next;
+	}
+
+	if (m->nodes[node].id < 0)
+		m->nodes[node].id = id;
+
+	return 0;
+}
+
+/* compute the fail links and turn the trie into a DFA, breadth first */
+int matcher_compile(struct matcher *m)
+{
+	struct match_node *nodes = m->nodes;
+	int *queue, head = 0, tail = 0, c;
+
+	queue = malloc(m->num_nodes * sizeof(*queue));
+	if (!queue)
+		return -ENOMEM;
+
+	for (c = 0; c < 256; c++) {
+		int child = nodes[0].next[c];
+
+		if (child)
+			queue[tail++] = child;
+	}
+
+	while (head < tail) {
+		int node = queue[head++];
+		int fail = nodes[node].fail;
+
+		for (c = 0; c < 256; c++) {
+			int child = nodes[node].next[c];
+
+			if (!child) {
+				nodes[node].next[c] = nodes[fail].next[c];
+				continue;
+			}
+
+			/* the fail target is shallower, so it's complete already */
+			nodes[child].fail = nodes[fail].next[c];
+			nodes[child].dict = nodes[nodes[child].fail].id >= 0 ?
+				nodes[child].fail : nodes[nodes[child].fail].dict;
+			queue[tail++] = child;
+		}
+	}
+
+	free(queue);
+	m->state = 0;
+
+	return 0;
+}
+
+/* forget a partial match, e.g. when starting to wait for something new */
+void matcher_reset(struct matcher *m)
+{
+	m->state = 0;
+}
+
+/*
+ * Scan buf and call fn for every pattern found, with the ids of patterns that
+ * end at the same position reported longest first. When fn returns nonzero
+ * the scan stops after the current byte. Returns the number of bytes
+ * consumed.
+ */
+int matcher_feed(struct matcher *m, const unsigned char *buf, int len,
+		 int (*fn)(void *ctx, int id), void *ctx)
+{
+	const struct match_node *nodes = m->nodes;
+	int i, state = m->state;
+
+	for (i = 0; i < len; i++) {
+		int node, stop = 0;
+
+		state = nodes[state].next[buf[i]];
+		if (nodes[state].id < 0 && !nodes[state].dict)
+			continue;
+
+		for (node = state; node; node = nodes[node].dict)
+			if (nodes[node].id >= 0)
+				stop |= fn(ctx, nodes[node].id);
+
+		if (stop) {
+			m->state = state;
+			return i + 1;
+		}
+	}
+
+	m->state = state;
+
+	return len;
+}
@@ -0,0 +1,439 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * Test of the telnet stream compression (MCCP2), run by "make check".
+ *
+ * A local telnet server on the loopback interface offers COMPRESS2 and
+ * sends zlib compressed data to the telnet backend. The start of the
+ * compressed stream in the middle of a read and in a read of its own, its
+ * end with uncompressed data following, a reset after a broken stream and a
+ * lost connection in the middle of the compressed stream followed by a
+ * reconnect are checked, and the bytes/s the backend decompresses are
+ * reported.
+ */
+#include "telnet.c"
+#include "test.h"
+
+#include <poll.h>
+#include <sys/timerfd.h>
+
+/* what else telnet.c and net.c need from the rest of microcom */
+unsigned long current_speed = DEFAULT_BAUDRATE;
+int current_flow;
+
+void mux_add_source(struct mux_source *src)
+{
+}
+
+void mux_del_source(struct mux_source *src)
+{
+}
+
+int mux_timer_create(void)
+{
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+int mux_timer_arm(int fd, unsigned int ms)
+{
+	return 0;
+}
+
+void mux_timer_ack(int fd)
+{
+}
+
+void microcom_exit(int signal)
+{
+}
+
+#define THROUGHPUT_BYTES (64 * 1024 * 1024)
+#define CHUNK 16384
+
+/* the server side of a connection */
+struct server {
+	int listenfd;
+	int fd;
+	char hostport[32];
+	z_stream zs;
+	bool compressing;
+};
+
+static void server_listen(struct server *srv)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+	};
+	socklen_t len = sizeof(addr);
+
+	srv->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	assert(srv->listenfd >= 0);
+	assert(!bind(srv->listenfd, (struct sockaddr *)&addr, sizeof(addr)));
+	assert(!listen(srv->listenfd, 1));
+	assert(!getsockname(srv->listenfd, (struct sockaddr *)&addr, &len));
+
+	snprintf(srv->hostport, sizeof(srv->hostport), "127.0.0.1:%d",
+		 ntohs(addr.sin_port));
+	srv->fd = -1;
+}
+
+static void server_accept(struct server *srv)
+{
+	srv->fd = accept(srv->listenfd, NULL, NULL);
+	assert(srv->fd >= 0);
+	srv->compressing = false;
+}
+
+static void server_send(struct server *srv, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	ssize_t ret;
+
+	while (len) {
+		ret = send(srv->fd, p, len, MSG_NOSIGNAL);
+		assert(ret > 0);
+		p += ret;
+		len -= ret;
+	}
+}
+
+/* the start of the compressed stream, the rest of buf is compressed */
+static size_t server_start(struct server *srv, unsigned char *buf)
+{
+	static const unsigned char start[] = {
+		IAC, SB, TELNET_OPTION_COMPRESS2, IAC, SE
+	};
+
+	memset(&srv->zs, 0, sizeof(srv->zs));
+	assert(deflateInit(&srv->zs, Z_DEFAULT_COMPRESSION) == Z_OK);
+	srv->compressing = true;
+	memcpy(buf, start, sizeof(start));
+
+	return sizeof(start);
+}
+
+/* compress data into out, flush is Z_SYNC_FLUSH or Z_FINISH */
+static size_t server_deflate(struct server *srv, const void *data, size_t len,
+			     unsigned char *out, size_t size, int flush)
+{
+	z_stream *zs = &srv->zs;
+	int ret;
+
+	zs->next_in = (unsigned char *)data;
+	zs->avail_in = len;
+	zs->next_out = out;
+	zs->avail_out = size;
+
+	ret = deflate(zs, flush);
+	assert(ret == Z_OK || ret == Z_STREAM_END);
+	assert(!zs->avail_in && zs->avail_out);
+
+	if (flush == Z_FINISH) {
+		deflateEnd(zs);
+		srv->compressing = false;
+	}
+
+	return size - zs->avail_out;
+}
+
+static void server_close(struct server *srv)
+{
+	if (srv->compressing)
+		deflateEnd(&srv->zs);
+	srv->compressing = false;
+	close(srv->fd);
+	srv->fd = -1;
+}
+
+/*
+ * Read from the backend until want bytes came or nothing more does, at
+ * least once. The backend needs room for an incomplete command it keeps.
+ */
+static size_t client_read(struct ios_ops *ios, unsigned char *buf, size_t size,
+			  size_t want, int timeout_ms)
+{
+	struct pollfd pfd = { .fd = ios->fd, .events = POLLIN };
+	size_t done = 0;
+	ssize_t ret;
+
+	do {
+		if (!ios->pending(ios) && poll(&pfd, 1, timeout_ms) != 1)
+			break;
+
+		ret = ios->read(ios, buf + done, size - done);
+		if (ret < 0 && errno == EAGAIN)
+			continue;
+		if (ret <= 0)
+			break;
+		done += ret;
+	} while (done < want);
+
+	return done;
+}
+
+/* expect exactly str from the backend */
+static bool client_expect(struct ios_ops *ios, const char *str)
+{
+	unsigned char buf[CHUNK + 512];
+	size_t len = strlen(str), got;
+
+	got = client_read(ios, buf, sizeof(buf), len, 1000);
+
+	return got == len && !memcmp(buf, str, len);
+}
+
+static struct telnet_data *client_connect(struct server *srv)
+{
+	struct ios_ops *ios;
+
+	/* the backend keeps pointers into it for reconnecting */
+	ios = telnet_init(strdup(srv->hostport));
+	assert(ios);
+	server_accept(srv);
+
+	return container_of(ios, struct telnet_data, ios);
+}
+
+static void client_free(struct telnet_data *telnet)
+{
+	mccp_reset(telnet);
+	telnet_exit(&telnet->ios);
+	free(telnet->host);
+	free(telnet);
+}
+
+/* the server offers COMPRESS2, the backend has to agree */
+static void test_negotiate(struct server *srv, struct telnet_data *telnet)
+{
+	static const unsigned char will[] = { IAC, WILL, TELNET_OPTION_COMPRESS2 };
+	static const unsigned char reply[] = { IAC, DO, TELNET_OPTION_COMPRESS2 };
+	unsigned char buf[64];
+	ssize_t len = 0, ret;
+	bool found = false;
+	int i;
+
+	server_send(srv, "login: ", 7);
+	server_send(srv, will, sizeof(will));
+	check(client_expect(&telnet->ios, "login: "), "no data before WILL");
+
+	/* the backend's own negotiation comes first */
+	while (len < sizeof(buf)) {
+		struct pollfd pfd = { .fd = srv->fd, .events = POLLIN };
+
+		if (poll(&pfd, 1, 100) != 1)
+			break;
+		ret = recv(srv->fd, buf + len, sizeof(buf) - len, 0);
+		if (ret <= 0)
+			break;
+		len += ret;
+	}
+
+	for (i = 0; i + sizeof(reply) <= len; i++)
+		found |= !memcmp(buf + i, reply, sizeof(reply));
+	check(found, "no DO COMPRESS2");
+}
+
+/* the compressed stream starts in the middle of a read and ends in one */
+static void test_start_end(struct server *srv, struct telnet_data *telnet)
+{
+	unsigned char buf[1024];
+	size_t len;
+
+	memcpy(buf, "plain ", 6);
+	len = 6;
+	len += server_start(srv, buf + len);
+	len += server_deflate(srv, "compressed\n", 11, buf + len,
+			      sizeof(buf) - len, Z_SYNC_FLUSH);
+	server_send(srv, buf, len);
+
+	check(client_expect(&telnet->ios, "plain compressed\n"),
+	      "compressed data after the start in the same read");
+	check(telnet->mccp_active, "compression not started");
+
+	/* an escaped IAC, IAC commands are compressed too */
+	len = server_deflate(srv, "a\xff\xff" "b\n", 5, buf, sizeof(buf),
+			     Z_FINISH);
+	memcpy(buf + len, "uncompressed\n", 13);
+	len += 13;
+	server_send(srv, buf, len);
+
+	check(client_expect(&telnet->ios, "a\xff" "b\nuncompressed\n"),
+	      "uncompressed data after the end in the same read");
+	check(!telnet->mccp_active, "compression not ended");
+}
+
+/* the start split across reads, the compressed data in a read of its own */
+static void test_split_start(struct server *srv, struct telnet_data *telnet)
+{
+	unsigned char buf[1024];
+	size_t len;
+
+	len = server_start(srv, buf);
+	server_send(srv, buf, 2);
+	check(client_expect(&telnet->ios, ""), "data from IAC SB");
+	usleep(10000);
+	server_send(srv, buf + 2, len - 2);
+	check(client_expect(&telnet->ios, ""), "data from IAC SB COMPRESS2");
+	usleep(10000);
+
+	len = server_deflate(srv, "split\n", 6, buf, sizeof(buf), Z_SYNC_FLUSH);
+	server_send(srv, buf, len);
+	check(client_expect(&telnet->ios, "split\n"), "compressed data");
+
+	len = server_deflate(srv, "", 0, buf, sizeof(buf), Z_FINISH);
+	server_send(srv, buf, len);
+	server_send(srv, "done\n", 5);
+	check(client_expect(&telnet->ios, "done\n"), "data after the end");
+}
+
+/* a broken stream resets the decompression, it can start again */
+static void test_reset(struct server *srv, struct telnet_data *telnet)
+{
+	static const unsigned char garbage[] = { 0xff, 0xff, 0xff, 0xff, 0x00 };
+	unsigned char buf[1024];
+	size_t len;
+	ssize_t ret;
+
+	len = server_start(srv, buf);
+	memcpy(buf + len, garbage, sizeof(garbage));
+	server_send(srv, buf, len + sizeof(garbage));
+	deflateEnd(&srv->zs);
+	srv->compressing = false;
+
+	usleep(10000);
+	do {
+		ret = telnet->ios.read(&telnet->ios, buf, sizeof(buf));
+	} while (ret < 0 && errno == EAGAIN);
+	check(ret < 0 && errno == EIO, "broken stream not reported");
+	check(!telnet->mccp_active && !telnet->zs.avail_in,
+	      "compression not reset");
+
+	server_send(srv, "plain\n", 6);
+	check(client_expect(&telnet->ios, "plain\n"), "data after the reset");
+
+	len = server_start(srv, buf);
+	len += server_deflate(srv, "again\n", 6, buf + len, sizeof(buf) - len,
+			      Z_FINISH);
+	server_send(srv, buf, len);
+	check(client_expect(&telnet->ios, "again\n"), "compression restarted");
+}
+
+/* the connection is lost in the middle of the compressed stream */
+static void test_connection_lost(struct server *srv, struct telnet_data *telnet)
+{
+	struct ios_ops *ios = &telnet->ios;
+	struct pollfd pfd;
+	unsigned char buf[1024];
+	size_t len;
+	ssize_t ret;
+
+	reconnect_max_delay = DEFAULT_RECONNECT_MAX_DELAY;
+
+	len = server_start(srv, buf);
+	len += server_deflate(srv, "lost\n", 5, buf + len, sizeof(buf) - len,
+			      Z_SYNC_FLUSH);
+	server_send(srv, buf, len);
+	check(client_expect(ios, "lost\n"), "data before the loss");
+	/* half of a compressed block */
+	len = server_deflate(srv, "never seen\n", 11, buf, sizeof(buf),
+			     Z_SYNC_FLUSH);
+	server_send(srv, buf, len / 2);
+	server_close(srv);
+
+	pfd.fd = ios->fd;
+	pfd.events = POLLIN;
+	while (ios->fd >= 0 && poll(&pfd, 1, 1000) == 1)
+		ios->read(ios, buf, sizeof(buf));
+	check(ios->fd < 0, "connection loss not detected");
+	check(!telnet->mccp_active && !telnet->zs.avail_in,
+	      "compression not reset");
+
+	/* what the reconnect timer and the connect completion do */
+	telnet_reconnect(&telnet->reconnect);
+	server_accept(srv);
+	pfd.fd = telnet->connecting.fd;
+	pfd.events = POLLOUT;
+	check(pfd.fd >= 0 && poll(&pfd, 1, 1000) == 1, "no reconnect");
+	telnet_connected(&telnet->connecting);
+	check(ios->fd >= 0, "not reconnected");
+
+	server_send(srv, "back\n", 5);
+	check(client_expect(ios, "back\n"), "uncompressed after the reconnect");
+
+	len = server_start(srv, buf);
+	len += server_deflate(srv, "compressed\n", 11, buf + len,
+			      sizeof(buf) - len, Z_SYNC_FLUSH);
+	server_send(srv, buf, len);
+	check(client_expect(ios, "compressed\n"),
+	      "compression after the reconnect");
+
+	reconnect_max_delay = 0;
+}
+
+static void test_throughput(struct server *srv, struct telnet_data *telnet)
+{
+	static unsigned char data[CHUNK], out[2 * CHUNK], in[CHUNK + 512];
+	size_t done = 0, wire = 0, len;
+	double t;
+	int i;
+
+	/* log-like text, it compresses about as well as a console does */
+	for (i = 0, len = 0; len < sizeof(data); i++)
+		len += snprintf((char *)data + len, sizeof(data) - len,
+				"[%8d.%06d] eth0: link up, 100 Mbps full duplex\n",
+				i / 100, i * 997 % 1000000);
+
+	if (!srv->compressing) {
+		len = server_start(srv, out);
+		server_send(srv, out, len);
+	}
+
+	t = now();
+	while (done < THROUGHPUT_BYTES) {
+		len = server_deflate(srv, data, sizeof(data), out, sizeof(out),
+				     Z_SYNC_FLUSH);
+		server_send(srv, out, len);
+		wire += len;
+
+		len = client_read(&telnet->ios, in, sizeof(in), sizeof(data),
+				  1000);
+		if (len != sizeof(data) || memcmp(in, data, len)) {
+			check(0, "data corrupted after %zu bytes", done);
+			return;
+		}
+		done += len;
+	}
+	t = now() - t;
+
+	printf("mccp: %zu bytes (%zu compressed) in %.2f s, %.1f MB/s\n",
+	       done, wire, t, done / t / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+	struct server srv;
+	struct telnet_data *telnet;
+
+	server_listen(&srv);
+	telnet = client_connect(&srv);
+
+	test_negotiate(&srv, telnet);
+	test_start_end(&srv, telnet);
+	test_split_start(&srv, telnet);
+	test_reset(&srv, telnet);
+	test_connection_lost(&srv, telnet);
+	test_throughput(&srv, telnet);
+
+	client_free(telnet);
+	server_close(&srv);
+	close(srv.listenfd);
+
+	if (failures) {
+		printf("%d failures\n", failures);
+		return 1;
+	}
+
+	printf("all tests passed\n");
+
+	return 0;
+}
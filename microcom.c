@@ -50,6 +50,11 @@ void microcom_exit(int signal)
 {
 	write(1, "exiting\n", 8);
 
+	daemon_exit();
+	control_exit();
+	pty_bridge_exit();
+	ring_export_exit();
+	ring_capture_exit();
 	ios->exit(ios);
 	tcsetattr(STDIN_FILENO, TCSANOW, &sots);
 
@@ -57,6 +62,13 @@ void microcom_exit(int signal)
 		_Exit(0);
 }
 
+/* a cancelled CI job must not look like a passed script */
+static void batch_exit(int signal)
+{
+	microcom_exit(0);
+	_Exit(128 + signal);
+}
+
 /*
  * Main functions
  ********************************************************************
@@ -77,8 +89,47 @@ void main_usage(int exitcode, char *str, char *dev)
 		"    -p, --port=<devfile>                 use the specified serial port device (%s);\n"
 		"    -s, --speed=<speed>                  use specified baudrate (%d)\n"
 		"    -t, --telnet=<host:port>             work in telnet (rfc2217) mode\n"
-		"    -c, --can=<interface:rx_id:tx_id>    work in CAN mode\n"
+		"        --connect-timeout=<sec>          give up connecting after <sec> seconds (%d)\n"
+		"        --keepalive=<idle>[:<interval>]  TCP keepalive timing in seconds, 0 disables\n"
+		"                                         (%d:%d)\n"
+		"        --quickack                       disable delayed ACKs (TCP_QUICKACK)\n"
+		"        --reconnect[=<ms>]               reconnect when the connection is lost, retrying\n"
+		"                                         with backoff up to <ms> milliseconds (%d)\n"
+		"        --tcp=<host:port>                connect to a raw TCP socket\n"
+		"        --unix=<path>                    connect to a UNIX stream socket\n"
+		"        --exec=<command>                 run <command> and talk to its stdin/stdout\n"
+		"        --exec-pty                       connect the command via a pty instead of pipes\n"
+		"    -c, --can=<interface:rx_id:tx_id[:options]>\n"
+		"                                         work in CAN mode\n"
 		"                                         default: (%s:%x:%x)\n"
+		"                                         options: fd (use CAN FD frames),\n"
+		"                                         brs (CAN FD with bitrate switch),\n"
+		"                                         isotp (ISO 15765-2 transport),\n"
+		"                                         bs=<n>, stmin=<n>, pad=<xx> (ISO-TP settings)\n"
+		"                                         timestamp (prefix lines with the receive time),\n"
+		"                                         hwtimestamp (timestamp, switch on hw timestamping),\n"
+		"                                         bitrate=<n> (for the bus load in canstats)\n"
+		"        --can-channel=<rx_id:tx_id[:tag[:logfile]]>\n"
+		"                                         add a CAN channel with its own tag and logfile\n"
+		"        --pty=<link>                     make the port available as a pty at <link>\n"
+		"        --shm=<name>[:<size>]            export the received data in a shared memory ring\n"
+		"        --capture=<file>[:<size>]        keep the received data in a ring in a file\n"
+		"        --scrollback=<size>              keep the last <size> bytes (suffixes k and M) shown\n"
+		"                                         on the terminal, see the scrollback command\n"
+		"        --control=<socket>               accept automation requests on the UNIX socket\n"
+		"                                         <socket>, see the man page\n"
+		"        --triggers=<file>                react on patterns in the received data as listed\n"
+		"                                         in <file>, see the trigger command\n"
+		"        --run=<script>                   run <script> without a terminal and exit with its\n"
+		"                                         status\n"
+		"        --timeout=<sec>                  with --run, give up after <sec> seconds (exit\n"
+		"                                         status 124)\n"
+		"        --daemon[=<socket>]              run in the background without a terminal, clients\n"
+		"                                         attach via the UNIX socket <socket>\n"
+		"        --relay=<endpoint>               pass data between the port and <endpoint> without\n"
+		"                                         a terminal, one of: listen:[<host>:]<port>,\n"
+		"                                         tcp:<host:port>, unix:<path>, exec:<command>,\n"
+		"                                         pty:<link>\n"
 		"    -f, --force                          ignore existing lock file\n"
 		"    -d, --debug                          output debugging info\n"
 		"    -l, --logfile=<logfile>              log output to <logfile>\n"
@@ -90,6 +141,8 @@ void main_usage(int exitcode, char *str, char *dev)
 		"    -v, --version                        print version string\n"
 		"    -h, --help                           This help\n",
 		DEFAULT_DEVICE, DEFAULT_BAUDRATE,
+		DEFAULT_CONNECT_TIMEOUT, DEFAULT_KEEPALIVE_IDLE, DEFAULT_KEEPALIVE_INTERVAL,
+		DEFAULT_RECONNECT_MAX_DELAY,
 		DEFAULT_CAN_INTERFACE, DEFAULT_CAN_ID, DEFAULT_CAN_ID,
 		DEFAULT_ESCAPE_CHAR);
 	fprintf(stderr, "Exitcode %d - %s %s\n\n", exitcode, str, dev);
@@ -107,11 +160,46 @@ int main(int argc, char *argv[])
 	struct sigaction sact = {0};  /* used to initialize the signal handler */
 	int opt, ret;
 	char *hostport = NULL;
-	int telnet = 0, can = 0;
+	int telnet = 0, can = 0, tcp = 0, reconnect = 0;
+	char *unix_path = NULL;
+	char *command = NULL;
+	char *relay = NULL;
+	char *pty_link = NULL;
+	char *shm = NULL;
+	char *capture = NULL;
+	char *control = NULL;
+	char *scrollback = NULL;
+	char *triggers = NULL;
+	char *run = NULL;
+	unsigned int timeout = 0;
+	int daemon_mode = 0;
+	char *daemon_socket = NULL;
 	char *interfaceid = NULL;
 	char *device = DEFAULT_DEVICE;
 	char *logfile = NULL;
 
+	enum {
+		OPT_CONNECT_TIMEOUT = 256,
+		OPT_KEEPALIVE,
+		OPT_QUICKACK,
+		OPT_RECONNECT,
+		OPT_TCP,
+		OPT_UNIX,
+		OPT_EXEC,
+		OPT_EXEC_PTY,
+		OPT_CAN_CHANNEL,
+		OPT_RELAY,
+		OPT_PTY,
+		OPT_SHM,
+		OPT_CAPTURE,
+		OPT_CONTROL,
+		OPT_SCROLLBACK,
+		OPT_DAEMON,
+		OPT_TRIGGERS,
+		OPT_RUN,
+		OPT_TIMEOUT,
+	};
+
 	struct option long_options[] = {
 		{ "help", no_argument, NULL, 'h' },
 		{ "port", required_argument, NULL, 'p' },
@@ -124,6 +212,25 @@ int main(int argc, char *argv[])
 		{ "listenonly", no_argument, NULL, 'o' },
 		{ "answerback", required_argument, NULL, 'a' },
 		{ "version", no_argument, NULL, 'v' },
+		{ "connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT },
+		{ "keepalive", required_argument, NULL, OPT_KEEPALIVE },
+		{ "quickack", no_argument, NULL, OPT_QUICKACK },
+		{ "reconnect", optional_argument, NULL, OPT_RECONNECT },
+		{ "tcp", required_argument, NULL, OPT_TCP },
+		{ "unix", required_argument, NULL, OPT_UNIX },
+		{ "exec", required_argument, NULL, OPT_EXEC },
+		{ "exec-pty", no_argument, NULL, OPT_EXEC_PTY },
+		{ "can-channel", required_argument, NULL, OPT_CAN_CHANNEL },
+		{ "relay", required_argument, NULL, OPT_RELAY },
+		{ "pty", required_argument, NULL, OPT_PTY },
+		{ "shm", required_argument, NULL, OPT_SHM },
+		{ "capture", required_argument, NULL, OPT_CAPTURE },
+		{ "control", required_argument, NULL, OPT_CONTROL },
+		{ "scrollback", required_argument, NULL, OPT_SCROLLBACK },
+		{ "daemon", optional_argument, NULL, OPT_DAEMON },
+		{ "triggers", required_argument, NULL, OPT_TRIGGERS },
+		{ "run", required_argument, NULL, OPT_RUN },
+		{ "timeout", required_argument, NULL, OPT_TIMEOUT },
 		{ 0 },
 	};
 
@@ -175,6 +282,82 @@ int main(int argc, char *argv[])
 			}
 			escape_char = *optarg;
 			break;
+		case OPT_CONNECT_TIMEOUT:
+			connect_timeout = strtol(optarg, NULL, 0);
+			break;
+		case OPT_KEEPALIVE:
+		{
+			char *interval;
+
+			keepalive_idle = strtol(optarg, &interval, 0);
+			if (*interval == ':')
+				keepalive_interval = strtol(interval + 1, NULL, 0);
+			break;
+		}
+		case OPT_QUICKACK:
+			tcp_quickack = 1;
+			break;
+		case OPT_TCP:
+			tcp = 1;
+			hostport = optarg;
+			break;
+		case OPT_UNIX:
+			unix_path = optarg;
+			break;
+		case OPT_EXEC:
+			command = optarg;
+			break;
+		case OPT_EXEC_PTY:
+			exec_pty = 1;
+			break;
+		case OPT_CAN_CHANNEL:
+#ifdef USE_CAN
+			if (can_add_channel(optarg))
+				exit(EXIT_FAILURE);
+#endif
+			can = 1;
+			break;
+		case OPT_RELAY:
+			relay = optarg;
+			break;
+		case OPT_PTY:
+			pty_link = optarg;
+			break;
+		case OPT_SHM:
+			shm = optarg;
+			break;
+		case OPT_CAPTURE:
+			capture = optarg;
+			break;
+		case OPT_CONTROL:
+			control = optarg;
+			break;
+		case OPT_SCROLLBACK:
+			scrollback = optarg;
+			break;
+		case OPT_DAEMON:
+			daemon_mode = 1;
+			daemon_socket = optarg;
+			listenonly = 1;
+			break;
+		case OPT_TRIGGERS:
+			triggers = optarg;
+			break;
+		case OPT_RUN:
+			run = optarg;
+			listenonly = 1;
+			/* keep messages in order with the data in a CI log */
+			setvbuf(stdout, NULL, _IOLBF, 0);
+			break;
+		case OPT_TIMEOUT:
+			timeout = strtoul(optarg, NULL, 0);
+			break;
+		case OPT_RECONNECT:
+			reconnect = 1;
+			reconnect_max_delay = DEFAULT_RECONNECT_MAX_DELAY;
+			if (optarg)
+				reconnect_max_delay = strtol(optarg, NULL, 0);
+			break;
 		}
 	}
 
@@ -182,13 +365,49 @@ int main(int argc, char *argv[])
 		main_usage(1, "", "");
 
 	commands_init();
+	script_init();
+	trigger_init();
+	transfer_init();
 	commands_fsl_imx_init();
 
-	if (telnet && can)
+	if (triggers && trigger_load(triggers))
+		exit(1);
+
+	if (telnet + can + tcp + !!unix_path + !!command > 1)
 		main_usage(1, "", "");
 
+	if (relay && pty_link)
+		main_usage(1, "--pty is not supported in relay mode", "");
+
+	if (relay && control)
+		main_usage(1, "--control is not supported in relay mode", "");
+
+	if (relay && daemon_mode)
+		main_usage(1, "--daemon and --relay are exclusive", "");
+
+	if (relay && reconnect)
+		main_usage(1, "--reconnect is not supported in relay mode", "");
+
+	if (run && (relay || daemon_mode))
+		main_usage(1, "--run can't be combined with --relay or --daemon", "");
+
+	if (timeout && !run)
+		main_usage(1, "--timeout requires --run", "");
+
+	if (reconnect && reconnect_max_delay <= 0)
+		main_usage(1, "--reconnect needs a delay above 0", "");
+
+	if (reconnect && !telnet)
+		main_usage(1, "--reconnect is only supported with --telnet", "");
+
 	if (telnet)
 		ios = telnet_init(hostport);
+	else if (tcp)
+		ios = tcp_init(hostport);
+	else if (unix_path)
+		ios = unix_init(unix_path);
+	else if (command)
+		ios = exec_init(command);
 	else if (can) {
 #ifdef USE_CAN
 		ios = can_init(interfaceid);
@@ -215,6 +434,87 @@ int main(int argc, char *argv[])
 	current_flow = FLOW_NONE;
 	ios->set_flow(ios, current_flow);
 
+	if (pty_link) {
+		ret = pty_bridge_init(pty_link);
+		if (ret)
+			goto cleanup_ios;
+	}
+
+	if (shm) {
+		ret = ring_export_init(shm);
+		if (ret)
+			goto cleanup_ios;
+	}
+
+	if (capture) {
+		ret = ring_capture_init(capture);
+		if (ret)
+			goto cleanup_ios;
+	}
+
+	if (scrollback) {
+		ret = scrollback_init(scrollback);
+		if (ret)
+			goto cleanup_ios;
+	}
+
+	if (control) {
+		ret = control_init(control);
+		if (ret)
+			goto cleanup_ios;
+	}
+
+	if (daemon_mode) {
+		/* no terminal to restore, keep it as it is */
+		tcgetattr(STDIN_FILENO, &sots);
+
+		sact.sa_handler = &microcom_exit;
+		sigaction(SIGINT, &sact, NULL);
+		sigaction(SIGTERM, &sact, NULL);
+		sigaction(SIGQUIT, &sact, NULL);
+
+		/* clients going away are handled by daemon.c */
+		sact.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &sact, NULL);
+
+		ret = daemon_init(daemon_socket);
+		if (ret)
+			goto cleanup_ios;
+	}
+
+	if (run) {
+		/* the terminal is left alone, stdin may not even be one */
+		tcgetattr(STDIN_FILENO, &sots);
+
+		sact.sa_handler = &batch_exit;
+		sigaction(SIGHUP, &sact, NULL);
+		sigaction(SIGINT, &sact, NULL);
+		sigaction(SIGTERM, &sact, NULL);
+		sigaction(SIGQUIT, &sact, NULL);
+
+		ret = script_batch(run, timeout * 1000);
+		if (ret)
+			goto cleanup_ios;
+	}
+
+	if (relay) {
+		/* no terminal to restore, keep it as it is */
+		tcgetattr(STDIN_FILENO, &sots);
+
+		sact.sa_handler = &microcom_exit;
+		sigaction(SIGHUP, &sact, NULL);
+		sigaction(SIGINT, &sact, NULL);
+		sigaction(SIGTERM, &sact, NULL);
+		sigaction(SIGQUIT, &sact, NULL);
+
+		/* a client going away is handled by relay_loop() */
+		sact.sa_handler = SIG_IGN;
+		sigaction(SIGPIPE, &sact, NULL);
+
+		ret = relay_loop(ios, relay);
+		goto cleanup_ios;
+	}
+
 	if (!listenonly) {
 		printf("Escape character: Ctrl-%c\n", escape_char);
 		printf("Type the escape character to get to the prompt.\n");
@@ -240,7 +540,13 @@ int main(int argc, char *argv[])
 		tcsetattr(STDIN_FILENO, TCSANOW, &sots);
 
 cleanup_ios:
+	daemon_exit();
+	control_exit();
+	pty_bridge_exit();
+	ring_export_exit();
+	ring_capture_exit();
 	ios->exit(ios);
 
-	exit(ret ? 1 : 0);
+	/* the status of a script run with --run */
+	exit(ret < 0 ? 1 : ret);
 }
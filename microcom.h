@@ -26,6 +26,8 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <signal.h>
 #include <string.h>
@@ -39,6 +41,10 @@
 #define DEFAULT_CAN_INTERFACE "can0"
 #define DEFAULT_CAN_ID (0x200)
 #define DEFAULT_ESCAPE_CHAR ('\\')
+#define DEFAULT_CONNECT_TIMEOUT 10
+#define DEFAULT_KEEPALIVE_IDLE 60
+#define DEFAULT_KEEPALIVE_INTERVAL 10
+#define DEFAULT_RECONNECT_MAX_DELAY 2000
 
 struct ios_ops {
 	ssize_t (*write)(struct ios_ops *, const unsigned char *buf, size_t count);
@@ -53,16 +59,92 @@ struct ios_ops {
 	int (*set_handshake_line)(struct ios_ops *, int pin, int enable);
 	int (*send_break)(struct ios_ops *);
 	void (*exit)(struct ios_ops *);
+	/* optional: data is buffered in the backend, call read without waiting */
+	int (*pending)(struct ios_ops *);
+	/* optional: the fd written to if it's not fd */
+	int (*write_fd)(struct ios_ops *);
 	int fd;
+	/* read and write are plain read()/write() on fd, data may be spliced */
+	bool raw;
 };
 
 int mux_loop(struct ios_ops *); /* mux.c */
+
+/* additional file descriptors watched by mux_loop() */
+struct mux_source {
+	int fd;
+	int (*handler)(struct mux_source *);
+	bool write;	/* wait until fd is writable instead of readable */
+	struct mux_source *next;
+};
+
+/* produces data for the port, called by mux_loop() when it's writable */
+struct mux_writer {
+	int (*write)(struct mux_writer *);
+};
+
+void mux_add_source(struct mux_source *src);
+void mux_set_writer(struct mux_writer *writer);
+void mux_stop(int status);
+void mux_del_source(struct mux_source *src);
+int mux_timer_create(void);
+int mux_timer_arm(int fd, unsigned int ms);
+void mux_timer_ack(int fd);
+void mux_event(const char *format, ...) __attribute__((format(printf, 1, 2)));
 void init_terminal(void);
 void restore_terminal(void);
 
 struct ios_ops *telnet_init(char *hostport);
+extern int reconnect_max_delay;
 struct ios_ops *serial_init(char *dev);
 struct ios_ops *can_init(char *interfaceid);
+int can_add_channel(char *spec);
+struct ios_ops *tcp_init(char *hostport);
+struct ios_ops *unix_init(char *path);
+struct ios_ops *exec_init(char *command);
+int tcp_listen(char *hostport);
+struct ios_ops *tcp_accept(int listenfd);
+int relay_loop(struct ios_ops *ios, char *endpoint);
+int pty_open(int *master, int *slave);
+int pty_bridge_init(char *link);
+struct ios_ops *pty_endpoint_init(char *link);
+void pty_bridge_write(const unsigned char *buf, int len);
+void pty_bridge_exit(void);
+size_t ring_parse_size(const char *str);
+int ring_export_init(char *spec);
+void ring_export_write(const unsigned char *buf, int len);
+bool ring_export_enabled(void);
+void ring_export_exit(void);
+int ring_capture_init(char *spec);
+void ring_capture_write(const unsigned char *buf, int len);
+bool ring_capture_enabled(void);
+int ring_capture_timer(void);
+void ring_capture_timeout(void);
+void ring_capture_exit(void);
+int daemon_init(char *path);
+void daemon_clients_write(const unsigned char *buf, int len);
+void daemon_exit(void);
+int scrollback_init(const char *spec);
+void scrollback_write(const unsigned char *buf, int len);
+int control_init(char *path);
+void control_receive(const unsigned char *buf, int len);
+void control_event(const char *msg, int len);
+void control_exit(void);
+extern int exec_pty;
+
+/* net.c */
+int net_parse_hostport(char *hostport, char **host, char **port,
+		       char *default_port);
+int net_connect(const char *host, const char *port, int timeout_ms);
+int net_connect_start(const char *host, const char *port, unsigned int attempt);
+int net_connect_finish(int fd);
+int net_peer_name(int fd, char *buf, size_t len);
+void net_setup_socket(int fd);
+void net_quickack(int fd);
+extern int connect_timeout;
+extern int keepalive_idle;
+extern int keepalive_interval;
+extern int tcp_quickack;
 
 void microcom_exit(int signal);
 
@@ -83,12 +165,25 @@ struct cmd {
 	struct cmd *next;
 	char *info;
 	char *help;
+	/* optional: more names for the command, NULL terminated */
+	const char *const *aliases;
+	/* optional: completion of the first argument, NULL terminated */
+	const char *const *values;
+	/* optional: readline generator for the (other) arguments */
+	char *(*complete)(const char *text, int state);
 };
 
 int logfile_open(const char *path);
 void logfile_close(void);
+int logfile_reopen(void);
+void logfile_write(const unsigned char *buf, int len);
+int logfile_fd(void);
+unsigned long long keyboard_dropped(void);
 
 int register_command(struct cmd *cmd);
+struct cmd *find_command(const char *name);
+char *complete_file(const char *text, int state);
+char *complete_command(const char *text, int state);
 #define MICROCOM_CMD_START 100
 #define MICROCOM_CMD_USAGE 101
 extern struct cmd *commands;
@@ -96,7 +191,52 @@ extern struct cmd *commands;
 #define for_each_command(cmd) for (cmd = commands; cmd; cmd = cmd->next)
 
 void commands_init(void);
+void script_init(void);
+void trigger_init(void);
+int trigger_load(const char *path);
+void trigger_receive(const unsigned char *buf, int len);
+void script_transfer_done(int err);
+const char *script_name(void);
+
+/* transfer.c */
+struct transfer {
+	const char *proto;
+	char *path;
+	bool send;
+	off_t size;		/* -1 if unknown */
+	off_t done;
+	/* data from the port, returns the number of bytes consumed */
+	int (*receive)(struct transfer *t, const unsigned char *buf, int len);
+	void (*timeout)(struct transfer *t);
+	/* optional, called when the port is writable, see transfer_want_write() */
+	int (*write)(struct transfer *t);
+	void (*free)(struct transfer *t);
+	struct mux_source timer;
+	struct mux_writer writer;
+	struct timespec start;
+	struct timespec last_progress;
+};
+
+void transfer_init(void);
+int transfer_start(struct transfer *t);
+void transfer_finish(struct transfer *t, int err);
+void transfer_abort(struct transfer *t, int err);
+void transfer_set_timeout(struct transfer *t, unsigned int ms);
+void transfer_want_write(struct transfer *t, bool enable);
+void transfer_progress(struct transfer *t);
+bool transfer_active(void);
+struct transfer *transfer_current(void);
+int transfer_receive(const unsigned char *buf, int len);
+uint16_t crc16_ccitt(uint16_t crc, const unsigned char *buf, size_t len);
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len);
+int zmodem_send(char *path);
+
+/* sendfile.c */
+int sendfile_start(char *path, unsigned int char_ms, unsigned int line_ms);
 void commands_fsl_imx_init(void);
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
 #define ARRAY_SIZE(arr)            (sizeof(arr) / sizeof((arr)[0]))
 
 /*
@@ -118,8 +258,28 @@ void commands_fsl_imx_init(void);
 
 extern unsigned long current_speed;
 extern int current_flow;
-int do_commandline(void);
+#define MAXARGS 64
+int commandline_parse(char *line, int *argc, char *argv[]);
+int commandline_run(char *cmd);
+void do_commandline(void);
+bool commandline_active(void);
+void commandline_read_char(void);
 int do_script(char *script);
+/* like timeout(1) */
+#define SCRIPT_BATCH_TIMEOUT 124
+int script_batch(char *path, unsigned int timeout_ms);
+void script_receive(const unsigned char *buf, int len);
+int str_unescape(char *str);
+
+/* match.c */
+struct matcher;
+struct matcher *matcher_new(void);
+void matcher_free(struct matcher *m);
+int matcher_add(struct matcher *m, const unsigned char *pattern, int len, int id);
+int matcher_compile(struct matcher *m);
+void matcher_reset(struct matcher *m);
+int matcher_feed(struct matcher *m, const unsigned char *buf, int len,
+		 int (*fn)(void *ctx, int id), void *ctx);
 
 #define dbg_printf(...) ({ if (debug) printf(__VA_ARGS__); })
 
@@ -132,6 +292,7 @@ int do_script(char *script);
 #define TELNET_OPTION_ECHO                              1
 #define TELNET_OPTION_SUPPRESS_GO_AHEAD                 3
 #define TELNET_OPTION_COM_PORT_CONTROL                  44
+#define TELNET_OPTION_COMPRESS2                         86
 
 /* RFC2217 */
 #define SET_BAUDRATE_CS           1
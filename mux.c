@@ -4,20 +4,149 @@
 
 #include "microcom.h"
 #include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/timerfd.h>
 
-#define BUFSIZE 1024
+#define BUFSIZE 4096
 
 static int logfd = -1;
+static char *logpath;
 char *answerback;
 
+static struct mux_source *sources;
+/* changes whenever a source is removed, see mux_loop() */
+static unsigned int sources_gen;
+static struct mux_writer *writer;
+static int stop_status = -1;
+
+void mux_add_source(struct mux_source *src)
+{
+	src->next = sources;
+	sources = src;
+}
+
+void mux_del_source(struct mux_source *src)
+{
+	struct mux_source **p;
+
+	for (p = &sources; *p; p = &(*p)->next) {
+		if (*p == src) {
+			*p = src->next;
+			sources_gen++;
+			return;
+		}
+	}
+}
+
+/* at most one writer at a time, NULL removes it */
+void mux_set_writer(struct mux_writer *w)
+{
+	writer = w;
+}
+
+/* make mux_loop() return status, e.g. when a batch script is done */
+void mux_stop(int status)
+{
+	stop_status = status;
+}
+
+int mux_timer_create(void)
+{
+	return timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+/* arm a timer created with mux_timer_create(), 0 disarms it */
+int mux_timer_arm(int fd, unsigned int ms)
+{
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = ms / 1000,
+			.tv_nsec = (ms % 1000) * 1000000,
+		},
+	};
+
+	return timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* acknowledge an expired timer */
+void mux_timer_ack(int fd)
+{
+	uint64_t expirations;
+
+	read(fd, &expirations, sizeof(expirations));
+}
+
+/*
+ * Output received while the command prompt is open, shown when it's closed.
+ * If there is more, the oldest part is dropped, it is still in the logfile.
+ */
+#define HOLD_SIZE (256 * 1024)
+
+static unsigned char *hold_buf;
+static size_t hold_len, hold_dropped;
+
+static void hold_output(const unsigned char *buf, size_t len)
+{
+	size_t drop;
+
+	if (!hold_buf) {
+		hold_buf = malloc(HOLD_SIZE);
+		if (!hold_buf) {
+			hold_dropped += len;
+			return;
+		}
+	}
+
+	if (len > HOLD_SIZE) {
+		hold_dropped += len - HOLD_SIZE;
+		buf += len - HOLD_SIZE;
+		len = HOLD_SIZE;
+	}
+
+	if (hold_len + len > HOLD_SIZE) {
+		drop = hold_len + len - HOLD_SIZE;
+		memmove(hold_buf, hold_buf + drop, hold_len - drop);
+		hold_len -= drop;
+		hold_dropped += drop;
+	}
+
+	memcpy(hold_buf + hold_len, buf, len);
+	hold_len += len;
+}
+
+static void release_output(void)
+{
+	char msg[128];
+	int len;
+
+	if (hold_dropped) {
+		len = snprintf(msg, sizeof(msg),
+			       "[%zu bytes received at the prompt not shown]\r\n",
+			       hold_dropped);
+		write(STDOUT_FILENO, msg, len);
+	}
+
+	if (hold_len)
+		write(STDOUT_FILENO, hold_buf, hold_len);
+
+	hold_len = 0;
+	hold_dropped = 0;
+}
+
 static void write_receive_buf(const unsigned char *buf, int len)
 {
 	if (len <= 0)
 		return;
 
-	write(STDOUT_FILENO, buf, len);
+	if (commandline_active())
+		hold_output(buf, len);
+	else
+		write(STDOUT_FILENO, buf, len);
 	if (logfd >= 0)
 		write(logfd, buf, len);
+	scrollback_write(buf, len);
+	daemon_clients_write(buf, len);
 }
 
 static int handle_receive_buf(struct ios_ops *ios, unsigned char *buf, int len)
@@ -50,6 +179,26 @@ static int handle_receive_buf(struct ios_ops *ios, unsigned char *buf, int len)
 	return 0;
 }
 
+/* keyboard input the port didn't take, see keyboard_write() */
+static unsigned long long kbd_dropped;
+
+unsigned long long keyboard_dropped(void)
+{
+	return kbd_dropped;
+}
+
+/*
+ * The port may not take everything, e.g. a CAN interface while the bus is
+ * off. Nobody retypes that, so it is dropped and counted instead of waiting.
+ */
+static void keyboard_write(struct ios_ops *ios, unsigned char *buf, int len)
+{
+	ssize_t ret = ios->write(ios, buf, len);
+
+	if (ret < len)
+		kbd_dropped += len - max(ret, (ssize_t)0);
+}
+
 /* handle escape characters, writing to output */
 static void cook_buf(struct ios_ops *ios, unsigned char *buf, int num)
 {
@@ -61,8 +210,9 @@ static void cook_buf(struct ios_ops *ios, unsigned char *buf, int num)
 		while ((current < num) && (buf[current] != CTRL(escape_char)))
 			current++;
 		/* and write the sequence before esc char to the comm port */
-		if (current)
-			ios->write(ios, buf, current);
+		/* the keyboard would disturb a file transfer */
+		if (current && !transfer_active())
+			keyboard_write(ios, buf, current);
 
 		if (current < num) { /* process an escape sequence */
 			/* found an escape character */
@@ -75,6 +225,45 @@ static void cook_buf(struct ios_ops *ios, unsigned char *buf, int num)
 	}                       /* while - end of processing all the charactes in the buffer */
 }
 
+/* write to the logfile only, e.g. data passed through in relay mode */
+void logfile_write(const unsigned char *buf, int len)
+{
+	if (logfd >= 0 && len > 0)
+		write(logfd, buf, len);
+}
+
+int logfile_fd(void)
+{
+	return logfd;
+}
+
+/*
+ * Report an event that is not part of the received data, e.g. a lost
+ * connection. It is shown on the terminal and written to the logfile, so
+ * gaps in a capture are visible.
+ */
+void mux_event(const char *format, ...)
+{
+	char buf[256], date[64];
+	time_t now = time(NULL);
+	va_list args;
+	int start, len;
+
+	strftime(date, sizeof(date), "%F %T", localtime(&now));
+
+	start = snprintf(buf, sizeof(buf), "\r\n[microcom %s: ", date);
+
+	va_start(args, format);
+	len = start + vsnprintf(buf + start, sizeof(buf) - start, format, args);
+	va_end(args);
+
+	len = min(len, (int)sizeof(buf) - 4);
+	control_event(buf + start, len - start);
+	len += sprintf(buf + len, "]\r\n");
+
+	write_receive_buf((unsigned char *)buf, len);
+}
+
 void logfile_close(void)
 {
 	if (logfd >= 0)
@@ -97,6 +286,26 @@ int logfile_open(const char *path)
 		logfile_close();
 
 	logfd = fd;
+	free(logpath);
+	logpath = strdup(path);
+
+	return 0;
+}
+
+/* open the logfile again after it was moved away, appending if it exists */
+int logfile_reopen(void)
+{
+	int fd;
+
+	if (!logpath)
+		return 0;
+
+	fd = open(logpath, O_CREAT | O_APPEND | O_WRONLY, 0644);
+	if (fd < 0)
+		return fd;
+
+	logfile_close();
+	logfd = fd;
 
 	return 0;
 }
@@ -105,20 +314,67 @@ int logfile_open(const char *path)
 int mux_loop(struct ios_ops *ios)
 {
 	fd_set ready;   /* used for select */
+	fd_set writable;
 	int i = 0, len; /* used in the multiplex loop */
 	unsigned char buf[BUFSIZE];
 
-	while (1) {
-		int ret;
+	while (stop_status < 0) {
+		struct mux_source *src, *next;
+		struct timeval zero = { 0 };
+		int ret, maxfd = ios->fd;
+		int pending = ios->pending && ios->pending(ios);
+		int wfd = ios->write_fd ? ios->write_fd(ios) : ios->fd;
 
 		FD_ZERO(&ready);
+		FD_ZERO(&writable);
+		if (writer && wfd >= 0) {
+			FD_SET(wfd, &writable);
+			maxfd = max(maxfd, wfd);
+		}
 		if (!listenonly)
 			FD_SET(STDIN_FILENO, &ready);
-		FD_SET(ios->fd, &ready);
+		if (ios->fd >= 0)
+			FD_SET(ios->fd, &ready);
+
+		for (src = sources; src; src = src->next) {
+			FD_SET(src->fd, src->write ? &writable : &ready);
+			maxfd = max(maxfd, src->fd);
+		}
+
+		ret = select(maxfd + 1, &ready, &writable, NULL, pending ? &zero : NULL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			fprintf(stderr, "select: %s\n", strerror(-ret));
+			return ret;
+		}
 
-		select(ios->fd + 1, &ready, NULL, NULL, NULL);
+		/*
+		 * A handler may remove any source, e.g. a command from the
+		 * control socket stopping a transfer, and the saved next with
+		 * it. Then start over, the sources handled already are no
+		 * longer marked ready.
+		 */
+		for (src = sources; src; src = next) {
+			fd_set *set = src->write ? &writable : &ready;
+			unsigned int gen = sources_gen;
 
-		if (FD_ISSET(ios->fd, &ready)) {
+			next = src->next;
+
+			if (!FD_ISSET(src->fd, set))
+				continue;
+
+			FD_CLR(src->fd, set);
+			ret = src->handler(src);
+			if (ret < 0)
+				return ret;
+
+			if (gen != sources_gen)
+				next = sources;
+		}
+
+		if (ios->fd >= 0 && (pending || FD_ISSET(ios->fd, &ready))) {
 			/* pf has characters for us */
 			len = ios->read(ios, buf, BUFSIZE);
 			if (len < 0) {
@@ -131,15 +387,39 @@ int mux_loop(struct ios_ops *ios)
 				fprintf(stderr, "Got EOF from port\n");
 				return -EINVAL;
 			} else {
-				i = handle_receive_buf(ios, buf, len);
+				/* a file transfer takes the data, there may be a rest */
+				unsigned char *p = buf;
+
+				i = transfer_receive(p, len);
+				p += i;
+				len -= i;
+
+				pty_bridge_write(p, len);
+				ring_export_write(p, len);
+				ring_capture_write(p, len);
+				control_receive(p, len);
+				i = handle_receive_buf(ios, p, len);
 				if (i < 0) {
 					fprintf(stderr, "%s\n", strerror(-i));
 					return i;
 				}
+				script_receive(p, len);
+				trigger_receive(p, len);
 			}
 		}
 
-		if (!listenonly && FD_ISSET(STDIN_FILENO, &ready)) {
+		if (writer && wfd >= 0 && FD_ISSET(wfd, &writable)) {
+			ret = writer->write(writer);
+			if (ret < 0)
+				return ret;
+		}
+
+		if (!listenonly && FD_ISSET(STDIN_FILENO, &ready) &&
+		    commandline_active()) {
+			commandline_read_char();
+			if (!commandline_active())
+				release_output();
+		} else if (!listenonly && FD_ISSET(STDIN_FILENO, &ready)) {
 			/* standard input has characters for us */
 			i = read(STDIN_FILENO, buf, BUFSIZE);
 			if (i < 0) {
@@ -155,4 +435,6 @@ int mux_loop(struct ios_ops *ios)
 			cook_buf(ios, buf, i);
 		}
 	}
+
+	return stop_status;
 }
@@ -0,0 +1,424 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "microcom.h"
+
+/* RFC 8305: delay between two connection attempts */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+int connect_timeout = DEFAULT_CONNECT_TIMEOUT;
+int keepalive_idle = DEFAULT_KEEPALIVE_IDLE;
+int keepalive_interval = DEFAULT_KEEPALIVE_INTERVAL;
+int tcp_quickack;
+
+/*
+ * Split a "host:port" or "[host]:port" string in place. If no port is given,
+ * default_port is used.
+ */
+int net_parse_hostport(char *hostport, char **host, char **port,
+		       char *default_port)
+{
+	char *s;
+
+	if (hostport[0] == '[') {
+		s = strchr(++hostport, ']');
+		if (!s)
+			return -EINVAL;
+
+		/* terminate hostport after host portion */
+		*s = '\0';
+
+		if (s[1] == ':')
+			*port = s + 2;
+		else if (s[1] == '\0')
+			*port = default_port;
+		else
+			return -EINVAL;
+	} else {
+		s = strchr(hostport, ':');
+		if (s) {
+			/* terminate hostport after host portion */
+			*s = '\0';
+			*port = s + 1;
+		} else {
+			*port = default_port;
+		}
+	}
+
+	*host = hostport;
+
+	return 0;
+}
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int set_nonblock(int fd, int enable)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		return flags;
+
+	if (enable)
+		flags |= O_NONBLOCK;
+	else
+		flags &= ~O_NONBLOCK;
+
+	return fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * Tune a connected TCP socket for interactive use: disable Nagle so single
+ * keystrokes are sent immediately and enable keepalive to notice dead peers.
+ */
+void net_setup_socket(int fd)
+{
+	int one = 1;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)))
+		dbg_printf("TCP_NODELAY: %s\n", strerror(errno));
+
+	if (keepalive_idle > 0) {
+		if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one)) ||
+		    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive_idle,
+			       sizeof(keepalive_idle)) ||
+		    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &keepalive_interval,
+			       sizeof(keepalive_interval)))
+			dbg_printf("keepalive: %s\n", strerror(errno));
+	}
+
+	net_quickack(fd);
+}
+
+/*
+ * TCP_QUICKACK is not permanent, the kernel may fall back to delayed ACKs
+ * at any time. So this has to be called again after each read.
+ */
+void net_quickack(int fd)
+{
+	int one = 1;
+
+	if (tcp_quickack)
+		setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+}
+
+/*
+ * Sort the addresses such that address families alternate as suggested by
+ * RFC 8305. The first family returned by getaddrinfo() keeps precedence.
+ */
+static int sort_addresses(struct addrinfo *addrinfo, struct addrinfo ***sorted)
+{
+	struct addrinfo *ai, **list;
+	int n = 0, i, j, k;
+
+	for (ai = addrinfo; ai; ai = ai->ai_next)
+		n++;
+
+	list = calloc(n, sizeof(*list));
+	if (!list)
+		return -ENOMEM;
+
+	for (ai = addrinfo, i = 0; ai; ai = ai->ai_next)
+		list[i++] = ai;
+
+	/* find the next address of another family and move it up front */
+	for (i = 1; i < n; i++) {
+		if (list[i]->ai_family != list[i - 1]->ai_family)
+			continue;
+
+		for (j = i + 1; j < n; j++)
+			if (list[j]->ai_family != list[i - 1]->ai_family)
+				break;
+		if (j == n)
+			break;
+
+		ai = list[j];
+		for (k = j; k > i; k--)
+			list[k] = list[k - 1];
+		list[i] = ai;
+	}
+
+	*sorted = list;
+
+	return n;
+}
+
+/*
+ * The addresses of the host last connected to, sorted by sort_addresses().
+ * Reconnecting uses them, getaddrinfo() would block the main loop, for the
+ * whole resolver timeout while DNS is down.
+ */
+static struct {
+	char *host;
+	char *port;
+	struct addrinfo *addrinfo;
+	struct addrinfo **addrs;
+	int naddrs;
+} resolved;
+
+static void net_forget(void)
+{
+	free(resolved.host);
+	free(resolved.port);
+	free(resolved.addrs);
+	if (resolved.addrinfo)
+		freeaddrinfo(resolved.addrinfo);
+	memset(&resolved, 0, sizeof(resolved));
+}
+
+/* look up host:port into resolved, returns 0 or a getaddrinfo() error */
+static int net_resolve(const char *host, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_ADDRCONFIG,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *addrinfo, **addrs;
+	int naddrs, ret;
+
+	ret = getaddrinfo(host, port, &hints, &addrinfo);
+	if (ret)
+		return ret;
+
+	naddrs = sort_addresses(addrinfo, &addrs);
+	if (naddrs < 0) {
+		freeaddrinfo(addrinfo);
+		return EAI_MEMORY;
+	}
+
+	net_forget();
+	resolved.host = strdup(host);
+	resolved.port = strdup(port);
+	resolved.addrinfo = addrinfo;
+	resolved.addrs = addrs;
+	resolved.naddrs = naddrs;
+
+	return 0;
+}
+
+/* format the address of the connected peer as "host (port port)" */
+int net_peer_name(int fd, char *buf, size_t len)
+{
+	char host[256], port[30];
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int ret;
+
+	if (getpeername(fd, (struct sockaddr *)&addr, &addrlen))
+		return -errno;
+
+	ret = getnameinfo((struct sockaddr *)&addr, addrlen,
+			  host, sizeof(host), port, sizeof(port),
+			  NI_NUMERICHOST | NI_NUMERICSERV);
+	if (ret) {
+		fprintf(stderr, "getnameinfo: %s\n", gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	snprintf(buf, len, "%s (port %s)", host, port);
+
+	return 0;
+}
+
+/*
+ * Start a non-blocking connect to host:port for the main loop, which waits
+ * for the socket to become writable and calls net_connect_finish(). Each
+ * attempt takes the next address in the order of net_connect(), so an
+ * unreachable one doesn't block the others. The addresses net_connect()
+ * resolved for host:port are used, host is only looked up if there are none.
+ *
+ * Returns the socket or a negative error code.
+ */
+int net_connect_start(const char *host, const char *port, unsigned int attempt)
+{
+	struct addrinfo *ai;
+	int fd, ret;
+
+	if (!resolved.addrinfo || strcmp(resolved.host, host) ||
+	    strcmp(resolved.port, port)) {
+		ret = net_resolve(host, port);
+		if (ret) {
+			dbg_printf("getaddrinfo: %s\n", gai_strerror(ret));
+			return -EINVAL;
+		}
+	}
+
+	ai = resolved.addrs[attempt % resolved.naddrs];
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    ai->ai_protocol);
+	if (fd < 0) {
+		ret = -errno;
+	} else if (connect(fd, ai->ai_addr, ai->ai_addrlen) && errno != EINPROGRESS) {
+		ret = -errno;
+		close(fd);
+	} else {
+		ret = fd;
+	}
+
+	return ret;
+}
+
+/* complete a connect started with net_connect_start(), 0 or an error code */
+int net_connect_finish(int fd)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+		return -errno;
+	if (err)
+		return -err;
+
+	set_nonblock(fd, 0);
+	net_setup_socket(fd);
+
+	return 0;
+}
+
+/*
+ * Connect to host:port. All addresses returned by getaddrinfo() are raced
+ * against each other ("happy eyeballs"): a new non-blocking connect is started
+ * every CONNECT_ATTEMPT_DELAY_MS (or as soon as the previous one failed) and
+ * the first attempt that succeeds wins. Gives up after timeout_ms milliseconds
+ * (0 means no timeout). The addresses are kept for net_connect_start().
+ *
+ * Returns the connected (blocking) socket or a negative error code.
+ */
+int net_connect(const char *host, const char *port, int timeout_ms)
+{
+	struct addrinfo **addrs;
+	struct pollfd *pfds;
+	int naddrs, npending = 0, next = 0;
+	int sock = -1, ret, i;
+	long long deadline, next_attempt;
+
+	ret = net_resolve(host, port);
+	if (ret) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		return -EINVAL;
+	}
+	addrs = resolved.addrs;
+	naddrs = resolved.naddrs;
+
+	pfds = calloc(naddrs, sizeof(*pfds));
+	if (!pfds)
+		return -ENOMEM;
+
+	deadline = timeout_ms > 0 ? now_ms() + timeout_ms : 0;
+	next_attempt = now_ms();
+	ret = -ECONNREFUSED;
+
+	while (sock < 0) {
+		long long now = now_ms();
+		int timeout = -1;
+
+		if (deadline && now >= deadline) {
+			ret = -ETIMEDOUT;
+			break;
+		}
+
+		/* start the next attempt if it's due */
+		if (next < naddrs && (now >= next_attempt || !npending)) {
+			struct addrinfo *ai = addrs[next++];
+			int fd;
+
+			next_attempt = now + CONNECT_ATTEMPT_DELAY_MS;
+
+			fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK,
+				    ai->ai_protocol);
+			if (fd < 0) {
+				ret = -errno;
+				continue;
+			}
+
+			if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+				sock = fd;
+				break;
+			}
+
+			if (errno != EINPROGRESS) {
+				ret = -errno;
+				close(fd);
+				continue;
+			}
+
+			pfds[npending].fd = fd;
+			pfds[npending].events = POLLOUT;
+			npending++;
+		}
+
+		if (!npending) {
+			if (next < naddrs)
+				continue;
+			break;
+		}
+
+		if (next < naddrs)
+			timeout = max(next_attempt - now, 0LL);
+		if (deadline && (timeout < 0 || deadline - now < timeout))
+			timeout = deadline - now;
+
+		if (poll(pfds, npending, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+
+		for (i = 0; i < npending; i++) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+
+			if (!pfds[i].revents)
+				continue;
+
+			getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+			if (!err) {
+				sock = pfds[i].fd;
+				pfds[i].fd = -1;
+				break;
+			}
+
+			ret = -err;
+			dbg_printf("connect: %s\n", strerror(err));
+			close(pfds[i].fd);
+
+			/* drop failed attempt, the next one may start right away */
+			npending--;
+			pfds[i] = pfds[npending];
+			i--;
+		}
+	}
+
+	/* abort the attempts that lost the race */
+	for (i = 0; i < npending; i++)
+		if (pfds[i].fd >= 0)
+			close(pfds[i].fd);
+
+	if (sock >= 0) {
+		set_nonblock(sock, 0);
+		net_setup_socket(sock);
+		ret = sock;
+	}
+
+	free(pfds);
+
+	return ret;
+}
@@ -7,9 +7,7 @@
 #include <readline/history.h>
 #include "microcom.h"
 
-#define MAXARGS 64
-
-static int parse_line(char *_line, int *argc, char *argv[])
+int commandline_parse(char *_line, int *argc, char *argv[])
 {
 	char *line = _line;
 	int nargs = 0;
@@ -66,138 +64,318 @@ out:
 }
 
 struct cmd *commands;
+static struct cmd *commands_tail;
+
+/*
+ * The commands by name and alias, open addressing with linear probing. The
+ * table is at most half full, so a lookup is one or two string compares.
+ */
+struct cmd_slot {
+	const char *name;
+	struct cmd *cmd;
+};
 
-int register_command(struct cmd *cmd)
+static struct cmd_slot *cmd_table;
+static unsigned int cmd_table_size;
+static unsigned int cmd_table_used;
+
+static unsigned int cmd_hash(const char *name)
 {
-	struct cmd *tmp;
+	unsigned int hash = 2166136261u;
 
-	cmd->next = NULL;
+	/* FNV-1a */
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619;
+	}
 
-	if (!commands) {
-		commands = cmd;
-		return 0;
+	return hash;
+}
+
+static struct cmd_slot *cmd_slot(struct cmd_slot *table, unsigned int size,
+				 const char *name)
+{
+	unsigned int i = cmd_hash(name) & (size - 1);
+
+	while (table[i].name && strcmp(table[i].name, name))
+		i = (i + 1) & (size - 1);
+
+	return &table[i];
+}
+
+static int cmd_table_grow(void)
+{
+	unsigned int i, size = cmd_table_size ? cmd_table_size * 2 : 64;
+	struct cmd_slot *table;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < cmd_table_size; i++)
+		if (cmd_table[i].name)
+			*cmd_slot(table, size, cmd_table[i].name) = cmd_table[i];
+
+	free(cmd_table);
+	cmd_table = table;
+	cmd_table_size = size;
+
+	return 0;
+}
+
+static int cmd_table_add(const char *name, struct cmd *cmd)
+{
+	struct cmd_slot *slot;
+	int ret;
+
+	if ((cmd_table_used + 1) * 2 > cmd_table_size) {
+		ret = cmd_table_grow();
+		if (ret)
+			return ret;
 	}
 
-	tmp = commands;
+	slot = cmd_slot(cmd_table, cmd_table_size, name);
+	if (slot->name)
+		return -EEXIST;
+
+	slot->name = name;
+	slot->cmd = cmd;
+	cmd_table_used++;
+
+	return 0;
+}
+
+struct cmd *find_command(const char *name)
+{
+	if (!cmd_table)
+		return NULL;
+
+	return cmd_slot(cmd_table, cmd_table_size, name)->cmd;
+}
+
+/* names already taken are skipped, the first command keeps them */
+int register_command(struct cmd *cmd)
+{
+	int i, ret;
+
+	ret = cmd_table_add(cmd->name, cmd);
+	if (ret)
+		return ret;
 
-	while (tmp->next)
-		tmp = tmp->next;
+	for (i = 0; cmd->aliases && cmd->aliases[i]; i++)
+		cmd_table_add(cmd->aliases[i], cmd);
 
-	tmp->next = cmd;
+	cmd->next = NULL;
+	if (commands_tail)
+		commands_tail->next = cmd;
+	else
+		commands = cmd;
+	commands_tail = cmd;
 
 	return 0;
 }
 
 void microcom_cmd_usage(char *command)
 {
-	struct cmd *cmd;
+	struct cmd *cmd = find_command(command);
+	char *str = NULL;
 
-	for_each_command(cmd) {
-		if (!strcmp(command, cmd->name)) {
-			char *str = NULL;
-			if (cmd->info)
-				str = cmd->info;
-			if (cmd->help)
-				str = cmd->help;
-			if (!str)
-				str = "no help available\n";
-			printf("usage:\n%s\n", str);
-			return;
-		}
+	if (!cmd) {
+		printf("no such command\n");
+		return;
 	}
-	printf("no such command\n");
+
+	if (cmd->info)
+		str = cmd->info;
+	if (cmd->help)
+		str = cmd->help;
+	if (!str)
+		str = "no help available\n";
+	printf("usage:\n%s\n", str);
 }
 
-static int __do_commandline(const char *prompt)
+/*
+ * run the commands in cmd, returns MICROCOM_CMD_START to leave the prompt,
+ * otherwise 0 or the error of the last command that was unknown or failed
+ */
+int commandline_run(char *cmd)
 {
-	char *cmd;
 	char *argv[MAXARGS + 1];
-	int argc = 0, ret = 0, n, len;
+	int argc = 0, ret, n = 0, len = strlen(cmd), err = 0;
 
-	while (1) {
+	while (n < len) {
 		struct cmd *command;
-		cmd = readline(prompt);
-		if (!cmd) {
-			ret = MICROCOM_CMD_START;
+
+		ret = commandline_parse(cmd + n, &argc, argv);
+		if (ret < 0)
 			break;
+		n += ret;
+		if (!argv[0])
+			continue;
+
+		command = find_command(argv[0]);
+		if (!command) {
+			printf("unknown command \'%s\', try \'help\'\n", argv[0]);
+			err = -ENOENT;
+			continue;
+		}
+
+		ret = command->fn(argc, argv);
+		if (ret == MICROCOM_CMD_START)
+			return ret;
+
+		if (ret == MICROCOM_CMD_USAGE) {
+			microcom_cmd_usage(argv[0]);
+			err = -EINVAL;
+		} else if (ret < 0) {
+			err = ret;
 		}
+	}
+
+	return err;
+}
+
+/*
+ * The prompt is run with readline's callback interface from the main loop,
+ * so the port is still read (and logged) while the user types a command.
+ */
+static bool prompt_active;
+
+static void commandline_stop(void)
+{
+	rl_callback_handler_remove();
+	prompt_active = false;
+
+	printf("\n----------------------\n");
+	fflush(stdout);
+	init_terminal();
+}
 
-		if (!strlen(cmd))
-			goto done;
+static void commandline_line(char *cmd)
+{
+	int ret = MICROCOM_CMD_START;
 
-		if (prompt)
+	/* NULL is EOF, i.e. Ctrl-D */
+	if (cmd) {
+		if (*cmd)
 			add_history(cmd);
+		ret = commandline_run(cmd);
+		free(cmd);
+	}
+
+	if (ret == MICROCOM_CMD_START)
+		commandline_stop();
+}
+
+/*
+ * Completion: the first word is a command, its arguments are completed as
+ * the command says, with its values for the first argument or its generator.
+ */
+static struct cmd *complete_cmd;
+
+char *complete_command(const char *text, int state)
+{
+	static struct cmd *cmd;
+	static int alias;
+	size_t len = strlen(text);
+
+	if (!state) {
+		cmd = commands;
+		alias = -1;
+	}
 
-		len = strlen(cmd);
-		n = 0;
-		while (n < len) {
-			int handled = 0;
-			ret = parse_line(cmd + n, &argc, argv);
-			if (ret < 0)
-				break;
-			n += ret;
-			if (!argv[0])
-				continue;
-
-			for_each_command(command) {
-				if (!strcmp(argv[0], command->name)) {
-					ret = command->fn(argc, argv);
-					if (ret == MICROCOM_CMD_START) {
-						free(cmd);
-						return ret;
-					}
-
-					if (ret == MICROCOM_CMD_USAGE)
-						microcom_cmd_usage(argv[0]);
-
-					handled = 1;
-					break;
-				}
-			}
-			if (!handled)
-				printf("unknown command \'%s\', try \'help\'\n", argv[0]);
+	while (cmd) {
+		const char *name = alias < 0 ? cmd->name :
+			cmd->aliases ? cmd->aliases[alias] : NULL;
+
+		if (!name) {
+			cmd = cmd->next;
+			alias = -1;
+			continue;
 		}
-done:
-		free(cmd);
+
+		alias++;
+		if (!strncmp(name, text, len))
+			return strdup(name);
 	}
 
-	if (cmd)
-		free(cmd);
-	return ret;
+	return NULL;
 }
 
-int do_commandline(void)
+char *complete_file(const char *text, int state)
 {
-	int ret;
+	return rl_filename_completion_function(text, state);
+}
 
-	restore_terminal();
-	printf("\nEnter command. Try \'help\' for a list of builtin commands\n");
+static char *complete_value(const char *text, int state)
+{
+	static int i;
+	size_t len = strlen(text);
 
-	do {
-		ret = __do_commandline("-> ");
-	} while (ret != MICROCOM_CMD_START);
+	if (!state)
+		i = 0;
 
-	printf("\n----------------------\n");
-	init_terminal();
+	while (complete_cmd->values[i]) {
+		const char *value = complete_cmd->values[i++];
 
-	return 0;
+		if (!strncmp(value, text, len))
+			return strdup(value);
+	}
+
+	return NULL;
 }
 
-int do_script(char *script)
+static char **commandline_complete(const char *text, int start, int end)
 {
-	int fd = open(script, O_RDONLY);
-	int stdinfd = dup(1);
-	int ret;
+	char *argv[MAXARGS + 1], *line;
+	char **matches = NULL;
+	int argc, from = start;
+
+	/* no filename completion unless the command asks for it */
+	rl_attempted_completion_over = 1;
+
+	/* the words before text in the current command */
+	while (from > 0 && rl_line_buffer[from - 1] != ';')
+		from--;
+	line = strndup(rl_line_buffer + from, start - from);
+	if (!line || commandline_parse(line, &argc, argv) < 0)
+		goto out;
 
-	if (fd < 0) {
-		printf("could not open %s: %s\n", script, strerror(errno));
-		return -1;
+	if (!argc) {
+		matches = rl_completion_matches(text, complete_command);
+		goto out;
 	}
 
-	dup2(fd, 0);
-	ret = __do_commandline(NULL);
-	dup2(stdinfd, 0);
+	complete_cmd = find_command(argv[0]);
+	if (!complete_cmd)
+		goto out;
+
+	if (argc == 1 && complete_cmd->values)
+		matches = rl_completion_matches(text, complete_value);
+	else if (complete_cmd->complete)
+		matches = rl_completion_matches(text, complete_cmd->complete);
+out:
+	free(line);
+	return matches;
+}
+
+void do_commandline(void)
+{
+	restore_terminal();
+	printf("\nEnter command. Try \'help\' for a list of builtin commands\n");
+
+	prompt_active = true;
+	rl_attempted_completion_function = commandline_complete;
+	rl_callback_handler_install("-> ", commandline_line);
+}
 
-	return ret;
+bool commandline_active(void)
+{
+	return prompt_active;
 }
 
+/* feed readline, called when stdin is readable while the prompt is open */
+void commandline_read_char(void)
+{
+	rl_callback_read_char();
+}
@@ -0,0 +1,284 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "microcom.h"
+
+/*
+ * The pty bridge makes the port available as a pseudo terminal, e.g. for a
+ * flashing tool, while microcom keeps the port open and logs. Everything
+ * received from the port goes to the pty as well, data written to the pty is
+ * sent to the port.
+ *
+ * The main loop handles one chunk at a time, so the data from the pty and
+ * from the keyboard is never interleaved within a write. With "pty tx off"
+ * the pty is not read anymore and writers block until it's switched on again.
+ * Like the keyboard, the pty must not disturb a file transfer or a script:
+ * meanwhile its data is dropped and counted.
+ */
+
+struct pty_bridge {
+	struct mux_source src;
+	int slave;	/* kept open so the master doesn't see a hangup */
+	char *link;
+	bool tx;	/* send data written to the pty to the port */
+	unsigned long long dropped;	/* during transfers and scripts */
+};
+
+static struct pty_bridge bridge = {
+	.src.fd = -1,
+	.slave = -1,
+};
+
+int pty_open(int *master, int *slave)
+{
+	*master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*master < 0)
+		return -errno;
+
+	if (grantpt(*master) || unlockpt(*master))
+		goto err;
+
+	*slave = open(ptsname(*master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+	if (*slave < 0)
+		goto err;
+
+	return 0;
+err:
+	close(*master);
+	return -errno;
+}
+
+static int pty_bridge_handler(struct mux_source *src)
+{
+	unsigned char buf[4096];
+	ssize_t len;
+
+	len = read(src->fd, buf, sizeof(buf));
+	if (len <= 0)
+		return 0;
+
+	if (transfer_active() || script_name())
+		bridge.dropped += len;
+	else
+		ios->write(ios, buf, len);
+
+	return 0;
+}
+
+/*
+ * microcom keeps the slave open, so the data is queued in the pty until it's
+ * read, up to the size of the tty buffer, and a tool opening the pty later
+ * reads that first ("pty flush" discards it). Beyond that it's dropped.
+ */
+void pty_bridge_write(const unsigned char *buf, int len)
+{
+	if (bridge.src.fd >= 0)
+		write(bridge.src.fd, buf, len);
+}
+
+static void pty_bridge_set_tx(bool enable)
+{
+	if (enable == bridge.tx)
+		return;
+
+	if (enable)
+		mux_add_source(&bridge.src);
+	else
+		mux_del_source(&bridge.src);
+
+	bridge.tx = enable;
+}
+
+static int cmd_pty(int argc, char *argv[])
+{
+	if (argc < 2) {
+		printf("%s -> %s, tx %s, %llu bytes dropped\n", bridge.link,
+		       ptsname(bridge.src.fd), bridge.tx ? "on" : "off",
+		       bridge.dropped);
+		return 0;
+	}
+
+	if (argc == 2 && !strcmp(argv[1], "flush")) {
+		/* what was written to the master is the slave's input */
+		tcflush(bridge.slave, TCIFLUSH);
+		return 0;
+	}
+
+	if (argc < 3 || strcmp(argv[1], "tx"))
+		return MICROCOM_CMD_USAGE;
+
+	if (!strcmp(argv[2], "on"))
+		pty_bridge_set_tx(true);
+	else if (!strcmp(argv[2], "off"))
+		pty_bridge_set_tx(false);
+	else
+		return MICROCOM_CMD_USAGE;
+
+	return 0;
+}
+
+static struct cmd pty_cmd = {
+	.name = "pty",
+	.fn = cmd_pty,
+	.info = "show the pty bridge, switch sending its data on and off or flush it",
+	.help = "pty [flush|tx on|tx off]",
+};
+
+/* create a pty with a non-blocking master and make it available as link */
+static int pty_create(char *link, int *master, int *slave)
+{
+	struct termios ts;
+	struct stat st;
+	int ret;
+
+	ret = pty_open(master, slave);
+	if (ret) {
+		fprintf(stderr, "pty: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	/* pass the data through unmodified until the user changes that */
+	tcgetattr(*slave, &ts);
+	cfmakeraw(&ts);
+	tcsetattr(*slave, TCSANOW, &ts);
+
+	fcntl(*master, F_SETFL, fcntl(*master, F_GETFL) | O_NONBLOCK);
+
+	/* replace a stale link, but nothing else */
+	if (!lstat(link, &st)) {
+		if (!S_ISLNK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is no symlink\n", link);
+			ret = -EEXIST;
+			goto err;
+		}
+		unlink(link);
+	}
+
+	if (symlink(ptsname(*master), link)) {
+		ret = -errno;
+		fprintf(stderr, "cannot create %s: %s\n", link, strerror(-ret));
+		goto err;
+	}
+
+	return 0;
+err:
+	close(*master);
+	close(*slave);
+	*master = *slave = -1;
+	return ret;
+}
+
+/* create a pty and make it available as link */
+int pty_bridge_init(char *link)
+{
+	int ret;
+
+	ret = pty_create(link, &bridge.src.fd, &bridge.slave);
+	if (ret)
+		return ret;
+
+	bridge.link = link;
+	bridge.src.handler = pty_bridge_handler;
+	pty_bridge_set_tx(true);
+	register_command(&pty_cmd);
+
+	printf("pty bridge %s -> %s\n", link, ptsname(bridge.src.fd));
+
+	return 0;
+}
+
+void pty_bridge_exit(void)
+{
+	if (bridge.link)
+		unlink(bridge.link);
+	bridge.link = NULL;
+}
+
+/*
+ * A pty as the endpoint of relay mode, e.g. to use a CAN console with a tool
+ * that expects a tty. Like the bridge, microcom keeps the slave open: the
+ * data is queued in the pty until a program reads it, up to the size of the
+ * tty buffer. Beyond that it's dropped, so the port is still read and logged.
+ */
+struct pty_endpoint {
+	struct ios_ops ios;
+	int slave;
+	char *link;
+};
+
+static ssize_t pty_endpoint_write(struct ios_ops *ios, const unsigned char *buf,
+				  size_t count)
+{
+	ssize_t ret = write(ios->fd, buf, count);
+
+	/* nobody reads the pty */
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return count;
+
+	return ret;
+}
+
+static ssize_t pty_endpoint_read(struct ios_ops *ios, unsigned char *buf,
+				 size_t count)
+{
+	return read(ios->fd, buf, count);
+}
+
+static int pty_endpoint_set_speed(struct ios_ops *ios, unsigned long speed)
+{
+	return 0;
+}
+
+static int pty_endpoint_set_flow(struct ios_ops *ios, int flow)
+{
+	return 0;
+}
+
+static int pty_endpoint_send_break(struct ios_ops *ios)
+{
+	return 0;
+}
+
+static void pty_endpoint_exit(struct ios_ops *ios)
+{
+	struct pty_endpoint *pty = container_of(ios, struct pty_endpoint, ios);
+
+	close(ios->fd);
+	close(pty->slave);
+	unlink(pty->link);
+	free(pty);
+}
+
+struct ios_ops *pty_endpoint_init(char *link)
+{
+	struct pty_endpoint *pty;
+	struct ios_ops *ios;
+
+	pty = calloc(1, sizeof(*pty));
+	if (!pty)
+		return NULL;
+
+	ios = &pty->ios;
+	ios->write = pty_endpoint_write;
+	ios->read = pty_endpoint_read;
+	ios->set_speed = pty_endpoint_set_speed;
+	ios->set_flow = pty_endpoint_set_flow;
+	ios->send_break = pty_endpoint_send_break;
+	ios->exit = pty_endpoint_exit;
+	/* not raw: writes must not wait for the pty, see pty_endpoint_write() */
+
+	if (pty_create(link, &ios->fd, &pty->slave)) {
+		free(pty);
+		return NULL;
+	}
+	pty->link = link;
+
+	printf("pty %s -> %s\n", link, ptsname(ios->fd));
+
+	return ios;
+}
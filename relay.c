@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "microcom.h"
+
+/*
+ * Relay mode: pass the data between the port and a second endpoint without
+ * a terminal, e.g. to make a serial console available via TCP. If both ends
+ * are plain file descriptors the data is moved with splice() through a pipe
+ * and never copied to userspace, otherwise it goes through a buffer.
+ *
+ * Each direction only reads when the data read before has been written out,
+ * so a slow receiver throttles the sender instead of filling up memory.
+ */
+
+#define RELAY_BUFSIZE 65536
+#define RELAY_PIPE_SIZE (1024 * 1024)
+
+struct relay_dir {
+	struct ios_ops *src, *dst;
+	bool log;		/* write the data to the logfile too */
+	int pipe[2];		/* splice buffer, -1 if copying */
+	int logpipe[2];		/* copy of the data for the logfile */
+	size_t len, pos;	/* data in the pipe or in buf */
+	unsigned char buf[RELAY_BUFSIZE];
+};
+
+static void relay_close_pipes(struct relay_dir *dir)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		if (dir->pipe[i] >= 0)
+			close(dir->pipe[i]);
+		if (dir->logpipe[i] >= 0)
+			close(dir->logpipe[i]);
+		dir->pipe[i] = dir->logpipe[i] = -1;
+	}
+}
+
+static void relay_setup(struct relay_dir *dir, struct ios_ops *src,
+			struct ios_ops *dst)
+{
+	relay_close_pipes(dir);
+
+	dir->src = src;
+	dir->dst = dst;
+	dir->len = dir->pos = 0;
+
+	/* the data has to pass through userspace for the rings */
+	if (!src->raw || !dst || !dst->raw ||
+	    (dir->log && (ring_export_enabled() || ring_capture_enabled())))
+		return;
+
+	if (pipe2(dir->pipe, O_NONBLOCK | O_CLOEXEC))
+		goto err;
+	fcntl(dir->pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+
+	if (dir->log && logfile_fd() >= 0) {
+		if (pipe2(dir->logpipe, O_NONBLOCK | O_CLOEXEC))
+			goto err;
+		fcntl(dir->logpipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+	}
+
+	return;
+err:
+	dbg_printf("pipe: %s\n", strerror(errno));
+	relay_close_pipes(dir);
+}
+
+/* the logfile is a regular file, so this doesn't block for long */
+static int relay_splice_log(struct relay_dir *dir, size_t len)
+{
+	ssize_t ret;
+
+	ret = tee(dir->pipe[0], dir->logpipe[1], len, SPLICE_F_NONBLOCK);
+	if (ret < 0)
+		return -errno;
+
+	while (ret > 0) {
+		ssize_t n = splice(dir->logpipe[0], NULL, logfile_fd(), NULL,
+				   ret, SPLICE_F_MOVE);
+		if (n <= 0)
+			return n ? -errno : -EIO;
+		ret -= n;
+	}
+
+	return 0;
+}
+
+/* returns the number of bytes read, 0 on EOF or a negative error code */
+static ssize_t relay_fill(struct relay_dir *dir)
+{
+	ssize_t ret;
+
+	if (dir->pipe[0] >= 0) {
+		ret = splice(dir->src->fd, NULL, dir->pipe[1], NULL, RELAY_PIPE_SIZE,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret < 0 && errno == EINVAL) {
+			/* e.g. ttys on some kernels can't be spliced */
+			dbg_printf("splice: %s, copying instead\n", strerror(errno));
+			relay_close_pipes(dir);
+			return relay_fill(dir);
+		}
+		if (ret < 0)
+			return -errno;
+
+		/* the pipe was empty, so it holds exactly the new data */
+		if (ret > 0 && dir->logpipe[0] >= 0) {
+			int err = relay_splice_log(dir, ret);
+
+			if (err)
+				return err;
+		}
+	} else {
+		ret = dir->src->read(dir->src, dir->buf, sizeof(dir->buf));
+		if (ret < 0)
+			return -errno;
+
+		if (dir->log) {
+			logfile_write(dir->buf, ret);
+			ring_export_write(dir->buf, ret);
+			ring_capture_write(dir->buf, ret);
+		}
+	}
+
+	dir->len = ret;
+	dir->pos = 0;
+
+	/* nobody to pass the data to, e.g. no client connected */
+	if (!dir->dst)
+		dir->len = 0;
+
+	return ret;
+}
+
+static int relay_drain(struct relay_dir *dir)
+{
+	ssize_t ret;
+
+	if (dir->pipe[0] >= 0)
+		ret = splice(dir->pipe[0], NULL, dir->dst->fd, NULL, dir->len,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	else
+		ret = dir->dst->write(dir->dst, dir->buf + dir->pos,
+				      dir->len - dir->pos);
+
+	if (ret < 0)
+		return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -errno;
+
+	if (dir->pipe[0] >= 0)
+		dir->len -= ret;
+	else if ((dir->pos += ret) == dir->len)
+		dir->len = dir->pos = 0;
+
+	return 0;
+}
+
+/* there is something to do without waiting for poll() */
+static bool relay_pending(struct relay_dir *dir)
+{
+	if (dir->len)
+		return !dir->dst->raw;
+
+	return dir->src->pending && dir->src->pending(dir->src);
+}
+
+/*
+ * Other backends write blocking, possibly to another fd than the one polled
+ * (e.g. exec), so only wait for plain fds to become writable.
+ */
+static bool relay_can_drain(struct relay_dir *dir, struct pollfd *pfd)
+{
+	return dir->len && (!dir->dst->raw || (pfd->revents & POLLOUT));
+}
+
+static struct ios_ops *relay_open(char *endpoint, int *listenfd)
+{
+	char *arg = strchr(endpoint, ':');
+
+	if (!arg) {
+		fprintf(stderr, "invalid relay endpoint '%s'\n", endpoint);
+		return NULL;
+	}
+	*arg++ = 0;
+
+	if (!strcmp(endpoint, "listen")) {
+		*listenfd = tcp_listen(arg);
+		if (*listenfd < 0) {
+			fprintf(stderr, "failed to listen on %s: %s\n", arg,
+				strerror(-*listenfd));
+			return NULL;
+		}
+		printf("listening on %s\n", arg);
+		return NULL;
+	}
+
+	if (!strcmp(endpoint, "tcp"))
+		return tcp_init(arg);
+	if (!strcmp(endpoint, "unix"))
+		return unix_init(arg);
+	if (!strcmp(endpoint, "exec"))
+		return exec_init(arg);
+	if (!strcmp(endpoint, "pty"))
+		return pty_endpoint_init(arg);
+
+	fprintf(stderr, "unknown relay endpoint '%s'\n", endpoint);
+	return NULL;
+}
+
+static void relay_set_nonblock(struct ios_ops *ios)
+{
+	/* plain fds are only written when poll() says so, see relay_drain() */
+	if (ios->raw)
+		fcntl(ios->fd, F_SETFL, fcntl(ios->fd, F_GETFL) | O_NONBLOCK);
+}
+
+static bool relay_error(ssize_t ret)
+{
+	return ret == 0 || (ret < 0 && ret != -EAGAIN && ret != -EWOULDBLOCK);
+}
+
+/*
+ * Relay between ios and endpoint, one of:
+ *   listen:[host:]port  accept TCP clients, one at a time
+ *   tcp:host:port       connect to a raw TCP socket
+ *   unix:path           connect to a UNIX stream socket
+ *   exec:command        run a command
+ *   pty:link            create a pty available as link
+ * The data received from ios is logged.
+ */
+int relay_loop(struct ios_ops *ios, char *endpoint)
+{
+	static struct relay_dir rx = { .log = true, .pipe = { -1, -1 }, .logpipe = { -1, -1 } };
+	static struct relay_dir tx = { .pipe = { -1, -1 }, .logpipe = { -1, -1 } };
+	struct ios_ops *peer;
+	int listenfd = -1;
+	ssize_t ret;
+
+	peer = relay_open(endpoint, &listenfd);
+	if (!peer && listenfd < 0)
+		return -EINVAL;
+
+	relay_set_nonblock(ios);
+	relay_setup(&rx, ios, peer);
+	if (peer) {
+		relay_set_nonblock(peer);
+		relay_setup(&tx, peer, ios);
+	}
+
+	while (1) {
+		struct pollfd pfd[3] = {
+			{ .fd = ios->fd, },
+			{ .fd = peer ? peer->fd : listenfd, },
+			{ .fd = ring_capture_timer(), .events = POLLIN, },
+		};
+		int pending = relay_pending(&rx) || (peer && relay_pending(&tx));
+
+		if (!rx.len)
+			pfd[0].events |= POLLIN;
+		if (peer && tx.len && ios->raw)
+			pfd[0].events |= POLLOUT;
+		if (!peer || !tx.len)
+			pfd[1].events |= POLLIN;
+		if (peer && rx.len && peer->raw)
+			pfd[1].events |= POLLOUT;
+
+		if (poll(pfd, 3, pending ? 0 : -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			fprintf(stderr, "poll: %s\n", strerror(-ret));
+			goto out;
+		}
+
+		if (pfd[2].revents & POLLIN)
+			ring_capture_timeout();
+
+		if (!peer && (pfd[1].revents & POLLIN)) {
+			peer = tcp_accept(listenfd);
+			if (peer) {
+				relay_set_nonblock(peer);
+				relay_setup(&rx, ios, peer);
+				relay_setup(&tx, peer, ios);
+			}
+			continue;
+		}
+
+		if (!rx.len && ((pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) ||
+				relay_pending(&rx))) {
+			ret = relay_fill(&rx);
+			if (relay_error(ret)) {
+				if (ret)
+					fprintf(stderr, "%s\n", strerror(-ret));
+				else
+					fprintf(stderr, "Got EOF from port\n");
+				ret = ret ? ret : -EINVAL;
+				goto out;
+			}
+		}
+
+		if (peer && relay_can_drain(&tx, &pfd[0])) {
+			ret = relay_drain(&tx);
+			if (ret) {
+				fprintf(stderr, "%s\n", strerror(-ret));
+				goto out;
+			}
+		}
+
+		if (!peer)
+			continue;
+
+		ret = 1;
+		if (!tx.len && ((pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) ||
+				relay_pending(&tx)))
+			ret = relay_fill(&tx);
+
+		if (!relay_error(ret) && relay_can_drain(&rx, &pfd[1]))
+			ret = relay_drain(&rx) ?: 1;
+
+		if (!relay_error(ret))
+			continue;
+
+		if (listenfd < 0) {
+			if (ret)
+				fprintf(stderr, "%s: %s\n", endpoint, strerror(-ret));
+			else
+				fprintf(stderr, "Got EOF from %s\n", endpoint);
+			ret = ret ? ret : -EINVAL;
+			goto out;
+		}
+
+		/* wait for the next client, meanwhile the port is only logged */
+		mux_event("client disconnected");
+		peer->exit(peer);
+		free(peer);
+		peer = NULL;
+		relay_setup(&rx, ios, NULL);
+		relay_close_pipes(&tx);
+		tx.len = 0;
+	}
+
+out:
+	relay_close_pipes(&rx);
+	relay_close_pipes(&tx);
+	if (peer)
+		peer->exit(peer);
+	if (listenfd >= 0)
+		close(listenfd);
+
+	return ret;
+}
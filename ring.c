@@ -0,0 +1,471 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "microcom.h"
+#include "ring.h"
+
+/*
+ * Writer side of the ring buffer described in ring.h. The received data is
+ * exported in a POSIX shared memory object, so analyzers can follow the
+ * console without a pipe per consumer.
+ *
+ * A capture is the same ring in a regular file. Storing data is a memcpy()
+ * into the shared mapping, so what was received survives microcom being
+ * killed. Against a crash of the host, writeback of the file is started at
+ * most every RING_FLUSH_MS while data comes in, without waiting for it.
+ * sync_file_range() doesn't commit any metadata, so a new capture file is
+ * allocated and written in full once, writeback then only overwrites blocks
+ * that are on the disk already.
+ */
+
+#define RING_DEFAULT_SIZE (1024 * 1024)
+#define RING_HEADER_SIZE 64
+#define RING_FLUSH_MS 1000
+
+struct ring_writer {
+	struct ring_header *hdr;
+	unsigned char *data;
+	size_t maplen;
+	char *name;
+};
+
+static struct ring_writer export;
+static struct ring_writer capture;
+static struct mux_source flush_timer = { .fd = -1 };
+static int capture_fd = -1;
+static bool flush_pending;
+
+static uint64_t ring_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void ring_copy_in(struct ring_writer *w, uint64_t pos,
+			 const void *buf, size_t len)
+{
+	uint64_t off = pos & (w->hdr->size - 1);
+	size_t n = min((uint64_t)len, w->hdr->size - off);
+
+	memcpy(w->data + off, buf, n);
+	memcpy(w->data, (const unsigned char *)buf + n, len - n);
+}
+
+static void ring_put(struct ring_writer *w, const unsigned char *buf,
+		     uint32_t len, uint64_t time_ns)
+{
+	struct ring_header *hdr = w->hdr;
+	struct ring_record rec = {
+		.seq = hdr->seq,
+		.time_ns = time_ns,
+		.len = len,
+	};
+	uint64_t need = ring_record_size(len);
+	uint64_t tail = hdr->tail;
+
+	/* drop the oldest records, they are overwritten now */
+	while (hdr->head + need - tail > hdr->size) {
+		struct ring_record old;
+
+		ring_copy_out(hdr, tail, &old, sizeof(old));
+		tail += ring_record_size(old.len);
+	}
+
+	/* readers must see the new tail before any overwritten data */
+	__atomic_store_n(&hdr->tail, tail, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	ring_copy_in(w, hdr->head, &rec, sizeof(rec));
+	ring_copy_in(w, hdr->head + sizeof(rec), buf, len);
+
+	__atomic_store_n(&hdr->head, hdr->head + need, __ATOMIC_RELEASE);
+	hdr->seq++;
+}
+
+static void ring_writer_write(struct ring_writer *w, const unsigned char *buf, int len)
+{
+	/* a record must never take more than the ring, keep them small */
+	uint32_t max = w->hdr->size / 4;
+	uint64_t time_ns = ring_now_ns();
+
+	while (len > 0) {
+		uint32_t n = min((uint32_t)len, max);
+
+		ring_put(w, buf, n, time_ns);
+		buf += n;
+		len -= n;
+	}
+}
+
+static void ring_writer_setup(struct ring_writer *w, void *map, size_t size)
+{
+	w->hdr = map;
+	w->data = (unsigned char *)map + RING_HEADER_SIZE;
+	w->maplen = RING_HEADER_SIZE + size;
+
+	memset(w->hdr, 0, sizeof(*w->hdr));
+	w->hdr->version = RING_VERSION;
+	w->hdr->header_size = RING_HEADER_SIZE;
+	w->hdr->size = size;
+	w->hdr->seq = 1;
+	w->hdr->created_ns = ring_now_ns();
+
+	/* readers check the magic, so it comes last */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(w->hdr->magic, RING_MAGIC, sizeof(w->hdr->magic));
+}
+
+/*
+ * Check that the records from tail to head of a ring left by a previous run
+ * are intact, so new ones can be appended. A writer killed right after
+ * publishing a record didn't count it in seq yet, that's fixed up.
+ */
+static bool ring_resume_check(struct ring_header *hdr, size_t size)
+{
+	struct ring_record rec;
+	uint64_t pos, next = 0;
+
+	if (!ring_valid(hdr) || hdr->header_size != RING_HEADER_SIZE ||
+	    hdr->size != size || hdr->tail > hdr->head ||
+	    hdr->head - hdr->tail > size)
+		return false;
+
+	for (pos = hdr->tail; pos < hdr->head; pos += ring_record_size(rec.len)) {
+		if (hdr->head - pos < sizeof(rec))
+			return false;
+		ring_copy_out(hdr, pos, &rec, sizeof(rec));
+		if (rec.len > size / 4 || (next && rec.seq != next))
+			return false;
+		next = rec.seq + 1;
+	}
+
+	if (pos != hdr->head || (next && next != hdr->seq && next != hdr->seq + 1))
+		return false;
+
+	if (next)
+		hdr->seq = next;
+
+	return true;
+}
+
+/*
+ * parse "<size>[k|M]" and round it down to a power of two, so it's never
+ * more memory than asked for, at least 4k
+ */
+size_t ring_parse_size(const char *str)
+{
+	char *end;
+	size_t size, ret = 4096;
+
+	size = strtoul(str, &end, 0);
+	if (*end == 'k' || *end == 'K')
+		size <<= 10;
+	else if (*end == 'm' || *end == 'M')
+		size <<= 20;
+
+	while (ret <= size / 2)
+		ret <<= 1;
+
+	if (ret != size)
+		printf("size %s is no power of two of at least 4k, using %zu bytes\n",
+		       str, ret);
+
+	return ret;
+}
+
+/* export the received data as "<name>[:<size>]" in /dev/shm */
+int ring_export_init(char *spec)
+{
+	char *sizestr = strchr(spec, ':');
+	size_t size = RING_DEFAULT_SIZE;
+	void *map;
+	int fd;
+
+	if (sizestr) {
+		*sizestr++ = 0;
+		size = ring_parse_size(sizestr);
+	}
+
+	if (asprintf(&export.name, "%s%s", *spec == '/' ? "" : "/", spec) < 0)
+		return -ENOMEM;
+
+	fd = shm_open(export.name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "shm_open %s: %s\n", export.name, strerror(errno));
+		return -errno;
+	}
+
+	if (ftruncate(fd, RING_HEADER_SIZE + size)) {
+		fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+		close(fd);
+		return -errno;
+	}
+
+	map = mmap(NULL, RING_HEADER_SIZE + size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	ring_writer_setup(&export, map, size);
+
+	printf("exporting received data to %s (%zu bytes)\n", export.name, size);
+
+	return 0;
+}
+
+void ring_export_write(const unsigned char *buf, int len)
+{
+	if (export.hdr)
+		ring_writer_write(&export, buf, len);
+}
+
+bool ring_export_enabled(void)
+{
+	return export.hdr;
+}
+
+void ring_export_exit(void)
+{
+	if (!export.hdr)
+		return;
+
+	munmap(export.hdr, export.maplen);
+	shm_unlink(export.name);
+	export.hdr = NULL;
+}
+
+static int ring_flush_handler(struct mux_source *src)
+{
+	mux_timer_ack(src->fd);
+	flush_pending = false;
+
+	capture.hdr->flushed_ns = ring_now_ns();
+	sync_file_range(capture_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+
+	return 0;
+}
+
+/*
+ * Open a capture file, returns the fd or a negative error code. An existing
+ * file must be a ring, one that can't be continued is moved out of the way.
+ * *resume tells whether it can be.
+ */
+static int ring_capture_open(const char *path, size_t size, bool *resume)
+{
+	size_t maplen = RING_HEADER_SIZE + size;
+	struct ring_header hdr;
+	struct stat st;
+	char *old;
+	void *map;
+	int fd, ret;
+
+	*resume = false;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || fstat(fd, &st)) {
+		ret = -errno;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		goto err;
+	}
+
+	if (!st.st_size)
+		return fd;
+
+	/* don't overwrite anything else given by mistake */
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, RING_MAGIC, sizeof(hdr.magic))) {
+		fprintf(stderr, "%s: not a capture file\n", path);
+		ret = -EINVAL;
+		goto err;
+	}
+
+	if (st.st_size == maplen) {
+		map = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map != MAP_FAILED) {
+			*resume = ring_resume_check(map, size);
+			munmap(map, maplen);
+			if (*resume)
+				return fd;
+		}
+	}
+
+	/* keep the data, e.g. from a crash, for microcom-ringcat */
+	close(fd);
+	if (asprintf(&old, "%s.old", path) < 0)
+		return -ENOMEM;
+	if (rename(path, old)) {
+		ret = -errno;
+		fprintf(stderr, "cannot move %s to %s: %s\n", path, old,
+			strerror(errno));
+		free(old);
+		return ret;
+	}
+	printf("%s can't be continued, moved to %s\n", path, old);
+	free(old);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return ret;
+	}
+
+	return fd;
+err:
+	if (fd >= 0)
+		close(fd);
+	return ret;
+}
+
+/*
+ * Allocate the whole file and fill it with zeros: preallocated blocks are
+ * unwritten extents, turning them into data needs a metadata update too.
+ */
+static int ring_capture_allocate(int fd, size_t len)
+{
+	static const unsigned char zeros[64 * 1024];
+	size_t pos;
+	ssize_t n;
+	int ret;
+
+	ret = posix_fallocate(fd, 0, len);
+	if (ret) {
+		fprintf(stderr, "fallocate: %s\n", strerror(ret));
+		return -ret;
+	}
+
+	for (pos = 0; pos < len; pos += n) {
+		n = pwrite(fd, zeros, min(sizeof(zeros), len - pos), pos);
+		if (n < 0) {
+			ret = -errno;
+			fprintf(stderr, "write: %s\n", strerror(errno));
+			return ret;
+		}
+	}
+
+	if (fsync(fd)) {
+		ret = -errno;
+		fprintf(stderr, "fsync: %s\n", strerror(errno));
+		return ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Capture the received data as "<file>[:<size>]". The records of an intact
+ * capture file of the same size are kept, new ones are appended.
+ */
+int ring_capture_init(char *spec)
+{
+	char *sizestr = strchr(spec, ':');
+	size_t size = RING_DEFAULT_SIZE;
+	bool resume;
+	void *map;
+	int fd, ret;
+
+	if (sizestr) {
+		*sizestr++ = 0;
+		size = ring_parse_size(sizestr);
+	}
+
+	fd = ring_capture_open(spec, size, &resume);
+	if (fd < 0)
+		return fd;
+
+	if (!resume) {
+		ret = ring_capture_allocate(fd, RING_HEADER_SIZE + size);
+		if (ret)
+			goto err;
+	}
+
+	map = mmap(NULL, RING_HEADER_SIZE + size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		goto err;
+	}
+
+	flush_timer.fd = mux_timer_create();
+	if (flush_timer.fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "timerfd: %s\n", strerror(errno));
+		munmap(map, RING_HEADER_SIZE + size);
+		goto err;
+	}
+	flush_timer.handler = ring_flush_handler;
+	mux_add_source(&flush_timer);
+
+	if (resume) {
+		capture.hdr = map;
+		capture.data = (unsigned char *)map + RING_HEADER_SIZE;
+		capture.maplen = RING_HEADER_SIZE + size;
+		printf("appending received data to %s (%zu bytes)\n", spec, size);
+	} else {
+		ring_writer_setup(&capture, map, size);
+		printf("capturing received data in %s (%zu bytes)\n", spec, size);
+	}
+
+	capture.name = spec;
+	capture_fd = fd;
+
+	return 0;
+err:
+	close(fd);
+	return ret;
+}
+
+void ring_capture_write(const unsigned char *buf, int len)
+{
+	if (!capture.hdr)
+		return;
+
+	ring_writer_write(&capture, buf, len);
+
+	if (!flush_pending) {
+		mux_timer_arm(flush_timer.fd, RING_FLUSH_MS);
+		flush_pending = true;
+	}
+}
+
+bool ring_capture_enabled(void)
+{
+	return capture.hdr;
+}
+
+/* for relay_loop(), which doesn't run the mux sources */
+int ring_capture_timer(void)
+{
+	return flush_timer.fd;
+}
+
+void ring_capture_timeout(void)
+{
+	ring_flush_handler(&flush_timer);
+}
+
+void ring_capture_exit(void)
+{
+	if (!capture.hdr)
+		return;
+
+	capture.hdr->flushed_ns = ring_now_ns();
+	msync(capture.hdr, capture.maplen, MS_SYNC);
+	munmap(capture.hdr, capture.maplen);
+	close(capture_fd);
+	capture.hdr = NULL;
+}
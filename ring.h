@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __RING_H
+#define __RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Ring buffer with the received data, shared with other processes.
+ *
+ * The ring starts with struct ring_header, followed by the data area of
+ * header->size bytes, a power of two. The data area holds records, each a
+ * struct ring_record followed by the data and padded to 8 bytes. Records may
+ * wrap around the end of the data area.
+ *
+ * head and tail are byte positions that only ever grow, the offset in the
+ * data area is position & (size - 1). The writer publishes a record by
+ * advancing head. Before it overwrites old records it advances tail past
+ * them, so a reader that finds its position below tail after copying a
+ * record knows the copy is garbage.
+ *
+ * Readers map the ring read-only and don't need any locking, see
+ * ring_read().
+ *
+ * The same format is used for capture files (microcom --capture), which stay
+ * after microcom is gone. A writer killed at any point leaves a consistent
+ * ring, only after a crash of the host the newest data may be missing or
+ * damaged, readers stop at the first record that doesn't fit.
+ */
+
+#define RING_MAGIC "mcomring"
+#define RING_VERSION 1
+
+struct ring_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;	/* the data area starts here */
+	uint64_t size;		/* of the data area */
+	uint64_t head;		/* end of the newest record */
+	uint64_t tail;		/* start of the oldest record */
+	uint64_t seq;		/* sequence number of the next record, from 1 */
+	uint64_t created_ns;	/* CLOCK_REALTIME when the ring was set up */
+	uint64_t flushed_ns;	/* last writeback of a capture file started */
+};
+
+struct ring_record {
+	uint64_t seq;
+	uint64_t time_ns;	/* CLOCK_REALTIME when received */
+	uint32_t len;		/* of the data following */
+	uint32_t flags;		/* reserved, 0 */
+};
+
+static inline uint64_t ring_record_size(uint32_t len)
+{
+	return (sizeof(struct ring_record) + len + 7) & ~7ULL;
+}
+
+static inline const unsigned char *ring_data(const struct ring_header *hdr)
+{
+	return (const unsigned char *)hdr + hdr->header_size;
+}
+
+static inline void ring_copy_out(const struct ring_header *hdr, uint64_t pos,
+				 void *buf, size_t len)
+{
+	uint64_t off = pos & (hdr->size - 1);
+	size_t n = len < hdr->size - off ? len : hdr->size - off;
+
+	memcpy(buf, ring_data(hdr) + off, n);
+	memcpy((unsigned char *)buf + n, ring_data(hdr), len - n);
+}
+
+static inline bool ring_valid(const struct ring_header *hdr)
+{
+	return !memcmp(hdr->magic, RING_MAGIC, sizeof(hdr->magic)) &&
+		hdr->version == RING_VERSION && hdr->size &&
+		!(hdr->size & (hdr->size - 1));
+}
+
+struct ring_reader {
+	const struct ring_header *hdr;
+	uint64_t pos;		/* of the next record to read */
+	uint64_t seq;		/* expected sequence number */
+	uint64_t lost;		/* records overwritten before they were read */
+};
+
+/* start with the oldest record still available or with the next new one */
+static inline void ring_reader_init(struct ring_reader *r, const void *ring,
+				    bool from_start)
+{
+	r->hdr = ring;
+	r->pos = __atomic_load_n(from_start ? &r->hdr->tail : &r->hdr->head,
+				 __ATOMIC_ACQUIRE);
+	r->seq = 0;
+	r->lost = 0;
+}
+
+/*
+ * Read the next record into rec and up to bufsize bytes of its data into buf.
+ * Returns the length of the data (which may be more than bufsize) or -1 if
+ * there is no new record.
+ */
+static inline long ring_read(struct ring_reader *r, struct ring_record *rec,
+			     void *buf, size_t bufsize)
+{
+	const struct ring_header *hdr = r->hdr;
+	uint64_t head, tail;
+	size_t n;
+
+	while (1) {
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (r->pos == head)
+			return -1;
+
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+		if (r->pos < tail)
+			r->pos = tail;
+
+		ring_copy_out(hdr, r->pos, rec, sizeof(*rec));
+		n = bufsize;
+		if (n > rec->len)
+			n = rec->len;
+		if (n > hdr->size)
+			n = hdr->size;
+		ring_copy_out(hdr, r->pos + sizeof(*rec), buf, n);
+
+		/* the writer may have overwritten the record while we copied it */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		tail = __atomic_load_n(&hdr->tail, __ATOMIC_RELAXED);
+		if (r->pos >= tail)
+			break;
+	}
+
+	/* no torn copy, so the ring is corrupt */
+	if (rec->len > hdr->size || (r->seq && rec->seq < r->seq))
+		return -1;
+
+	if (r->seq && rec->seq > r->seq)
+		r->lost += rec->seq - r->seq;
+	r->seq = rec->seq + 1;
+	r->pos += ring_record_size(rec->len);
+
+	return rec->len;
+}
+
+#endif /* __RING_H */
@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ring.h"
+
+/*
+ * Example consumer of the ring exported with microcom --shm: print the data
+ * in the ring and optionally follow it. With --file it reads a capture file
+ * written with microcom --capture, also one left by a crashed microcom, and
+ * prints its data in order.
+ */
+
+static void usage(int exitcode)
+{
+	fprintf(stderr,
+		"usage: microcom-ringcat [options] <name>\n"
+		"    -F, --file          <name> is a capture file\n"
+		"    -f, --follow        wait for new data\n"
+		"    -n, --new           skip the data already in the ring\n"
+		"    -t, --timestamps    prefix each chunk with its receive time\n"
+		"    -h, --help          this help\n");
+	exit(exitcode);
+}
+
+static const void *ring_map(const char *name, int file)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (file)
+		fd = open(name, O_RDONLY | O_CLOEXEC);
+	else
+		fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct ring_header)) {
+		fprintf(stderr, "%s: not a ring\n", name);
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "mmap: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (!ring_valid(map) ||
+	    ((const struct ring_header *)map)->header_size +
+	    ((const struct ring_header *)map)->size > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s: not a ring\n", name);
+		return NULL;
+	}
+
+	return map;
+}
+
+int main(int argc, char *argv[])
+{
+	static unsigned char buf[1 << 20];
+	struct option long_options[] = {
+		{ "file", no_argument, NULL, 'F' },
+		{ "follow", no_argument, NULL, 'f' },
+		{ "new", no_argument, NULL, 'n' },
+		{ "timestamps", no_argument, NULL, 't' },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+	int file = 0, follow = 0, from_start = 1, timestamps = 0;
+	struct ring_reader reader;
+	struct ring_record rec;
+	uint64_t lost = 0;
+	const void *ring;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "Ffnth", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'F':
+			file = 1;
+			break;
+		case 'f':
+			follow = 1;
+			break;
+		case 'n':
+			from_start = 0;
+			break;
+		case 't':
+			timestamps = 1;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+		}
+	}
+
+	if (optind != argc - 1)
+		usage(1);
+
+	ring = ring_map(argv[optind], file);
+	if (!ring)
+		exit(1);
+
+	ring_reader_init(&reader, ring, from_start);
+
+	while (1) {
+		long len = ring_read(&reader, &rec, buf, sizeof(buf));
+
+		if (len < 0) {
+			if (!follow)
+				break;
+			fflush(stdout);
+			usleep(10000);
+			continue;
+		}
+
+		if (reader.lost != lost) {
+			fprintf(stderr, "[%llu records lost]\n",
+				(unsigned long long)(reader.lost - lost));
+			lost = reader.lost;
+		}
+
+		if (timestamps)
+			printf("[%llu.%06llu] ",
+			       (unsigned long long)(rec.time_ns / 1000000000),
+			       (unsigned long long)(rec.time_ns % 1000000000) / 1000);
+
+		/* data beyond buf is skipped, the writer never produces that */
+		if (len > (long)sizeof(buf))
+			len = sizeof(buf);
+
+		fwrite(buf, 1, len, stdout);
+
+		if (timestamps && (!len || buf[len - 1] != '\n'))
+			putchar('\n');
+	}
+
+	return 0;
+}
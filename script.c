@@ -0,0 +1,700 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include "config.h"
+
+#include "microcom.h"
+
+/*
+ * Scripts run from the main loop, so the port is read (and logged) while a
+ * script waits. A script has one statement per line, or several separated
+ * by ';' like on the prompt:
+ *
+ *   <label>:
+ *   send <string>
+ *   expect <pattern> [<timeout>]
+ *   expect-any [-t <timeout>] [-e <label>] <pattern> <label> [<pattern> <label>...]
+ *   timeout <seconds>	default timeout for expect, 0 waits forever
+ *   sleep <seconds>
+ *   goto <label>
+ *   exit [<status>]
+ *
+ * Anything else is run as a command like on the prompt, an unknown command or
+ * a command returning an error fails the script. Strings and patterns
+ * may contain \r, \n, \t, \e, \\ and \xHH. expect fails the script on timeout,
+ * expect-any continues at the label of the pattern found first, or at the -e
+ * label on timeout. All patterns of an expect are matched in one pass over
+ * the received data, see match.c. A command starting a file transfer (sb,
+ * rb, ...) waits for it, a failed transfer fails the script.
+ */
+
+/* statements without waiting before giving the main loop a chance */
+#define SCRIPT_MAX_STEPS 1000
+
+enum script_state {
+	SCRIPT_RUN,
+	SCRIPT_EXPECT,
+	SCRIPT_SLEEP,
+	SCRIPT_TRANSFER,	/* waiting for a file transfer to finish */
+	SCRIPT_DONE,
+};
+
+struct script {
+	char *name;
+	char **lines;
+	int num_lines;
+	int pc;			/* next line to run */
+	int stmt;		/* offset of the next statement in line pc - 1 */
+	enum script_state state;
+	int status;
+	bool running;		/* in script_run(), don't free or replace */
+	bool batch;		/* microcom exits with the script's status */
+	unsigned int timeout_ms;
+	int transfer_err;
+
+	struct mux_source timer;
+
+	/* the current expect */
+	struct matcher *matcher;
+	char **targets;		/* label per pattern, NULL continues */
+	int num_targets;
+	char *else_target;
+	char *waiting;		/* for messages */
+	int matched;
+};
+
+static struct script *script;
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* resolve escape sequences in place, returns the new length */
+int str_unescape(char *str)
+{
+	char *in = str, *out = str;
+
+	while (*in) {
+		if (*in != '\\' || !in[1]) {
+			*out++ = *in++;
+			continue;
+		}
+
+		in++;
+		switch (*in) {
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'e':
+			*out++ = 0x1b;
+			break;
+		case 'x':
+			if (hexval(in[1]) >= 0 && hexval(in[2]) >= 0) {
+				*out++ = hexval(in[1]) << 4 | hexval(in[2]);
+				in += 2;
+				break;
+			}
+			/* fall through */
+		default:
+			*out++ = *in;
+			break;
+		}
+		in++;
+	}
+
+	*out = 0;
+
+	return out - str;
+}
+
+static unsigned int script_parse_seconds(const char *str)
+{
+	double sec = strtod(str, NULL);
+
+	return sec > 0 ? sec * 1000 : 0;
+}
+
+static void script_expect_clear(struct script *s)
+{
+	int i;
+
+	matcher_free(s->matcher);
+	s->matcher = NULL;
+	for (i = 0; i < s->num_targets; i++)
+		free(s->targets[i]);
+	free(s->targets);
+	s->targets = NULL;
+	s->num_targets = 0;
+	free(s->else_target);
+	s->else_target = NULL;
+	free(s->waiting);
+	s->waiting = NULL;
+}
+
+static void script_free(struct script *s)
+{
+	int i;
+
+	script_expect_clear(s);
+	if (s->timer.fd >= 0) {
+		mux_del_source(&s->timer);
+		close(s->timer.fd);
+	}
+	for (i = 0; i < s->num_lines; i++)
+		free(s->lines[i]);
+	free(s->lines);
+	free(s->name);
+	free(s);
+}
+
+static void script_finish(struct script *s, int status)
+{
+	s->state = SCRIPT_DONE;
+	s->status = status;
+	mux_timer_arm(s->timer.fd, 0);
+}
+
+static void script_fail(struct script *s, const char *msg)
+{
+	mux_event("script %s line %d: %s", s->name, s->pc, msg);
+	script_finish(s, 1);
+}
+
+static int script_goto(struct script *s, const char *label)
+{
+	size_t len = strlen(label);
+	int i;
+
+	for (i = 0; i < s->num_lines; i++) {
+		char *line = s->lines[i] + strspn(s->lines[i], " \t");
+
+		if (!strncmp(line, label, len) && line[len] == ':' &&
+		    !line[len + 1 + strspn(line + len + 1, " \t")]) {
+			s->pc = i + 1;
+			s->stmt = 0;
+			return 0;
+		}
+	}
+
+	script_fail(s, "no such label");
+
+	return -EINVAL;
+}
+
+static void script_wait(struct script *s, enum script_state state,
+			unsigned int ms)
+{
+	s->state = state;
+	mux_timer_arm(s->timer.fd, ms);
+}
+
+static int script_send(struct script *s, int argc, char *argv[])
+{
+	int i, len;
+
+	for (i = 1; i < argc; i++) {
+		if (i > 1)
+			ios->write(ios, (unsigned char *)" ", 1);
+		len = str_unescape(argv[i]);
+		ios->write(ios, (unsigned char *)argv[i], len);
+	}
+
+	return 0;
+}
+
+static int script_add_pattern(struct script *s, char *pattern, char *target)
+{
+	int len;
+
+	if (!s->waiting)
+		s->waiting = strdup(pattern);
+
+	len = str_unescape(pattern);
+	if (matcher_add(s->matcher, (unsigned char *)pattern, len, s->num_targets))
+		return -EINVAL;
+
+	s->targets[s->num_targets++] = target ? strdup(target) : NULL;
+
+	return 0;
+}
+
+static int script_expect(struct script *s, int argc, char *argv[], bool any)
+{
+	unsigned int timeout = s->timeout_ms;
+	int i = 1;
+
+	if (any) {
+		for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+			if (!strcmp(argv[i], "-t"))
+				timeout = script_parse_seconds(argv[i + 1]);
+			else if (!strcmp(argv[i], "-e"))
+				s->else_target = strdup(argv[i + 1]);
+			else
+				break;
+		}
+		if (i >= argc || (argc - i) % 2)
+			return MICROCOM_CMD_USAGE;
+	} else {
+		if (argc < 2 || argc > 3)
+			return MICROCOM_CMD_USAGE;
+		if (argc == 3)
+			timeout = script_parse_seconds(argv[2]);
+	}
+
+	s->matcher = matcher_new();
+	s->targets = calloc(argc, sizeof(*s->targets));
+	if (!s->matcher || !s->targets)
+		return -ENOMEM;
+
+	if (any) {
+		for (; i < argc; i += 2)
+			if (script_add_pattern(s, argv[i], argv[i + 1]))
+				return MICROCOM_CMD_USAGE;
+	} else if (script_add_pattern(s, argv[1], NULL)) {
+		return MICROCOM_CMD_USAGE;
+	}
+
+	if (matcher_compile(s->matcher))
+		return -ENOMEM;
+
+	script_wait(s, SCRIPT_EXPECT, timeout);
+
+	return 0;
+}
+
+/* run the first statement of line, *len is set to the length it takes */
+static int script_step(struct script *s, char *line, int *len)
+{
+	char *argv[MAXARGS + 1];
+	int argc;
+
+	*len = commandline_parse(line, &argc, argv);
+	if (*len < 0)
+		return MICROCOM_CMD_USAGE;
+
+	if (!argc)
+		return 0;
+
+	if (argc == 1 && argv[0][strlen(argv[0]) - 1] == ':')
+		return 0;
+
+	if (!strcmp(argv[0], "send"))
+		return script_send(s, argc, argv);
+
+	if (!strcmp(argv[0], "expect"))
+		return script_expect(s, argc, argv, false);
+
+	if (!strcmp(argv[0], "expect-any"))
+		return script_expect(s, argc, argv, true);
+
+	if (!strcmp(argv[0], "timeout")) {
+		if (argc != 2)
+			return MICROCOM_CMD_USAGE;
+		s->timeout_ms = script_parse_seconds(argv[1]);
+		return 0;
+	}
+
+	if (!strcmp(argv[0], "sleep")) {
+		unsigned int ms;
+
+		if (argc != 2)
+			return MICROCOM_CMD_USAGE;
+		/* a zero timer would be disarmed */
+		ms = script_parse_seconds(argv[1]);
+		script_wait(s, SCRIPT_SLEEP, ms ? ms : 1);
+		return 0;
+	}
+
+	if (!strcmp(argv[0], "goto")) {
+		if (argc != 2)
+			return MICROCOM_CMD_USAGE;
+		script_goto(s, argv[1]);
+		return 0;
+	}
+
+	if (!strcmp(argv[0], "exit")) {
+		/* it ends up as exit status in batch mode */
+		script_finish(s, argc > 1 ? strtol(argv[1], NULL, 0) & 0xff : 0);
+		if (s->status)
+			mux_event("script %s exited with status %d", s->name,
+				  s->status);
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Run a command like on the prompt. Unlike there, an unknown command or one
+ * returning an error fails the script.
+ */
+static int script_command(struct script *s, char *line)
+{
+	char *argv[MAXARGS + 1];
+	struct cmd *cmd;
+	char msg[128];
+	int argc, ret;
+
+	if (commandline_parse(line, &argc, argv) < 0)
+		return MICROCOM_CMD_USAGE;
+
+	cmd = find_command(argv[0]);
+	if (!cmd) {
+		snprintf(msg, sizeof(msg), "unknown command '%s'", argv[0]);
+		script_fail(s, msg);
+		return -ENOENT;
+	}
+
+	ret = cmd->fn(argc, argv);
+	if (ret == MICROCOM_CMD_USAGE)
+		microcom_cmd_usage(argv[0]);
+
+	return ret;
+}
+
+/* run statements until the script has to wait or is done */
+static void script_run(struct script *s)
+{
+	int steps = 0;
+
+	s->running = true;
+
+	while (s->state == SCRIPT_RUN) {
+		const char *stmt;
+		char *line;
+		int ret, len;
+
+		if (!s->stmt && s->pc >= s->num_lines) {
+			script_finish(s, 0);
+			break;
+		}
+
+		if (++steps > SCRIPT_MAX_STEPS) {
+			script_wait(s, SCRIPT_SLEEP, 1);
+			break;
+		}
+
+		/* the next statement of the line or the next line */
+		if (!s->stmt)
+			s->pc++;
+		stmt = s->lines[s->pc - 1] + s->stmt;
+
+		/* parsing modifies the line */
+		line = strdup(stmt);
+		if (!line) {
+			script_fail(s, "out of memory");
+			break;
+		}
+
+		ret = script_step(s, line, &len);
+
+		/* a goto moved on already */
+		if (stmt == s->lines[s->pc - 1] + s->stmt) {
+			if (len > 0 && len < strlen(stmt))
+				s->stmt += len;
+			else
+				s->stmt = 0;
+		}
+
+		/* not a script statement, run just this one like on the prompt */
+		if (ret == -ENOENT) {
+			strncpy(line, stmt, len);
+			line[len > 0 ? len - 1 : 0] = 0;
+			ret = script_command(s, line);
+		}
+		free(line);
+
+		if (ret == MICROCOM_CMD_USAGE)
+			script_fail(s, "invalid statement");
+		else if (ret == -ENOMEM)
+			script_fail(s, "out of memory");
+		else if (ret < 0 && s->state != SCRIPT_DONE)
+			script_fail(s, "command failed");
+		else if (s->state == SCRIPT_RUN && transfer_active())
+			s->state = SCRIPT_TRANSFER;
+	}
+
+	s->running = false;
+
+	if (s->state == SCRIPT_DONE) {
+		if (!s->status)
+			mux_event("script %s done", s->name);
+		if (s->batch)
+			mux_stop(s->status);
+		script = NULL;
+		script_free(s);
+	}
+}
+
+static int script_match(void *ctx, int id)
+{
+	struct script *s = ctx;
+
+	/* the longest of the patterns ending here is reported first */
+	if (s->matched < 0)
+		s->matched = id;
+
+	return 1;
+}
+
+/* feed the received data to the running script */
+void script_receive(const unsigned char *buf, int len)
+{
+	while (script && script->state == SCRIPT_EXPECT && len > 0) {
+		struct script *s = script;
+		char *target;
+		int n;
+
+		s->matched = -1;
+		n = matcher_feed(s->matcher, buf, len, script_match, s);
+		buf += n;
+		len -= n;
+
+		if (s->matched < 0)
+			break;
+
+		target = s->targets[s->matched];
+		s->targets[s->matched] = NULL;
+		script_expect_clear(s);
+		mux_timer_arm(s->timer.fd, 0);
+		s->state = SCRIPT_RUN;
+
+		if (target)
+			script_goto(s, target);
+		free(target);
+
+		/* the rest of the data is for the next expect, if any */
+		script_run(s);
+	}
+}
+
+static int script_timer_handler(struct mux_source *src)
+{
+	struct script *s = container_of(src, struct script, timer);
+	char msg[128];
+
+	mux_timer_ack(src->fd);
+
+	if (s->state == SCRIPT_EXPECT) {
+		char *target = s->else_target;
+
+		s->else_target = NULL;
+		if (target) {
+			s->state = SCRIPT_RUN;
+			script_goto(s, target);
+			free(target);
+		} else {
+			snprintf(msg, sizeof(msg), "timeout waiting for \"%s\"",
+				 s->waiting);
+			script_fail(s, msg);
+		}
+		script_expect_clear(s);
+	} else if (s->state == SCRIPT_SLEEP) {
+		s->state = SCRIPT_RUN;
+	} else if (s->state == SCRIPT_TRANSFER) {
+		s->state = SCRIPT_RUN;
+		if (s->transfer_err)
+			script_fail(s, "file transfer failed");
+	}
+
+	script_run(s);
+
+	return 0;
+}
+
+/*
+ * Called when a file transfer is done. A script waiting for it continues
+ * from the timer, the transfer is still being torn down here.
+ */
+void script_transfer_done(int err)
+{
+	if (!script || script->state != SCRIPT_TRANSFER)
+		return;
+
+	script->transfer_err = err;
+	mux_timer_arm(script->timer.fd, 1);
+}
+
+static int script_load(struct script *s, const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	if (!f)
+		return -errno;
+
+	while ((len = getline(&line, &size, f)) >= 0) {
+		char **lines;
+
+		while (len && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = 0;
+
+		lines = realloc(s->lines, (s->num_lines + 1) * sizeof(*lines));
+		if (!lines)
+			break;
+		s->lines = lines;
+		s->lines[s->num_lines++] = line;
+		line = NULL;
+		size = 0;
+	}
+
+	free(line);
+	fclose(f);
+
+	return 0;
+}
+
+static void script_stop(void)
+{
+	if (!script)
+		return;
+
+	/* from within the script, it's freed when the statement is done */
+	if (script->running) {
+		script_finish(script, 1);
+		return;
+	}
+
+	mux_event("script %s stopped", script->name);
+	script_free(script);
+	script = NULL;
+}
+
+static int script_start(char *path, bool batch)
+{
+	struct script *s;
+	int ret;
+
+	if (script && script->running) {
+		printf("a script is running already\n");
+		return -EBUSY;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	s->timer.fd = -1;
+	s->batch = batch;
+	s->name = strdup(path);
+	ret = script_load(s, path);
+	if (ret) {
+		printf("could not open %s: %s\n", path, strerror(-ret));
+		script_free(s);
+		return ret;
+	}
+
+	s->timer.fd = mux_timer_create();
+	if (s->timer.fd < 0) {
+		ret = -errno;
+		script_free(s);
+		return ret;
+	}
+	s->timer.handler = script_timer_handler;
+	mux_add_source(&s->timer);
+
+	script_stop();
+	script = s;
+	script_run(s);
+
+	return 0;
+}
+
+int do_script(char *path)
+{
+	int ret;
+
+	ret = script_start(path, false);
+	if (ret)
+		return ret;
+
+	/* leave the prompt, so the script's output is visible */
+	return MICROCOM_CMD_START;
+}
+
+static struct mux_source batch_timer = { .fd = -1 };
+
+static int batch_timeout_handler(struct mux_source *src)
+{
+	mux_timer_ack(src->fd);
+	mux_event("timeout, script %s not done", script ? script->name : "");
+	mux_stop(SCRIPT_BATCH_TIMEOUT);
+
+	return 0;
+}
+
+/*
+ * Run a script without a terminal, mux_loop() returns the script's status
+ * when it's done, or SCRIPT_BATCH_TIMEOUT after timeout_ms if that's not 0.
+ */
+int script_batch(char *path, unsigned int timeout_ms)
+{
+	if (timeout_ms) {
+		batch_timer.fd = mux_timer_create();
+		if (batch_timer.fd < 0)
+			return -errno;
+		batch_timer.handler = batch_timeout_handler;
+		mux_add_source(&batch_timer);
+		mux_timer_arm(batch_timer.fd, timeout_ms);
+	}
+
+	return script_start(path, true);
+}
+
+/* the running script, NULL if there is none */
+const char *script_name(void)
+{
+	return script ? script->name : NULL;
+}
+
+static int cmd_script(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "stop")) {
+		script_stop();
+		return 0;
+	}
+
+	if (argc > 1)
+		return MICROCOM_CMD_USAGE;
+
+	if (!script)
+		printf("no script running\n");
+	else if (script->state == SCRIPT_EXPECT)
+		printf("%s line %d: waiting for \"%s\"\n", script->name,
+		       script->pc, script->waiting);
+	else if (script->state == SCRIPT_TRANSFER)
+		printf("%s line %d: waiting for the file transfer\n",
+		       script->name, script->pc);
+	else
+		printf("%s line %d\n", script->name, script->pc);
+
+	return 0;
+}
+
+static const char *const script_values[] = { "stop", NULL };
+
+static struct cmd script_cmd = {
+	.name = "script",
+	.fn = cmd_script,
+	.info = "show or stop the running script",
+	.help = "script [stop]",
+	.values = script_values,
+};
+
+void script_init(void)
+{
+	register_command(&script_cmd);
+}
@@ -0,0 +1,72 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPL-2.0-only
+#
+# Run scripts with --run against cat, or the command in $cmd, and check the
+# exit status microcom reports for them. With lrzsz installed, files are sent
+# and received with the X/YMODEM and ZMODEM code as well.
+
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+ret=0
+
+# check <expected status> <script lines>...
+check() {
+	want=$1
+	shift
+	printf '%s\n' "$@" > "$dir/script"
+	./microcom --exec="${cmd:-cat}" --run="$dir/script" --timeout=2 \
+		> "$dir/out" 2>&1 < /dev/null
+	got=$?
+	if [ $got -ne $want ]; then
+		echo "FAIL: exit status $got instead of $want for:"
+		printf '\t%s\n' "$@"
+		sed 's/^/\t| /' "$dir/out"
+		ret=1
+	fi
+}
+
+check 0 'send "hello\n"' 'expect "hello" 2'
+check 0 'send "a\n"; expect "a"; send "b\n"; expect "b"'
+check 3 'exit 3'
+check 1 'send "hello\n"' 'expect "bye" 1'
+check 1 'send "hello\n"' 'expct "hello"'
+check 1 "sb $dir/missing.bin"
+check 1 'timeout'
+check 124 'sleep 5'
+
+# a command closing its output doesn't stop the timeout
+cmd='exec >&- 2>&-; sleep 5'
+check 124 'expect "never"'
+cmd=
+
+# file transfers against lrzsz, the file must arrive unchanged
+# same <protocol> <received file>
+same() {
+	if [ "$(cksum < "$dir/send/data.bin")" != "$(cksum < "$2" 2>/dev/null)" ]; then
+		echo "FAIL: $1 round trip changed the file"
+		ret=1
+	fi
+	rm -f "$2"
+}
+
+if command -v rz > /dev/null && command -v sz > /dev/null; then
+	mkdir "$dir/send" "$dir/recv"
+	head -c 100000 /dev/urandom > "$dir/send/data.bin"
+
+	cmd="cd $dir/recv && exec rb -q"
+	check 0 "sb $dir/send/data.bin"
+	same "YMODEM send" "$dir/recv/data.bin"
+
+	cmd="cd $dir/recv && exec rz -q"
+	check 0 "sz $dir/send/data.bin"
+	same "ZMODEM send" "$dir/recv/data.bin"
+
+	cmd="exec sb -q $dir/send/data.bin"
+	check 0 "rb $dir/recv"
+	same "YMODEM receive" "$dir/recv/data.bin"
+	cmd=
+else
+	echo "lrzsz not installed, skipping the file transfers"
+fi
+
+exit $ret
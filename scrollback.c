@@ -0,0 +1,325 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <regex.h>
+#include <sys/mman.h>
+
+#include "microcom.h"
+
+/*
+ * Scrollback: the last <size> bytes shown on the terminal, kept in memory to
+ * look at them again from the prompt. The buffer is a memfd mapped twice in
+ * a row, so the data is contiguous in memory even when it wraps around the
+ * end: writing is one memcpy() and searching runs over one block with
+ * memmem()/memchr(), which the C library vectorizes.
+ *
+ * Lines are numbered from the start of microcom on, a search shows the
+ * numbers to dump the lines around a match with "scrollback lines".
+ */
+
+struct scrollback {
+	unsigned char *base;
+	size_t size;		/* a power of two */
+	uint64_t head;		/* bytes written ever */
+	uint64_t lines;		/* newlines written ever */
+};
+
+static struct scrollback sb;
+
+/* the scrollback contents and the number of its first line */
+struct sb_view {
+	const unsigned char *data;
+	size_t len;
+	uint64_t first_line;
+};
+
+#define SCROLLBACK_MAX_MATCHES 100
+
+static uint64_t count_lines(const unsigned char *p, const unsigned char *end)
+{
+	uint64_t n = 0;
+
+	while ((p = memchr(p, '\n', end - p))) {
+		n++;
+		p++;
+	}
+
+	return n;
+}
+
+void scrollback_write(const unsigned char *buf, int len)
+{
+	if (!sb.base || len <= 0)
+		return;
+
+	sb.lines += count_lines(buf, buf + len);
+
+	if (len > sb.size) {
+		sb.head += len - sb.size;
+		buf += len - sb.size;
+		len = sb.size;
+	}
+
+	/* the second mapping takes what goes beyond the end */
+	memcpy(sb.base + (sb.head & (sb.size - 1)), buf, len);
+	sb.head += len;
+}
+
+static void sb_get_view(struct sb_view *v)
+{
+	size_t used = min(sb.head, (uint64_t)sb.size);
+
+	v->data = sb.base + ((sb.head - used) & (sb.size - 1));
+	v->len = used;
+	v->first_line = sb.lines - count_lines(v->data, v->data + used) + 1;
+}
+
+/* the start of line n in the view, NULL if it's not there */
+static const unsigned char *sb_line(const struct sb_view *v, uint64_t n)
+{
+	const unsigned char *p = v->data, *end = v->data + v->len;
+	uint64_t line = v->first_line;
+
+	if (n < line)
+		return NULL;
+
+	while (line < n) {
+		p = memchr(p, '\n', end - p);
+		if (!p)
+			return NULL;
+		p++;
+		line++;
+	}
+
+	return p < end ? p : NULL;
+}
+
+/* the start of the last n lines in the view */
+static const unsigned char *sb_tail(const struct sb_view *v, uint64_t n)
+{
+	const unsigned char *p = v->data + v->len, *nl;
+
+	if (!n || !v->len)
+		return p;
+
+	/* a last line without newline counts */
+	if (p[-1] == '\n')
+		p--;
+
+	while (1) {
+		nl = memrchr(v->data, '\n', p - v->data);
+		if (!nl)
+			return v->data;
+		if (!--n)
+			return nl + 1;
+		p = nl;
+	}
+}
+
+static void sb_print_line(uint64_t n, const unsigned char *line,
+			  const unsigned char *end)
+{
+	const unsigned char *eol = memchr(line, '\n', end - line);
+	int len = (eol ? eol : end) - line;
+
+	if (len && line[len - 1] == '\r')
+		len--;
+
+	printf("%llu: %.*s\n", (unsigned long long)n, len, line);
+}
+
+static int sb_search(const struct sb_view *v, const char *pattern, bool regex)
+{
+	const unsigned char *p = v->data, *end = v->data + v->len;
+	const unsigned char *counted = v->data;
+	uint64_t line = v->first_line, matches = 0;
+	size_t patlen = strlen(pattern);
+	regex_t re;
+	int ret;
+
+	if (regex) {
+		ret = regcomp(&re, pattern, REG_EXTENDED | REG_NOSUB | REG_NEWLINE);
+		if (ret) {
+			char msg[128];
+
+			regerror(ret, &re, msg, sizeof(msg));
+			printf("%s\n", msg);
+			return -EINVAL;
+		}
+	}
+
+	while (p < end) {
+		const unsigned char *start, *eol;
+
+		if (regex) {
+			regmatch_t m = { .rm_so = 0 };
+
+			eol = memchr(p, '\n', end - p);
+			m.rm_eo = (eol ? eol : end) - p;
+			if (m.rm_eo && p[m.rm_eo - 1] == '\r')
+				m.rm_eo--;
+			if (regexec(&re, (const char *)p, 1, &m, REG_STARTEND)) {
+				p = eol ? eol + 1 : end;
+				continue;
+			}
+			start = p;
+		} else {
+			const unsigned char *match = memmem(p, end - p, pattern, patlen);
+
+			if (!match)
+				break;
+			start = memrchr(p, '\n', match - p);
+			start = start ? start + 1 : p;
+			eol = memchr(match, '\n', end - match);
+		}
+
+		line += count_lines(counted, start);
+		counted = start;
+		if (++matches <= SCROLLBACK_MAX_MATCHES)
+			sb_print_line(line, start, end);
+
+		p = eol ? eol + 1 : end;
+	}
+
+	if (regex)
+		regfree(&re);
+
+	if (matches > SCROLLBACK_MAX_MATCHES)
+		printf("%llu more matches\n",
+		       (unsigned long long)(matches - SCROLLBACK_MAX_MATCHES));
+	else if (!matches)
+		printf("not found\n");
+
+	return 0;
+}
+
+static int sb_save(const struct sb_view *v, const char *path, const unsigned char *from)
+{
+	const unsigned char *end = v->data + v->len;
+	FILE *f = fopen(path, "w");
+	size_t len;
+
+	if (!f) {
+		printf("cannot open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	len = fwrite(from, 1, end - from, f);
+	if (fclose(f) || len != end - from) {
+		printf("cannot write %s: %s\n", path, strerror(errno));
+		return -EIO;
+	}
+
+	printf("%zu bytes saved\n", (size_t)(end - from));
+
+	return 0;
+}
+
+static int cmd_scrollback(int argc, char *argv[])
+{
+	const unsigned char *from, *to;
+	struct sb_view v;
+
+	sb_get_view(&v);
+
+	if (argc < 2) {
+		printf("%zu of %zu bytes, lines %llu to %llu\n", v.len, sb.size,
+		       (unsigned long long)v.first_line,
+		       (unsigned long long)sb.lines + 1);
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "tail") && argc <= 3) {
+		from = sb_tail(&v, argc == 3 ? strtoull(argv[2], NULL, 0) : 20);
+		to = v.data + v.len;
+		fwrite(from, 1, to - from, stdout);
+		if (from < to && to[-1] != '\n')
+			printf("\n");
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "lines") && (argc == 3 || argc == 4)) {
+		uint64_t first = strtoull(argv[2], NULL, 0);
+		uint64_t last = argc == 4 ? strtoull(argv[3], NULL, 0) : first;
+
+		from = sb_line(&v, first);
+		if (!from || last < first) {
+			printf("no such lines\n");
+			return 0;
+		}
+		to = sb_line(&v, last + 1);
+		if (!to)
+			to = v.data + v.len;
+		fwrite(from, 1, to - from, stdout);
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "search") && argc == 3)
+		return sb_search(&v, argv[2], false);
+
+	if (!strcmp(argv[1], "search") && argc == 4 && !strcmp(argv[2], "-r"))
+		return sb_search(&v, argv[3], true);
+
+	if (!strcmp(argv[1], "save") && (argc == 3 || argc == 4)) {
+		from = argc == 4 ? sb_tail(&v, strtoull(argv[3], NULL, 0)) : v.data;
+		return sb_save(&v, argv[2], from);
+	}
+
+	if (!strcmp(argv[1], "clear") && argc == 2) {
+		/* the numbers go on */
+		sb.head = 0;
+		return 0;
+	}
+
+	return MICROCOM_CMD_USAGE;
+}
+
+static const char *const scrollback_values[] = {
+	"tail", "lines", "search", "save", "clear", NULL
+};
+
+static struct cmd scrollback_cmd = {
+	.name = "scrollback",
+	.fn = cmd_scrollback,
+	.info = "show, search or save the data received lately",
+	.help = "scrollback [tail [<n>]|lines <first> [<last>]|search [-r] <pattern>|save <file> [<lines>]|clear]",
+	.values = scrollback_values,
+	.complete = complete_file,
+};
+
+/* keep the last "<size>[k|M]" bytes shown on the terminal */
+int scrollback_init(const char *spec)
+{
+	size_t size = max(ring_parse_size(spec), (size_t)sysconf(_SC_PAGESIZE));
+	unsigned char *base;
+	int fd;
+
+	fd = memfd_create("microcom-scrollback", MFD_CLOEXEC);
+	if (fd < 0 || ftruncate(fd, size)) {
+		fprintf(stderr, "scrollback: %s\n", strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -errno;
+	}
+
+	/* reserve twice the size, then put the buffer in both halves */
+	base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED ||
+	    mmap(base, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		 fd, 0) == MAP_FAILED ||
+	    mmap(base + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+		 fd, 0) == MAP_FAILED) {
+		fprintf(stderr, "scrollback: %s\n", strerror(errno));
+		close(fd);
+		return -errno;
+	}
+	close(fd);
+
+	sb.base = base;
+	sb.size = size;
+
+	register_command(&scrollback_cmd);
+
+	return 0;
+}
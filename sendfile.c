@@ -0,0 +1,150 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "microcom.h"
+
+/*
+ * Send a file as is, e.g. a script to a shell or an image to loadb. It's
+ * written whenever the port can take more, so flow control (done by the
+ * tty for serial ports) and a slow network just slow it down. For targets
+ * without flow control, the data can be paced with a delay after each
+ * character and/or after each line. The received data is shown as usual.
+ */
+
+/* at most this much per write, so the main loop gets its turn */
+#define SENDFILE_CHUNK	4096
+
+struct sendfile_data {
+	struct transfer t;
+	const unsigned char *map;
+	unsigned int char_ms;
+	unsigned int line_ms;
+};
+
+static int sendfile_receive(struct transfer *t, const unsigned char *buf, int len)
+{
+	/* it's for the terminal */
+	return 0;
+}
+
+static int sendfile_write(struct transfer *t)
+{
+	struct sendfile_data *sf = container_of(t, struct sendfile_data, t);
+	const unsigned char *p = sf->map + t->done;
+	size_t n = min((off_t)SENDFILE_CHUNK, t->size - t->done);
+	unsigned int delay;
+	ssize_t ret;
+
+	if (!n) {
+		transfer_finish(t, 0);
+		return 0;
+	}
+
+	if (sf->char_ms) {
+		n = 1;
+	} else if (sf->line_ms) {
+		const unsigned char *eol = memchr(p, '\n', n);
+
+		if (eol)
+			n = eol - p + 1;
+	}
+
+	ret = ios->write(ios, p, n);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			transfer_finish(t, -errno);
+		return 0;
+	}
+	if (!ret)
+		return 0;
+
+	t->done += ret;
+	transfer_progress(t);
+
+	if (t->done == t->size) {
+		transfer_finish(t, 0);
+		return 0;
+	}
+
+	delay = p[ret - 1] == '\n' && sf->line_ms ? sf->line_ms : sf->char_ms;
+	if (delay) {
+		transfer_want_write(t, false);
+		transfer_set_timeout(t, delay);
+	}
+
+	return 0;
+}
+
+/* the pacing delay is over */
+static void sendfile_timeout(struct transfer *t)
+{
+	transfer_want_write(t, true);
+}
+
+static void sendfile_free(struct transfer *t)
+{
+	struct sendfile_data *sf = container_of(t, struct sendfile_data, t);
+
+	if (sf->map)
+		munmap((void *)sf->map, t->size);
+	free(t->path);
+	free(sf);
+}
+
+int sendfile_start(char *path, unsigned int char_ms, unsigned int line_ms)
+{
+	struct sendfile_data *sf;
+	struct stat st;
+	int fd, ret;
+
+	sf = calloc(1, sizeof(*sf));
+	if (!sf)
+		return -ENOMEM;
+
+	sf->t.proto = "sendfile";
+	sf->t.send = true;
+	sf->t.path = strdup(path);
+	sf->t.receive = sendfile_receive;
+	sf->t.timeout = sendfile_timeout;
+	sf->t.write = sendfile_write;
+	sf->t.free = sendfile_free;
+	sf->char_ms = char_ms;
+	sf->line_ms = line_ms;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		ret = -errno;
+		printf("cannot open %s: %s\n", path, strerror(errno));
+		goto err;
+	}
+	sf->t.size = st.st_size;
+
+	if (st.st_size) {
+		sf->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (sf->map == MAP_FAILED) {
+			ret = -errno;
+			sf->map = NULL;
+			printf("cannot map %s: %s\n", path, strerror(errno));
+			goto err;
+		}
+		madvise((void *)sf->map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	fd = -1;
+
+	ret = transfer_start(&sf->t);
+	if (ret)
+		goto err;
+
+	transfer_want_write(&sf->t, true);
+
+	return 0;
+err:
+	if (fd >= 0)
+		close(fd);
+	sendfile_free(&sf->t);
+	return ret;
+}
@@ -215,7 +215,7 @@ struct ios_ops * serial_init(char *device)
 	struct ios_ops *ops;
 	int fd, ret;
 
-	ops = malloc(sizeof(*ops));
+	ops = calloc(1, sizeof(*ops));
 	if (!ops)
 		return NULL;
 
@@ -226,6 +226,7 @@ struct ios_ops * serial_init(char *device)
 	ops->set_handshake_line = serial_set_handshake_line;
 	ops->send_break = serial_send_break;
 	ops->exit = serial_exit;
+	ops->raw = true;
 
 	/* open the device */
 	fd = open(device, O_RDWR | O_NONBLOCK);
@@ -0,0 +1,224 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "microcom.h"
+
+/*
+ * Raw stream sockets: the data is passed through unmodified, there is no
+ * telnet option processing. Used for e.g. QEMU's "-serial tcp:" and
+ * "-serial unix:" or socat.
+ */
+
+static ssize_t socket_write(struct ios_ops *ios, const unsigned char *buf, size_t count)
+{
+	return send(ios->fd, buf, count, MSG_NOSIGNAL);
+}
+
+static ssize_t socket_read(struct ios_ops *ios, unsigned char *buf, size_t count)
+{
+	return read(ios->fd, buf, count);
+}
+
+static ssize_t tcp_read(struct ios_ops *ios, unsigned char *buf, size_t count)
+{
+	ssize_t ret;
+
+	ret = read(ios->fd, buf, count);
+	if (ret > 0)
+		net_quickack(ios->fd);
+
+	return ret;
+}
+
+static int socket_set_speed(struct ios_ops *ios, unsigned long speed)
+{
+	return 0;
+}
+
+static int socket_set_flow(struct ios_ops *ios, int flow)
+{
+	return 0;
+}
+
+static int socket_send_break(struct ios_ops *ios)
+{
+	return 0;
+}
+
+static void socket_exit(struct ios_ops *ios)
+{
+	close(ios->fd);
+}
+
+static struct ios_ops *socket_ios_alloc(void)
+{
+	struct ios_ops *ios;
+
+	ios = calloc(1, sizeof(*ios));
+	if (!ios)
+		return NULL;
+
+	ios->write = socket_write;
+	ios->read = socket_read;
+	ios->set_speed = socket_set_speed;
+	ios->set_flow = socket_set_flow;
+	ios->send_break = socket_send_break;
+	ios->exit = socket_exit;
+	ios->raw = true;
+
+	return ios;
+}
+
+struct ios_ops *tcp_init(char *hostport)
+{
+	struct ios_ops *ios;
+	char *host, *port;
+	char peer[300];
+	int sock;
+
+	ios = socket_ios_alloc();
+	if (!ios)
+		return NULL;
+
+	ios->read = tcp_read;
+
+	if (net_parse_hostport(hostport, &host, &port, NULL) || !port) {
+		fprintf(stderr, "failed to parse host:port\n");
+		free(ios);
+		return NULL;
+	}
+
+	sock = net_connect(host, port, connect_timeout * 1000);
+	if (sock < 0) {
+		fprintf(stderr, "failed to connect: %s\n", strerror(-sock));
+		free(ios);
+		return NULL;
+	}
+
+	ios->fd = sock;
+
+	if (!net_peer_name(sock, peer, sizeof(peer)))
+		printf("connected to %s\n", peer);
+
+	return ios;
+}
+
+/* listen on [host:]port, all addresses if no host is given */
+int tcp_listen(char *hostport)
+{
+	struct addrinfo hints = {
+		.ai_flags = AI_PASSIVE,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *addrinfo, *ai;
+	char *host, *port;
+	int fd = -1, one = 1;
+	int ret;
+
+	if (strchr(hostport, ':')) {
+		if (net_parse_hostport(hostport, &host, &port, NULL) || !port)
+			return -EINVAL;
+		if (!*host)
+			host = NULL;
+	} else {
+		host = NULL;
+		port = hostport;
+	}
+
+	ret = getaddrinfo(host, port, &hints, &addrinfo);
+	if (ret) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		return -EINVAL;
+	}
+
+	for (ai = addrinfo; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 1))
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	if (fd < 0)
+		fd = -errno;
+
+	freeaddrinfo(addrinfo);
+
+	return fd;
+}
+
+struct ios_ops *tcp_accept(int listenfd)
+{
+	struct ios_ops *ios;
+	char peer[300];
+	int fd;
+
+	fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	ios = socket_ios_alloc();
+	if (!ios) {
+		close(fd);
+		return NULL;
+	}
+
+	ios->read = tcp_read;
+	ios->fd = fd;
+	net_setup_socket(fd);
+
+	if (!net_peer_name(fd, peer, sizeof(peer)))
+		mux_event("client %s connected", peer);
+
+	return ios;
+}
+
+struct ios_ops *unix_init(char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	struct ios_ops *ios;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "socket path too long: %s\n", path);
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	ios = socket_ios_alloc();
+	if (!ios)
+		return NULL;
+
+	ios->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (ios->fd < 0) {
+		perror("socket");
+		free(ios);
+		return NULL;
+	}
+
+	if (connect(ios->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		fprintf(stderr, "failed to connect to %s: %s\n", path, strerror(errno));
+		close(ios->fd);
+		free(ios);
+		return NULL;
+	}
+
+	printf("connected to %s\n", path);
+
+	return ios;
+}
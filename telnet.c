@@ -11,9 +11,40 @@
 #include <sys/socket.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef USE_MCCP
+#include <zlib.h>
+#endif
 
 #include "microcom.h"
 
+#define RECONNECT_DELAY_MIN_MS 50
+
+int reconnect_max_delay;
+
+struct telnet_data {
+	struct ios_ops ios;
+	char *host;
+	char *port;
+	struct mux_source reconnect;
+	struct mux_source connecting;	/* socket of a reconnect in progress */
+	unsigned int reconnect_delay;
+	unsigned int reconnect_attempt;
+	/* incomplete command at the end of the previous read */
+	unsigned char partial[256];
+	size_t partial_len;
+#ifdef USE_MCCP
+	z_stream zs;
+	bool mccp_active;	/* the server stream is compressed */
+	bool mccp_starting;	/* IAC SB COMPRESS2 IAC SE just received */
+	bool mccp_flush;	/* inflate() might have more output */
+	unsigned char zbuf[16384];
+#endif
+};
+
+static void telnet_connection_lost(struct ios_ops *ios);
+
 static int telnet_printf(struct ios_ops *ios, const char *format, ...)
 {
 	char buf[20];
@@ -34,7 +65,7 @@ static int telnet_printf(struct ios_ops *ios, const char *format, ...)
 	}
 
 	while (written < size) {
-		ret = write(ios->fd, buf + written, size - written);
+		ret = send(ios->fd, buf + written, size - written, MSG_NOSIGNAL);
 		if (ret < 0)
 			return ret;
 
@@ -227,11 +258,33 @@ static int do_binary_transmission_option(struct ios_ops *ios, unsigned char *buf
 	return -EINVAL;
 }
 
+#ifdef USE_MCCP
+/*
+ * This is called with buf[-2:0] being IAC SB COMPRESS2. Everything after the
+ * following IAC SE is compressed (MCCP2), the caller takes care of that.
+ */
+static int do_compress2_option(struct ios_ops *ios, unsigned char *buf, int len)
+{
+	struct telnet_data *telnet = container_of(ios, struct telnet_data, ios);
+
+	if (len < 3 || buf[1] != IAC || buf[2] != SE) {
+		fprintf(stderr, "Incomplete or broken SB (COMPRESS2)\n");
+		return -EINVAL;
+	}
+
+	dbg_printf("IAC SE\n");
+	telnet->mccp_starting = true;
+
+	return 3;
+}
+#endif
+
 struct telnet_option {
 	unsigned char id;
 	const char *name;
 	int (*subneg_handler)(struct ios_ops *ios, unsigned char *buf, int len);
 	bool sent_will;
+	bool accept_will;
 };
 
 #define TELNET_OPTION(x)        .id = TELNET_OPTION_ ## x, .name = #x
@@ -249,6 +302,12 @@ static const struct telnet_option telnet_options[] = {
 		TELNET_OPTION(ECHO),
 	}, {
 		TELNET_OPTION(SUPPRESS_GO_AHEAD),
+#ifdef USE_MCCP
+	}, {
+		TELNET_OPTION(COMPRESS2),
+		.subneg_handler = do_compress2_option,
+		.accept_will = true,
+#endif
 	}
 };
 
@@ -327,7 +386,11 @@ static int handle_command(struct ios_ops *ios, unsigned char *buf, int len)
 		else
 			dbg_printf("WILL #%d", buf[2]);
 
-		if (option && option->subneg_handler) {
+		if (option && option->accept_will) {
+			/* the server offers something we want */
+			dbg_printf(" -> DO\n");
+			telnet_printf(ios, "%c%c%c", IAC, DO, buf[2]);
+		} else if (option && option->subneg_handler) {
 			/* ok, we already requested that, so take this as
 			 * confirmation to actually do COM_PORT stuff.
 			 * Everything is fine. Don't reconfirm to prevent an
@@ -397,38 +460,215 @@ static ssize_t telnet_write(struct ios_ops *ios, const unsigned char *buf, size_
 	 */
 	while ((iac = memchr(buf + handled, IAC, count - handled)) != NULL) {
 		if (iac - (buf + handled)) {
-			ret = write(ios->fd, buf + handled, iac - (buf + handled));
+			ret = send(ios->fd, buf + handled, iac - (buf + handled), MSG_NOSIGNAL);
 			if (ret < 0)
 				return ret;
 			handled += ret;
 		} else {
-			dprintf(ios->fd, "%c%c", IAC, IAC);
+			static const unsigned char iaciac[] = { IAC, IAC };
+
+			ret = send(ios->fd, iaciac, sizeof(iaciac), MSG_NOSIGNAL);
+			if (ret < 0)
+				return ret;
 			handled += 1;
 		}
 	}
 
 	/* Send the remaining data that needs no quoting. */
-	ret = write(ios->fd, buf + handled, count - handled);
+	ret = send(ios->fd, buf + handled, count - handled, MSG_NOSIGNAL);
 	if (ret < 0)
 		return ret;
 	return ret + handled;
 }
 
+#ifdef USE_MCCP
+static void mccp_start(struct telnet_data *telnet, unsigned char *buf, size_t len)
+{
+	z_stream *zs = &telnet->zs;
+
+	/*
+	 * buf holds the first compressed bytes, zs->next_in the rest of the data
+	 * read from the socket that wasn't passed to the caller yet.
+	 */
+	assert(len + zs->avail_in <= sizeof(telnet->zbuf));
+	if (zs->avail_in)
+		memmove(telnet->zbuf + len, zs->next_in, zs->avail_in);
+	memcpy(telnet->zbuf, buf, len);
+
+	zs->zalloc = Z_NULL;
+	zs->zfree = Z_NULL;
+	zs->opaque = Z_NULL;
+	zs->next_in = telnet->zbuf;
+	zs->avail_in += len;
+
+	if (inflateInit(zs) != Z_OK) {
+		fprintf(stderr, "inflateInit: %s\n", zs->msg ? zs->msg : "failed");
+		return;
+	}
+
+	dbg_printf("compression started\n");
+	telnet->mccp_active = true;
+	telnet->mccp_flush = false;
+}
+
+static void mccp_reset(struct telnet_data *telnet)
+{
+	if (telnet->mccp_active)
+		inflateEnd(&telnet->zs);
+
+	telnet->mccp_active = false;
+	telnet->mccp_starting = false;
+	telnet->zs.avail_in = 0;
+}
+
+static ssize_t mccp_inflate(struct telnet_data *telnet, unsigned char *buf, size_t count)
+{
+	z_stream *zs = &telnet->zs;
+	ssize_t ret;
+	size_t len;
+
+	if (!zs->avail_in && !telnet->mccp_flush) {
+		ret = read(telnet->ios.fd, telnet->zbuf, sizeof(telnet->zbuf));
+		if (ret <= 0)
+			return ret;
+
+		zs->next_in = telnet->zbuf;
+		zs->avail_in = ret;
+	}
+
+	zs->next_out = buf;
+	zs->avail_out = count;
+
+	ret = inflate(zs, Z_SYNC_FLUSH);
+	len = count - zs->avail_out;
+	telnet->mccp_flush = !zs->avail_out;
+
+	if (ret == Z_STREAM_END) {
+		/* the remaining input is uncompressed again */
+		dbg_printf("compression ended\n");
+		inflateEnd(zs);
+		telnet->mccp_active = false;
+	} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+		fprintf(stderr, "decompression failed: %s\n", zs->msg ? zs->msg : "");
+		mccp_reset(telnet);
+		errno = EIO;
+		return -1;
+	}
+
+	if (!len) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	return len;
+}
+
+static int telnet_pending(struct ios_ops *ios)
+{
+	struct telnet_data *telnet = container_of(ios, struct telnet_data, ios);
+
+	return telnet->zs.avail_in || (telnet->mccp_active && telnet->mccp_flush);
+}
+#endif
+
+/* get the raw telnet stream, i.e. before handling IAC sequences */
+static ssize_t telnet_fill(struct telnet_data *telnet, unsigned char *buf, size_t count)
+{
+#ifdef USE_MCCP
+	z_stream *zs = &telnet->zs;
+
+	if (telnet->mccp_active)
+		return mccp_inflate(telnet, buf, count);
+
+	/* uncompressed data following the end of a compressed stream */
+	if (zs->avail_in) {
+		count = min(count, (size_t)zs->avail_in);
+		memcpy(buf, zs->next_in, count);
+		zs->next_in += count;
+		zs->avail_in -= count;
+		return count;
+	}
+
+	/* make sure that data following IAC SB COMPRESS2 fits into zbuf */
+	count = min(count, sizeof(telnet->zbuf));
+#endif
+
+	return read(telnet->ios.fd, buf, count);
+}
+
+/* check if buf (starting with IAC) holds a complete command */
+static bool telnet_command_complete(const unsigned char *buf, size_t len)
+{
+	size_t i;
+
+	if (len < 2)
+		return false;
+
+	switch (buf[1]) {
+	case WILL:
+	case WONT:
+	case DO:
+	case DONT:
+		return len >= 3;
+	case SB:
+		for (i = 2; i + 1 < len; i++) {
+			if (buf[i] != IAC)
+				continue;
+			if (buf[i + 1] == SE)
+				return true;
+			i++;
+		}
+		return false;
+	default:
+		return true;
+	}
+}
+
 static ssize_t telnet_read(struct ios_ops *ios, unsigned char *buf, size_t count)
 {
+	struct telnet_data *telnet = container_of(ios, struct telnet_data, ios);
+	size_t partial_len = telnet->partial_len;
 	ssize_t ret;
 	unsigned char *iac;
 	size_t handled = 0;
 
-	ret = read(ios->fd, buf, count);
+	assert(count > partial_len);
+
+	ret = telnet_fill(telnet, buf + partial_len, count - partial_len);
+
+	if (ret > 0 && partial_len) {
+		memcpy(buf, telnet->partial, partial_len);
+		telnet->partial_len = 0;
+		ret += partial_len;
+	}
+
+	if (reconnect_max_delay &&
+	    (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR))) {
+		telnet_connection_lost(ios);
+		errno = EAGAIN;
+		return -1;
+	}
 
 	if (ret <= 0)
 		return ret;
 
+	net_quickack(ios->fd);
+
 	while ((iac = memchr(buf + handled, IAC, ret - handled)) != NULL) {
 		handled = iac - buf;
 
-		/* XXX: possible out-of-bounds access */
+		if (!telnet_command_complete(iac, ret - handled)) {
+			/* keep it until the rest arrives */
+			if (ret - handled > sizeof(telnet->partial)) {
+				fprintf(stderr, "Overlong SB string\n");
+				return -EINVAL;
+			}
+			telnet->partial_len = ret - handled;
+			memcpy(telnet->partial, iac, telnet->partial_len);
+			ret = handled;
+			break;
+		}
+
 		if (((unsigned char *)iac)[1] == IAC) {
 			/* duplicated IAC = one payload IAC */
 			ret -= 1;
@@ -440,6 +680,16 @@ static ssize_t telnet_read(struct ios_ops *ios, unsigned char *buf, size_t count
 			if (iaclen < 0)
 				return iaclen;
 
+#ifdef USE_MCCP
+			if (telnet->mccp_starting) {
+				/* the rest of the buffer is compressed */
+				telnet->mccp_starting = false;
+				mccp_start(telnet, iac + iaclen, ret - (handled + iaclen));
+				ret = handled;
+				break;
+			}
+#endif
+
 			memmove(iac, iac + iaclen, ret - (handled + iaclen));
 			ret -= iaclen;
 		}
@@ -468,7 +718,7 @@ static int telnet_set_speed(struct ios_ops *ios, unsigned long speed)
 	buf2[offset++] = SE;
 
 	dbg_printf("-> IAC SB COM_PORT_CONTROL SET_BAUDRATE_CS 0x%lx IAC SE\n", speed);
-	write(ios->fd, buf2, offset);
+	send(ios->fd, buf2, offset, MSG_NOSIGNAL);
 
 	return 0;
 }
@@ -493,7 +743,7 @@ static int telnet_set_flow(struct ios_ops *ios, int flow)
 	}
 
 	dbg_printf("-> IAC SB COM_PORT_CONTROL SET_CONTROL_CS %d IAC SE\n", buf2[4]);
-	write(ios->fd, buf2, sizeof(buf2));
+	send(ios->fd, buf2, sizeof(buf2), MSG_NOSIGNAL);
 
 	return 0;
 }
@@ -502,110 +752,196 @@ static int telnet_send_break(struct ios_ops *ios)
 {
 	unsigned char buf2[] = { IAC, BREAK };
 
-	write(ios->fd, buf2, sizeof(buf2));
+	send(ios->fd, buf2, sizeof(buf2), MSG_NOSIGNAL);
 
 	return 0;
 }
 
-static void telnet_exit(struct ios_ops *ios)
+/*
+ * announce the options we want to use, sent after each (re)connect. The
+ * server may have closed the connection already, that is noticed on read.
+ */
+static void telnet_negotiate(int sock)
+{
+	static const unsigned char options[] = {
+		IAC, WILL, TELNET_OPTION_COM_PORT_CONTROL,
+		IAC, DO, TELNET_OPTION_BINARY_TRANSMISSION,
+		IAC, WILL, TELNET_OPTION_BINARY_TRANSMISSION,
+	};
+
+	dbg_printf("-> WILL COM_PORT_CONTROL\n");
+	dbg_printf("-> DO BINARY_TRANSMISSION\n");
+	dbg_printf("-> WILL BINARY_TRANSMISSION\n");
+
+	/* in a single segment */
+	send(sock, options, sizeof(options), MSG_NOSIGNAL);
+}
+
+static void telnet_schedule_reconnect(struct telnet_data *telnet)
+{
+	unsigned int delay = telnet->reconnect_delay;
+
+	/* wait somewhere between delay/2 and delay to spread out clients */
+	delay = delay / 2 + random() % (delay / 2 + 1);
+	dbg_printf("reconnecting in %u ms\n", delay);
+	mux_timer_arm(telnet->reconnect.fd, delay);
+
+	telnet->reconnect_delay = min(telnet->reconnect_delay * 2,
+				      (unsigned int)reconnect_max_delay);
+}
+
+/* the connect of telnet_reconnect() completed or failed */
+static int telnet_connected(struct mux_source *src)
+{
+	struct telnet_data *telnet = container_of(src, struct telnet_data, connecting);
+	struct ios_ops *ios = &telnet->ios;
+	int sock = src->fd, ret;
+	char peer[300];
+
+	mux_del_source(src);
+	src->fd = -1;
+
+	ret = net_connect_finish(sock);
+	if (ret) {
+		dbg_printf("reconnect: %s\n", strerror(-ret));
+		close(sock);
+		telnet->reconnect_attempt++;
+		telnet_schedule_reconnect(telnet);
+		return 0;
+	}
+
+	ios->fd = sock;
+	telnet_negotiate(sock);
+	telnet_set_speed(ios, current_speed);
+	telnet_set_flow(ios, current_flow);
+
+	mux_del_source(&telnet->reconnect);
+	close(telnet->reconnect.fd);
+
+	if (net_peer_name(sock, peer, sizeof(peer)))
+		strcpy(peer, telnet->host);
+	mux_event("reconnected to %s", peer);
+
+	return 0;
+}
+
+/*
+ * The reconnect timer: start a connect without blocking, the terminal stays
+ * usable. The timer then limits how long it may take.
+ */
+static int telnet_reconnect(struct mux_source *src)
 {
+	struct telnet_data *telnet = container_of(src, struct telnet_data, reconnect);
+	int sock;
+
+	mux_timer_ack(src->fd);
+
+	if (telnet->connecting.fd >= 0) {
+		dbg_printf("reconnect: %s\n", strerror(ETIMEDOUT));
+		mux_del_source(&telnet->connecting);
+		close(telnet->connecting.fd);
+		telnet->connecting.fd = -1;
+		telnet->reconnect_attempt++;
+		telnet_schedule_reconnect(telnet);
+		return 0;
+	}
+
+	sock = net_connect_start(telnet->host, telnet->port,
+				 telnet->reconnect_attempt);
+	if (sock < 0) {
+		dbg_printf("reconnect: %s\n", strerror(-sock));
+		telnet->reconnect_attempt++;
+		telnet_schedule_reconnect(telnet);
+		return 0;
+	}
+
+	telnet->connecting.fd = sock;
+	telnet->connecting.handler = telnet_connected;
+	telnet->connecting.write = true;
+	mux_add_source(&telnet->connecting);
+	mux_timer_arm(src->fd, connect_timeout > 0 ?
+		      min(connect_timeout * 1000, reconnect_max_delay) :
+		      reconnect_max_delay);
+
+	return 0;
+}
+
+static void telnet_connection_lost(struct ios_ops *ios)
+{
+	struct telnet_data *telnet = container_of(ios, struct telnet_data, ios);
+
 	close(ios->fd);
+	ios->fd = -1;
+	telnet->partial_len = 0;
+#ifdef USE_MCCP
+	mccp_reset(telnet);
+#endif
+
+	mux_event("connection to %s lost, reconnecting", telnet->host);
+
+	telnet->reconnect.fd = mux_timer_create();
+	if (telnet->reconnect.fd < 0) {
+		perror("timerfd_create");
+		microcom_exit(0);
+		exit(1);
+	}
+
+	telnet->reconnect.handler = telnet_reconnect;
+	telnet->reconnect_delay = RECONNECT_DELAY_MIN_MS;
+	telnet->reconnect_attempt = 0;
+	telnet->connecting.fd = -1;
+	mux_add_source(&telnet->reconnect);
+	telnet_schedule_reconnect(telnet);
+}
+
+static void telnet_exit(struct ios_ops *ios)
+{
+	if (ios->fd >= 0)
+		close(ios->fd);
 }
 
 struct ios_ops *telnet_init(char *hostport)
 {
-	char *port;
-	int ret;
-	struct addrinfo *addrinfo, *ai;
-	struct addrinfo hints;
+	struct telnet_data *telnet;
 	struct ios_ops *ios;
-	char connected_host[256], connected_port[30];
+	char peer[300];
+	int sock;
 
-	ios = malloc(sizeof(*ios));
-	if (!ios)
+	telnet = calloc(1, sizeof(*telnet));
+	if (!telnet)
 		return NULL;
 
+	ios = &telnet->ios;
 	ios->write = telnet_write;
 	ios->read = telnet_read;
 	ios->set_speed = telnet_set_speed;
 	ios->set_flow = telnet_set_flow;
 	ios->send_break = telnet_send_break;
 	ios->exit = telnet_exit;
+#ifdef USE_MCCP
+	ios->pending = telnet_pending;
+#endif
 
-	memset(&hints, '\0', sizeof(hints));
-	hints.ai_flags = AI_ADDRCONFIG;
-	hints.ai_socktype = SOCK_STREAM;
-
-	if (hostport[0] == '[') {
-		char *s = strchr(++hostport, ']');
-
-		if (s)
-			/* terminate hostport after host portion */
-			*s = '\0';
-
-		if (s && s[1] == ':')
-			port = s + 2;
-		else if (s && s[1] == '\0')
-			port = "23";
-		else {
-			fprintf(stderr, "failed to parse host:port");
-			free(ios);
-			return NULL;
-		}
-	} else {
-		port = strchr(hostport, ':');
-		if (port) {
-			/* terminate hostport after host portion */
-			*port = '\0';
-
-			port += 1;
-		} else
-			port = "23";
+	if (net_parse_hostport(hostport, &telnet->host, &telnet->port, "23")) {
+		fprintf(stderr, "failed to parse host:port");
+		free(telnet);
+		return NULL;
 	}
 
-	ret = getaddrinfo(hostport, port, &hints, &addrinfo);
-	if (ret) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+	sock = net_connect(telnet->host, telnet->port, connect_timeout * 1000);
+	if (sock < 0) {
+		fprintf(stderr, "failed to connect: %s\n", strerror(-sock));
+		free(telnet);
 		return NULL;
 	}
 
-	for (ai = addrinfo; ai != NULL; ai = ai->ai_next) {
-		int sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-		if (sock < 0)
-			continue;
+	ios->fd = sock;
 
-		if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
-			close(sock);
-			continue;
-		}
+	if (!net_peer_name(sock, peer, sizeof(peer)))
+		printf("connected to %s\n", peer);
 
-		ios->fd = sock;
+	srandom(getpid() ^ time(NULL));
+	telnet_negotiate(sock);
 
-		ret = getnameinfo(ai->ai_addr, ai->ai_addrlen,
-				  connected_host, sizeof(connected_host),
-				  connected_port, sizeof(connected_port),
-				  NI_NUMERICHOST | NI_NUMERICSERV);
-		if (ret) {
-			fprintf(stderr, "getnameinfo: %s\n", gai_strerror(ret));
-			goto out;
-		}
-		printf("connected to %s (port %s)\n", connected_host, connected_port);
-
-		/* send intent we WILL do COM_PORT stuff */
-		dbg_printf("-> WILL COM_PORT_CONTROL\n");
-		dprintf(sock, "%c%c%c", IAC, WILL, TELNET_OPTION_COM_PORT_CONTROL);
-		dbg_printf("-> DO BINARY_TRANSMISSION\n");
-		dprintf(sock, "%c%c%c", IAC, DO, TELNET_OPTION_BINARY_TRANSMISSION);
-		dbg_printf("-> WILL BINARY_TRANSMISSION\n");
-		dprintf(sock, "%c%c%c", IAC, WILL, TELNET_OPTION_BINARY_TRANSMISSION);
-		goto out;
-	}
-
-	perror("failed to connect");
-	free(ios);
-	ios = NULL;
-out:
-	freeaddrinfo(addrinfo);
 	return ios;
 }
-
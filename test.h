@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef __TEST_H
+#define __TEST_H
+
+/*
+ * Shared by the test programs run by "make check". A test includes the
+ * source file it tests and then this header, which defines what most of them
+ * need from the rest of microcom and the helpers to check and time things.
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+struct ios_ops *ios;
+int debug;
+
+void mux_event(const char *format, ...)
+{
+}
+
+int register_command(struct cmd *cmd)
+{
+	return 0;
+}
+
+static int failures;
+
+#define check(cond, ...) do {					\
+	if (!(cond)) {						\
+		printf("FAIL %s:%d: ", __func__, __LINE__);	\
+		printf(__VA_ARGS__);				\
+		printf("\n");					\
+		failures++;					\
+	}							\
+} while (0)
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif /* __TEST_H */
@@ -0,0 +1,1032 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#define _GNU_SOURCE
+#include "config.h"
+
+#include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "microcom.h"
+
+/*
+ * File transfers, e.g. to load an image with U-Boot's or barebox' loadx and
+ * loady or to send a file to rz. A transfer runs from the main loop: while
+ * it's active the data from the port goes to the transfer first. The
+ * protocols take all of it, so the terminal and the logfile only get the
+ * start and the end of the transfer. The keyboard is ignored, except for the
+ * escape character ("transfer abort" cancels).
+ *
+ * X/YMODEM is implemented here, ZMODEM (sending only) in zmodem.c and
+ * sending a file as is in sendfile.c.
+ */
+
+#define SOH	0x01
+#define STX	0x02
+#define EOT	0x04
+#define ACK	0x06
+#define BS	0x08
+#define NAK	0x15
+#define CAN	0x18
+#define CPMEOF	0x1a
+
+#define XMODEM_RETRIES		10
+#define XMODEM_START_TIMEOUT	60000
+#define XMODEM_TIMEOUT		10000
+/* the receiver asks for the transfer to start this often */
+#define XMODEM_POLL		3000
+/*
+ * A block is given up when nothing of it arrived for this long, the time
+ * between characters (a 1K block alone takes over a second at 9600 baud).
+ */
+#define XMODEM_CHAR_TIMEOUT	1000
+/* header, 1K of data and CRC */
+#define XMODEM_BLOCK_MAX	(3 + 1024 + 2)
+
+static struct transfer *active;
+
+static uint16_t crc16_table[256];
+static uint32_t crc32_table[256];
+
+static void crc_init(void)
+{
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		uint16_t c16 = i << 8;
+		uint32_t c32 = i;
+
+		for (j = 0; j < 8; j++) {
+			c16 = c16 & 0x8000 ? (c16 << 1) ^ 0x1021 : c16 << 1;
+			c32 = c32 & 1 ? (c32 >> 1) ^ 0xedb88320 : c32 >> 1;
+		}
+		crc16_table[i] = c16;
+		crc32_table[i] = c32;
+	}
+}
+
+/* CRC-16/XMODEM, start with 0 */
+uint16_t crc16_ccitt(uint16_t crc, const unsigned char *buf, size_t len)
+{
+	while (len--)
+		crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ *buf++) & 0xff];
+
+	return crc;
+}
+
+/* CRC-32 (IEEE 802.3), start with 0xffffffff and invert the result */
+uint32_t crc32_update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+	while (len--)
+		crc = (crc >> 8) ^ crc32_table[(crc ^ *buf++) & 0xff];
+
+	return crc;
+}
+
+static double transfer_elapsed(struct transfer *t, struct timespec *now)
+{
+	clock_gettime(CLOCK_MONOTONIC, now);
+
+	return now->tv_sec - t->start.tv_sec +
+		(now->tv_nsec - t->start.tv_nsec) / 1e9;
+}
+
+/* show the progress on the terminal, not more than four times a second */
+void transfer_progress(struct transfer *t)
+{
+	struct timespec now;
+	double secs = transfer_elapsed(t, &now);
+	double rate;
+
+	if ((now.tv_sec - t->last_progress.tv_sec) * 1000 +
+	    (now.tv_nsec - t->last_progress.tv_nsec) / 1000000 < 250)
+		return;
+	t->last_progress = now;
+
+	rate = secs > 0 ? t->done / secs : 0;
+
+	if (t->size > 0 && rate > 0)
+		printf("\r%s: %lld/%lld KiB (%d%%), %.1f KiB/s, %d s left  ",
+		       t->proto, (long long)t->done / 1024,
+		       (long long)t->size / 1024, (int)(t->done * 100 / t->size),
+		       rate / 1024, (int)((t->size - t->done) / rate));
+	else
+		printf("\r%s: %lld KiB, %.1f KiB/s  ", t->proto,
+		       (long long)t->done / 1024, rate / 1024);
+	fflush(stdout);
+}
+
+static int transfer_timer_handler(struct mux_source *src)
+{
+	struct transfer *t = container_of(src, struct transfer, timer);
+
+	mux_timer_ack(src->fd);
+	t->timeout(t);
+
+	return 0;
+}
+
+static int transfer_writer(struct mux_writer *w)
+{
+	struct transfer *t = container_of(w, struct transfer, writer);
+
+	return t->write(t);
+}
+
+/* 0 stops the timer */
+void transfer_set_timeout(struct transfer *t, unsigned int ms)
+{
+	mux_timer_arm(t->timer.fd, ms);
+}
+
+void transfer_want_write(struct transfer *t, bool enable)
+{
+	mux_set_writer(enable ? &t->writer : NULL);
+}
+
+bool transfer_active(void)
+{
+	return active;
+}
+
+struct transfer *transfer_current(void)
+{
+	return active;
+}
+
+int transfer_start(struct transfer *t)
+{
+	t->timer.fd = mux_timer_create();
+	if (t->timer.fd < 0)
+		return -errno;
+
+	t->timer.handler = transfer_timer_handler;
+	mux_add_source(&t->timer);
+	t->writer.write = transfer_writer;
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+	active = t;
+
+	if (t->path)
+		mux_event("%s: %s %s", t->proto, t->send ? "sending" : "receiving",
+			  t->path);
+	else
+		mux_event("%s: %s", t->proto, t->send ? "sending" : "receiving");
+
+	return 0;
+}
+
+/* the transfer is freed, the caller must not touch it anymore */
+void transfer_finish(struct transfer *t, int err)
+{
+	struct timespec now;
+	double secs = transfer_elapsed(t, &now);
+
+	transfer_want_write(t, false);
+	mux_del_source(&t->timer);
+	close(t->timer.fd);
+
+	if (err)
+		mux_event("%s: failed after %lld bytes: %s", t->proto,
+			  (long long)t->done, strerror(-err));
+	else
+		mux_event("%s: %lld bytes in %.1f s (%.1f KiB/s)", t->proto,
+			  (long long)t->done, secs,
+			  secs > 0 ? t->done / secs / 1024 : 0);
+
+	active = NULL;
+	t->free(t);
+
+	script_transfer_done(err);
+}
+
+/* cancel the transfer for the other side as well */
+void transfer_abort(struct transfer *t, int err)
+{
+	static const unsigned char cancel[] = {
+		CAN, CAN, CAN, CAN, CAN, CAN, CAN, CAN,
+		BS, BS, BS, BS, BS, BS, BS, BS,
+	};
+
+	ios->write(ios, cancel, sizeof(cancel));
+	transfer_finish(t, err);
+}
+
+/* returns the number of bytes the transfer took */
+int transfer_receive(const unsigned char *buf, int len)
+{
+	if (!active || len <= 0)
+		return 0;
+
+	return active->receive(active, buf, len);
+}
+
+struct xmodem {
+	struct transfer t;
+	bool ymodem;
+	bool crc;
+	bool onek;		/* send 1024 byte blocks */
+	int fd;
+	int state;
+	int retries;
+	int cans;
+	unsigned char blk;	/* number of the current block */
+
+	/* sending: the block in flight */
+	unsigned char block[XMODEM_BLOCK_MAX];
+	int blocklen;
+	int datalen;
+
+	/* what the port didn't take yet, see xmodem_out() */
+	unsigned char out[XMODEM_BLOCK_MAX + 16];
+	int outlen;
+	int outpos;
+
+	/* receiving */
+	char *dir;
+	int rlen;		/* of block */
+	int need;		/* length of the block being received */
+	bool header;		/* waiting for a YMODEM header */
+	int polls;
+};
+
+enum {
+	XM_WAIT_START,		/* for 'C' or NAK */
+	XM_WAIT_HEADER_ACK,	/* YMODEM block 0 sent */
+	XM_WAIT_DATA_START,	/* for the 'C' after block 0 */
+	XM_WAIT_ACK,
+	XM_WAIT_EOT_ACK,
+	XM_WAIT_FIN_START,	/* for the 'C' before the empty block 0 */
+	XM_WAIT_FIN_ACK,
+};
+
+static void xmodem_free(struct transfer *t)
+{
+	struct xmodem *x = container_of(t, struct xmodem, t);
+
+	if (x->fd >= 0)
+		close(x->fd);
+	free(x->t.path);
+	free(x->dir);
+	free(x);
+}
+
+static int xmodem_check_cancel(struct xmodem *x, unsigned char c)
+{
+	if (c != CAN) {
+		x->cans = 0;
+		return 0;
+	}
+
+	/* a single CAN may be line noise */
+	if (++x->cans < 2)
+		return 0;
+
+	transfer_finish(&x->t, -ECANCELED);
+
+	return 1;
+}
+
+static void xmodem_build_block(struct xmodem *x, const unsigned char *data,
+			       int len, int size, unsigned char pad)
+{
+	unsigned char *p = x->block;
+
+	*p++ = size == 1024 ? STX : SOH;
+	*p++ = x->blk;
+	*p++ = ~x->blk;
+	memcpy(p, data, len);
+	memset(p + len, pad, size - len);
+
+	if (x->crc) {
+		uint16_t crc = crc16_ccitt(0, p, size);
+
+		p[size] = crc >> 8;
+		p[size + 1] = crc;
+		x->blocklen = 3 + size + 2;
+	} else {
+		unsigned char sum = 0;
+		int i;
+
+		for (i = 0; i < size; i++)
+			sum += p[i];
+		p[size] = sum;
+		x->blocklen = 3 + size + 1;
+	}
+
+	x->datalen = len;
+}
+
+/*
+ * Send what the port takes, the rest is sent from xmodem_write(). A write
+ * error is reported from there as well, the transfer can't be finished in
+ * the middle of the protocol handling.
+ */
+static int xmodem_flush(struct xmodem *x)
+{
+	ssize_t ret;
+
+	while (x->outpos < x->outlen) {
+		ret = ios->write(ios, x->out + x->outpos, x->outlen - x->outpos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			transfer_want_write(&x->t, true);
+			if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+				return -errno;
+			return 0;
+		}
+		x->outpos += ret;
+	}
+
+	x->outpos = x->outlen = 0;
+	transfer_want_write(&x->t, false);
+
+	return 0;
+}
+
+static int xmodem_write(struct transfer *t)
+{
+	struct xmodem *x = container_of(t, struct xmodem, t);
+	int ret;
+
+	ret = xmodem_flush(x);
+	if (ret)
+		transfer_finish(t, ret);
+
+	return 0;
+}
+
+/*
+ * Queue data behind the rest the port didn't take yet. The protocol waits
+ * for an answer to each block, so more than a block and a few characters
+ * are only left after the port took nothing for a whole timeout, then the
+ * new data is a resend replacing the rest.
+ */
+static void xmodem_out(struct xmodem *x, const unsigned char *buf, int len)
+{
+	int rest = x->outlen - x->outpos;
+
+	if (rest + len > sizeof(x->out))
+		rest = 0;
+
+	memmove(x->out, x->out + x->outpos, rest);
+	memcpy(x->out + rest, buf, len);
+	x->outpos = 0;
+	x->outlen = rest + len;
+
+	xmodem_flush(x);
+}
+
+static void xmodem_send_block(struct xmodem *x)
+{
+	xmodem_out(x, x->block, x->blocklen);
+	transfer_set_timeout(&x->t, XMODEM_TIMEOUT);
+}
+
+/* YMODEM block 0: the name and size, an empty one ends the batch */
+static void xmodem_send_header(struct xmodem *x, bool last)
+{
+	unsigned char data[128] = { 0 };
+	char *name;
+
+	x->blk = 0;
+	if (!last) {
+		name = basename(x->t.path);
+		snprintf((char *)data, sizeof(data) - 1, "%s%c%lld", name, 0,
+			 (long long)x->t.size);
+	}
+
+	xmodem_build_block(x, data, sizeof(data), sizeof(data), 0);
+	xmodem_send_block(x);
+}
+
+static int xmodem_send_next(struct xmodem *x)
+{
+	unsigned char data[1024];
+	int size = x->onek ? 1024 : 128;
+	ssize_t len;
+
+	len = read(x->fd, data, size);
+	if (len < 0) {
+		transfer_abort(&x->t, -errno);
+		return -1;
+	}
+
+	if (!len) {
+		const unsigned char eot = EOT;
+
+		xmodem_out(x, &eot, 1);
+		transfer_set_timeout(&x->t, XMODEM_TIMEOUT);
+		x->state = XM_WAIT_EOT_ACK;
+		return 0;
+	}
+
+	/* don't pad the last bit to 1K */
+	if (len <= 128)
+		size = 128;
+
+	x->blk++;
+	xmodem_build_block(x, data, len, size, CPMEOF);
+	xmodem_send_block(x);
+	x->state = XM_WAIT_ACK;
+
+	return 0;
+}
+
+static void xmodem_resend(struct xmodem *x)
+{
+	if (++x->retries > XMODEM_RETRIES) {
+		transfer_abort(&x->t, -EIO);
+		return;
+	}
+
+	if (x->state == XM_WAIT_EOT_ACK) {
+		const unsigned char eot = EOT;
+
+		xmodem_out(x, &eot, 1);
+		transfer_set_timeout(&x->t, XMODEM_TIMEOUT);
+	} else {
+		xmodem_send_block(x);
+	}
+}
+
+static int xmodem_send_receive(struct transfer *t, const unsigned char *buf,
+			       int len)
+{
+	struct xmodem *x = container_of(t, struct xmodem, t);
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		if (xmodem_check_cancel(x, c))
+			return i + 1;
+
+		switch (x->state) {
+		case XM_WAIT_START:
+			if (c != 'C' && c != NAK)
+				break;
+			x->crc = c == 'C';
+			if (x->ymodem) {
+				xmodem_send_header(x, false);
+				x->state = XM_WAIT_HEADER_ACK;
+			} else if (xmodem_send_next(x)) {
+				return i + 1;
+			}
+			break;
+		case XM_WAIT_HEADER_ACK:
+			/* a 'C' may still be from before the header */
+			if (c == ACK)
+				x->state = XM_WAIT_DATA_START;
+			else if (c == NAK)
+				xmodem_resend(x);
+			break;
+		case XM_WAIT_DATA_START:
+			if (c == 'C' && xmodem_send_next(x))
+				return i + 1;
+			break;
+		case XM_WAIT_ACK:
+			if (c == ACK) {
+				x->retries = 0;
+				t->done += x->datalen;
+				transfer_progress(t);
+				if (xmodem_send_next(x))
+					return i + 1;
+			} else if (c == NAK) {
+				xmodem_resend(x);
+			}
+			break;
+		case XM_WAIT_EOT_ACK:
+			if (c == ACK && x->ymodem) {
+				x->state = XM_WAIT_FIN_START;
+				transfer_set_timeout(t, XMODEM_TIMEOUT);
+			} else if (c == ACK) {
+				transfer_finish(t, 0);
+				return i + 1;
+			} else if (c == NAK) {
+				xmodem_resend(x);
+			}
+			break;
+		case XM_WAIT_FIN_START:
+			if (c == 'C') {
+				xmodem_send_header(x, true);
+				x->state = XM_WAIT_FIN_ACK;
+			}
+			break;
+		case XM_WAIT_FIN_ACK:
+			if (c == ACK) {
+				transfer_finish(t, 0);
+				return i + 1;
+			} else if (c == NAK) {
+				xmodem_resend(x);
+			}
+			break;
+		}
+
+		if (!active)
+			return i + 1;
+	}
+
+	return len;
+}
+
+static void xmodem_send_timeout(struct transfer *t)
+{
+	struct xmodem *x = container_of(t, struct xmodem, t);
+
+	switch (x->state) {
+	case XM_WAIT_START:
+		transfer_abort(t, -ETIMEDOUT);
+		break;
+	case XM_WAIT_DATA_START:
+		/* some receivers don't ask again */
+		xmodem_send_next(x);
+		break;
+	case XM_WAIT_FIN_START:
+		xmodem_send_header(x, true);
+		x->state = XM_WAIT_FIN_ACK;
+		break;
+	default:
+		xmodem_resend(x);
+		break;
+	}
+}
+
+static struct xmodem *xmodem_alloc(const char *proto, bool send)
+{
+	struct xmodem *x = calloc(1, sizeof(*x));
+
+	if (!x)
+		return NULL;
+
+	x->t.proto = proto;
+	x->t.send = send;
+	x->t.size = -1;
+	x->t.write = xmodem_write;
+	x->t.free = xmodem_free;
+	x->fd = -1;
+
+	return x;
+}
+
+static int xmodem_send(char *path, bool ymodem, bool onek)
+{
+	struct xmodem *x;
+	struct stat st;
+	int ret;
+
+	x = xmodem_alloc(ymodem ? "ymodem" : "xmodem", true);
+	if (!x)
+		return -ENOMEM;
+
+	x->ymodem = ymodem;
+	x->onek = onek || ymodem;
+	x->t.path = strdup(path);
+	x->t.receive = xmodem_send_receive;
+	x->t.timeout = xmodem_send_timeout;
+
+	x->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (x->fd < 0 || fstat(x->fd, &st)) {
+		ret = -errno;
+		printf("cannot open %s: %s\n", path, strerror(errno));
+		xmodem_free(&x->t);
+		return ret;
+	}
+	x->t.size = st.st_size;
+
+	ret = transfer_start(&x->t);
+	if (ret) {
+		xmodem_free(&x->t);
+		return ret;
+	}
+
+	x->state = XM_WAIT_START;
+	transfer_set_timeout(&x->t, XMODEM_START_TIMEOUT);
+
+	return 0;
+}
+
+static void xmodem_put(struct xmodem *x, unsigned char c)
+{
+	xmodem_out(x, &c, 1);
+}
+
+/* ask for the (next) transfer to start */
+static void xmodem_poll(struct xmodem *x)
+{
+	/* fall back to checksums for senders that don't do CRC */
+	if (!x->ymodem && x->polls == 3)
+		x->crc = false;
+
+	if (++x->polls > XMODEM_RETRIES) {
+		transfer_abort(&x->t, -ETIMEDOUT);
+		return;
+	}
+
+	xmodem_put(x, x->crc ? 'C' : NAK);
+	transfer_set_timeout(&x->t, XMODEM_POLL);
+}
+
+/* parse a YMODEM header, returns 1 for the end of the batch */
+static int xmodem_open_file(struct xmodem *x, unsigned char *data)
+{
+	char *name = (char *)data, *path;
+
+	if (!*name)
+		return 1;
+
+	x->t.size = strtoll(name + strlen(name) + 1, NULL, 10);
+	if (!x->t.size)
+		x->t.size = -1;
+
+	/* the sender doesn't get to choose the directory */
+	name = basename(name);
+
+	if (asprintf(&path, "%s/%s", x->dir ? x->dir : ".", name) < 0)
+		return -ENOMEM;
+
+	if (x->fd >= 0)
+		close(x->fd);
+	x->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (x->fd < 0) {
+		int ret = -errno;
+
+		free(path);
+		return ret;
+	}
+
+	free(x->t.path);
+	x->t.path = path;
+	x->t.done = 0;
+
+	mux_event("%s: receiving %s (%lld bytes)", x->t.proto, path,
+		  (long long)x->t.size);
+
+	return 0;
+}
+
+static void xmodem_block(struct xmodem *x)
+{
+	unsigned char *data = x->block + 3;
+	int size = x->need - 3 - (x->crc ? 2 : 1);
+	ssize_t len = size;
+	bool ok;
+
+	if (x->crc) {
+		ok = crc16_ccitt(0, data, size) ==
+			(data[size] << 8 | data[size + 1]);
+	} else {
+		unsigned char sum = 0;
+		int i;
+
+		for (i = 0; i < size; i++)
+			sum += data[i];
+		ok = sum == data[size];
+	}
+
+	if (!ok || (unsigned char)(x->block[1] ^ x->block[2]) != 0xff) {
+		xmodem_put(x, NAK);
+		return;
+	}
+
+	/* the previous block again, our ACK got lost */
+	if (x->block[1] == (unsigned char)(x->blk - 1) && !x->header) {
+		xmodem_put(x, ACK);
+		return;
+	}
+
+	if (x->block[1] != x->blk) {
+		transfer_abort(&x->t, -EPROTO);
+		return;
+	}
+
+	if (x->header) {
+		int ret = xmodem_open_file(x, data);
+
+		if (ret < 0) {
+			transfer_abort(&x->t, ret);
+			return;
+		}
+
+		xmodem_put(x, ACK);
+		if (ret) {
+			transfer_finish(&x->t, 0);
+			return;
+		}
+
+		x->header = false;
+		x->blk = 1;
+		xmodem_put(x, 'C');
+		return;
+	}
+
+	if (x->t.size >= 0)
+		len = min((off_t)size, x->t.size - x->t.done);
+
+	if (write(x->fd, data, len) != len) {
+		transfer_abort(&x->t, -errno);
+		return;
+	}
+
+	x->t.done += len;
+	x->blk++;
+	xmodem_put(x, ACK);
+	transfer_progress(&x->t);
+}
+
+static int xmodem_recv_receive(struct transfer *t, const unsigned char *buf,
+			       int len)
+{
+	struct xmodem *x = container_of(t, struct xmodem, t);
+	int i;
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+
+		if (x->rlen) {
+			x->block[x->rlen++] = c;
+			if (x->rlen == x->need) {
+				x->rlen = 0;
+				xmodem_block(x);
+				if (!active)
+					return i + 1;
+				transfer_set_timeout(t, XMODEM_TIMEOUT);
+			}
+			continue;
+		}
+
+		if (xmodem_check_cancel(x, c))
+			return i + 1;
+
+		switch (c) {
+		case SOH:
+		case STX:
+			x->polls = 0;
+			x->block[0] = c;
+			x->rlen = 1;
+			x->need = 3 + (c == STX ? 1024 : 128) + (x->crc ? 2 : 1);
+			break;
+		case EOT:
+			xmodem_put(x, ACK);
+			if (!x->ymodem) {
+				transfer_finish(t, 0);
+				return i + 1;
+			}
+			close(x->fd);
+			x->fd = -1;
+			mux_event("%s: received %s", t->proto, t->path);
+			/* the next file or the end of the batch */
+			x->header = true;
+			x->blk = 0;
+			x->polls = 0;
+			xmodem_poll(x);
+			break;
+		default:
+			break;
+		}
+	}
+
+	/* within a block, wait for its next characters */
+	if (x->rlen)
+		transfer_set_timeout(t, XMODEM_CHAR_TIMEOUT);
+
+	return len;
+}
+
+static void xmodem_recv_timeout(struct transfer *t)
+{
+	struct xmodem *x = container_of(t, struct xmodem, t);
+
+	/* a block got cut off, have it sent again */
+	if (x->rlen) {
+		x->rlen = 0;
+		xmodem_put(x, NAK);
+		transfer_set_timeout(t, XMODEM_TIMEOUT);
+		return;
+	}
+
+	if ((x->header || x->blk == 1) && !t->done) {
+		xmodem_poll(x);
+		return;
+	}
+
+	if (++x->retries > XMODEM_RETRIES) {
+		transfer_abort(t, -ETIMEDOUT);
+		return;
+	}
+
+	xmodem_put(x, NAK);
+	transfer_set_timeout(t, XMODEM_TIMEOUT);
+}
+
+/* XMODEM into path, YMODEM into the directory path */
+static int xmodem_recv(char *path, bool ymodem)
+{
+	struct xmodem *x;
+	int ret;
+
+	x = xmodem_alloc(ymodem ? "ymodem" : "xmodem", false);
+	if (!x)
+		return -ENOMEM;
+
+	x->ymodem = ymodem;
+	x->crc = true;
+	x->t.receive = xmodem_recv_receive;
+	x->t.timeout = xmodem_recv_timeout;
+
+	if (ymodem) {
+		x->header = true;
+		x->blk = 0;
+		x->dir = path ? strdup(path) : NULL;
+	} else {
+		x->blk = 1;
+		x->t.path = strdup(path);
+		x->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (x->fd < 0) {
+			ret = -errno;
+			printf("cannot open %s: %s\n", path, strerror(errno));
+			xmodem_free(&x->t);
+			return ret;
+		}
+	}
+
+	ret = transfer_start(&x->t);
+	if (ret) {
+		xmodem_free(&x->t);
+		return ret;
+	}
+
+	xmodem_poll(x);
+
+	return 0;
+}
+
+static int transfer_busy(void)
+{
+	if (!active)
+		return 0;
+
+	printf("a transfer is running already\n");
+
+	return 1;
+}
+
+/* leave the prompt, so the progress is visible */
+static int transfer_started(int ret)
+{
+	return ret ? ret : MICROCOM_CMD_START;
+}
+
+static int cmd_sx(int argc, char *argv[])
+{
+	bool onek = argc == 3 && !strcmp(argv[1], "-k");
+
+	if (argc != 2 + onek)
+		return MICROCOM_CMD_USAGE;
+	if (transfer_busy())
+		return -EBUSY;
+
+	return transfer_started(xmodem_send(argv[argc - 1], false, onek));
+}
+
+static int cmd_sb(int argc, char *argv[])
+{
+	if (argc != 2)
+		return MICROCOM_CMD_USAGE;
+	if (transfer_busy())
+		return -EBUSY;
+
+	return transfer_started(xmodem_send(argv[1], true, true));
+}
+
+static int cmd_sz(int argc, char *argv[])
+{
+	if (argc != 2)
+		return MICROCOM_CMD_USAGE;
+	if (transfer_busy())
+		return -EBUSY;
+
+	return transfer_started(zmodem_send(argv[1]));
+}
+
+static int cmd_sendfile(int argc, char *argv[])
+{
+	unsigned int char_ms = 0, line_ms = 0;
+	int i;
+
+	for (i = 1; i < argc - 2; i += 2) {
+		if (!strcmp(argv[i], "-c"))
+			char_ms = strtoul(argv[i + 1], NULL, 0);
+		else if (!strcmp(argv[i], "-l"))
+			line_ms = strtoul(argv[i + 1], NULL, 0);
+		else
+			return MICROCOM_CMD_USAGE;
+	}
+
+	if (i != argc - 1)
+		return MICROCOM_CMD_USAGE;
+	if (transfer_busy())
+		return -EBUSY;
+
+	return transfer_started(sendfile_start(argv[i], char_ms, line_ms));
+}
+
+static int cmd_rx(int argc, char *argv[])
+{
+	if (argc != 2)
+		return MICROCOM_CMD_USAGE;
+	if (transfer_busy())
+		return -EBUSY;
+
+	return transfer_started(xmodem_recv(argv[1], false));
+}
+
+static int cmd_rb(int argc, char *argv[])
+{
+	if (argc > 2)
+		return MICROCOM_CMD_USAGE;
+	if (transfer_busy())
+		return -EBUSY;
+
+	return transfer_started(xmodem_recv(argc > 1 ? argv[1] : NULL, true));
+}
+
+static int cmd_transfer(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "abort")) {
+		if (active)
+			transfer_abort(active, -ECANCELED);
+		return 0;
+	}
+
+	if (argc > 1)
+		return MICROCOM_CMD_USAGE;
+
+	if (!active) {
+		printf("no transfer running\n");
+		return 0;
+	}
+
+	printf("%s: %s %s, %lld bytes done\n", active->proto,
+	       active->send ? "sending" : "receiving",
+	       active->path ? active->path : "", (long long)active->done);
+
+	return 0;
+}
+
+static const char *const transfer_values[] = { "abort", NULL };
+
+static struct cmd transfer_cmds[] = {
+	{
+		.name = "sx",
+		.fn = cmd_sx,
+		.info = "send a file with XMODEM (-k: 1K blocks)",
+		.help = "sx [-k] <file>",
+		.complete = complete_file,
+	}, {
+		.name = "sb",
+		.fn = cmd_sb,
+		.info = "send a file with YMODEM",
+		.help = "sb <file>",
+		.complete = complete_file,
+	}, {
+		.name = "sz",
+		.fn = cmd_sz,
+		.info = "send a file with ZMODEM",
+		.help = "sz <file>",
+		.complete = complete_file,
+	}, {
+		.name = "sendfile",
+		.fn = cmd_sendfile,
+		.info = "send a file as is, optionally waiting <ms> after each character or line",
+		.help = "sendfile [-c <ms>] [-l <ms>] <file>",
+		.complete = complete_file,
+	}, {
+		.name = "rx",
+		.fn = cmd_rx,
+		.info = "receive a file with XMODEM",
+		.help = "rx <file>",
+		.complete = complete_file,
+	}, {
+		.name = "rb",
+		.fn = cmd_rb,
+		.info = "receive files with YMODEM",
+		.help = "rb [<directory>]",
+		.complete = complete_file,
+	}, {
+		.name = "transfer",
+		.fn = cmd_transfer,
+		.info = "show or abort the running file transfer",
+		.help = "transfer [abort]",
+		.values = transfer_values,
+	},
+};
+
+void transfer_init(void)
+{
+	int i;
+
+	crc_init();
+
+	for (i = 0; i < ARRAY_SIZE(transfer_cmds); i++)
+		register_command(&transfer_cmds[i]);
+}
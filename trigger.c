@@ -0,0 +1,334 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include "config.h"
+
+#include "microcom.h"
+
+/*
+ * Triggers react on patterns in the received data, e.g. to stop U-Boot's
+ * autoboot or to mark a kernel panic in the logfile. All patterns are
+ * compiled into one matcher (see match.c) that scans the received data once,
+ * no matter how many triggers there are. The table is rebuilt whenever it
+ * changes.
+ *
+ * A trigger is "<pattern> <action> [<argument>]", the actions are:
+ *
+ *   send <string>	send string to the port
+ *   cmd <command>	run a command like on the prompt
+ *   mark [<text>]	write an event to the terminal and the logfile
+ *   exit [<status>]	quit microcom
+ */
+
+enum trigger_action {
+	TRIGGER_SEND,
+	TRIGGER_CMD,
+	TRIGGER_MARK,
+	TRIGGER_EXIT,
+};
+
+static const char *trigger_action_names[] = {
+	[TRIGGER_SEND] = "send",
+	[TRIGGER_CMD] = "cmd",
+	[TRIGGER_MARK] = "mark",
+	[TRIGGER_EXIT] = "exit",
+};
+
+struct trigger {
+	char *pattern;		/* as given, for listing */
+	enum trigger_action action;
+	char *arg;		/* as given */
+	char *data;		/* unescaped arg for send */
+	int len;
+	unsigned long hits;
+};
+
+static struct trigger *triggers;
+static int num_triggers;
+static struct matcher *matcher;
+/* changed by every rebuild, actions may modify the table */
+static unsigned int generation;
+
+/* triggers firing at the same position, the rest is ignored */
+#define TRIGGER_MAX_HITS 16
+
+struct trigger_hits {
+	int ids[TRIGGER_MAX_HITS];
+	int num;
+};
+
+static int trigger_rebuild(void)
+{
+	struct matcher *m = NULL;
+	int i, ret = -ENOMEM;
+
+	generation++;
+
+	if (num_triggers) {
+		m = matcher_new();
+		if (!m)
+			goto out;
+
+		for (i = 0; i < num_triggers; i++) {
+			char *pattern = strdup(triggers[i].pattern);
+			int len;
+
+			if (!pattern)
+				goto out;
+			len = str_unescape(pattern);
+			ret = matcher_add(m, (unsigned char *)pattern, len, i);
+			free(pattern);
+			if (ret)
+				goto out;
+		}
+
+		ret = matcher_compile(m);
+		if (ret)
+			goto out;
+	}
+
+	matcher_free(matcher);
+	matcher = m;
+
+	return 0;
+out:
+	matcher_free(m);
+	return ret;
+}
+
+static void trigger_free(struct trigger *t)
+{
+	free(t->pattern);
+	free(t->arg);
+	free(t->data);
+}
+
+static char *join_args(int argc, char *argv[])
+{
+	size_t len = 1;
+	char *str;
+	int i;
+
+	for (i = 0; i < argc; i++)
+		len += strlen(argv[i]) + 1;
+
+	str = calloc(1, len);
+	if (!str)
+		return NULL;
+
+	for (i = 0; i < argc; i++) {
+		if (i)
+			strcat(str, " ");
+		strcat(str, argv[i]);
+	}
+
+	return str;
+}
+
+/* add a trigger from "<pattern> <action> [<argument>...]" */
+static int trigger_add(int argc, char *argv[])
+{
+	struct trigger t = { 0 }, *tmp;
+	int ret, i;
+
+	if (argc < 2 || !*argv[0])
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(trigger_action_names); i++)
+		if (!strcmp(argv[1], trigger_action_names[i]))
+			break;
+	if (i == ARRAY_SIZE(trigger_action_names))
+		return -EINVAL;
+	t.action = i;
+
+	if ((t.action == TRIGGER_SEND || t.action == TRIGGER_CMD) && argc < 3)
+		return -EINVAL;
+
+	t.pattern = strdup(argv[0]);
+	t.arg = argc > 2 ? join_args(argc - 2, argv + 2) : strdup("");
+	if (t.pattern && t.arg && t.action == TRIGGER_SEND) {
+		t.data = strdup(t.arg);
+		if (t.data)
+			t.len = str_unescape(t.data);
+	}
+	if (!t.pattern || !t.arg || (t.action == TRIGGER_SEND && !t.data)) {
+		trigger_free(&t);
+		return -ENOMEM;
+	}
+
+	tmp = realloc(triggers, (num_triggers + 1) * sizeof(*tmp));
+	if (!tmp) {
+		trigger_free(&t);
+		return -ENOMEM;
+	}
+	triggers = tmp;
+	triggers[num_triggers++] = t;
+
+	ret = trigger_rebuild();
+	if (ret)
+		trigger_free(&triggers[--num_triggers]);
+
+	return ret;
+}
+
+static void trigger_del(int n)
+{
+	trigger_free(&triggers[n]);
+	memmove(&triggers[n], &triggers[n + 1],
+		(num_triggers - n - 1) * sizeof(*triggers));
+	num_triggers--;
+	trigger_rebuild();
+}
+
+static void trigger_clear(void)
+{
+	while (num_triggers)
+		trigger_free(&triggers[--num_triggers]);
+	trigger_rebuild();
+}
+
+/* load triggers from a file, one per line, '#' starts a comment */
+int trigger_load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char *line = NULL, *argv[MAXARGS + 1];
+	size_t size = 0;
+	int argc, ret = 0, lineno = 0;
+
+	if (!f) {
+		fprintf(stderr, "cannot open %s: %s\n", path, strerror(errno));
+		return -errno;
+	}
+
+	while (getline(&line, &size, f) >= 0) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = 0;
+
+		if (commandline_parse(line, &argc, argv) < 0 || !argc ||
+		    argv[0][0] == '#')
+			continue;
+
+		ret = trigger_add(argc, argv);
+		if (ret) {
+			fprintf(stderr, "%s:%d: invalid trigger\n", path, lineno);
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+
+	return ret;
+}
+
+static void trigger_fire(struct trigger *t)
+{
+	char *cmd;
+
+	t->hits++;
+
+	switch (t->action) {
+	case TRIGGER_SEND:
+		ios->write(ios, (unsigned char *)t->data, t->len);
+		break;
+	case TRIGGER_CMD:
+		/* parsing modifies the command */
+		cmd = strdup(t->arg);
+		if (cmd)
+			commandline_run(cmd);
+		free(cmd);
+		break;
+	case TRIGGER_MARK:
+		mux_event("%s", *t->arg ? t->arg : t->pattern);
+		break;
+	case TRIGGER_EXIT:
+		mux_event("trigger \"%s\": exit", t->pattern);
+		fflush(NULL);
+		microcom_exit(0);
+		exit(strtol(t->arg, NULL, 0));
+	}
+}
+
+static int trigger_match(void *ctx, int id)
+{
+	struct trigger_hits *hits = ctx;
+
+	if (hits->num < TRIGGER_MAX_HITS)
+		hits->ids[hits->num++] = id;
+
+	return 1;
+}
+
+/* scan the received data, called with everything read from the port */
+void trigger_receive(const unsigned char *buf, int len)
+{
+	while (matcher && len > 0) {
+		struct trigger_hits hits = { .num = 0 };
+		unsigned int gen = generation;
+		int i, n;
+
+		n = matcher_feed(matcher, buf, len, trigger_match, &hits);
+		buf += n;
+		len -= n;
+
+		for (i = 0; i < hits.num && gen == generation; i++)
+			trigger_fire(&triggers[hits.ids[i]]);
+	}
+}
+
+static int cmd_trigger(int argc, char *argv[])
+{
+	int i, ret;
+
+	if (argc < 2) {
+		for (i = 0; i < num_triggers; i++)
+			printf("%d: \"%s\" %s %s (%lu hits)\n", i,
+			       triggers[i].pattern,
+			       trigger_action_names[triggers[i].action],
+			       triggers[i].arg, triggers[i].hits);
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "add")) {
+		ret = trigger_add(argc - 2, argv + 2);
+		if (ret == -EINVAL)
+			return MICROCOM_CMD_USAGE;
+		return ret;
+	}
+
+	if (!strcmp(argv[1], "del") && argc == 3) {
+		char *end;
+
+		i = strtol(argv[2], &end, 0);
+		if (*end || i < 0 || i >= num_triggers)
+			return MICROCOM_CMD_USAGE;
+		trigger_del(i);
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "clear")) {
+		trigger_clear();
+		return 0;
+	}
+
+	if (!strcmp(argv[1], "load") && argc == 3)
+		return trigger_load(argv[2]);
+
+	return MICROCOM_CMD_USAGE;
+}
+
+static const char *const trigger_values[] = {
+	"add", "del", "clear", "load", NULL
+};
+
+static struct cmd trigger_cmd = {
+	.name = "trigger",
+	.fn = cmd_trigger,
+	.info = "list or change the triggers on received data",
+	.help = "trigger [add <pattern> send|cmd|mark|exit [<argument>]|del <n>|clear|load <file>]",
+	.values = trigger_values,
+	.complete = complete_file,
+};
+
+void trigger_init(void)
+{
+	register_command(&trigger_cmd);
+}
@@ -0,0 +1,737 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#include "config.h"
+
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "microcom.h"
+
+/*
+ * ZMODEM sender, see transfer.c for how transfers run.
+ *
+ * The data is streamed: subpackets end with ZCRCG, which the receiver doesn't
+ * acknowledge, so the line never idles waiting for an ACK. Every
+ * ZM_ACK_INTERVAL bytes a ZCRCQ asks for a ZACK, and the sender stops when
+ * ZM_WINDOW bytes are unacknowledged. A receiver that announces a buffer
+ * size gets frames of that size ending with ZCRCW and is waited for after
+ * each. On an error the receiver sends ZRPOS and the data is resent from
+ * there. What the port doesn't take at once (it's non-blocking) is kept in
+ * the output buffer and sent from zm_write() before the next subpacket.
+ */
+
+#define ZPAD		'*'
+#define ZDLE		0x18
+#define ZBIN		'A'
+#define ZHEX		'B'
+#define ZBIN32		'C'
+
+/* frame types */
+#define ZRQINIT		0
+#define ZRINIT		1
+#define ZACK		3
+#define ZFILE		4
+#define ZSKIP		5
+#define ZNAK		6
+#define ZABORT		7
+#define ZFIN		8
+#define ZRPOS		9
+#define ZDATA		10
+#define ZEOF		11
+#define ZFERR		12
+#define ZCRC		13
+#define ZCHALLENGE	14
+#define ZCAN		16
+
+/* subpacket ends */
+#define ZCRCE		'h'	/* end of frame */
+#define ZCRCG		'i'	/* frame continues */
+#define ZCRCQ		'j'	/* frame continues, ZACK expected */
+#define ZCRCW		'k'	/* end of frame, ZACK expected */
+#define ZRUB0		'l'
+#define ZRUB1		'm'
+
+/* ZRINIT flags in ZF0 */
+#define CANFDX		0x01
+#define CANOVIO		0x02
+#define CANFC32		0x20
+#define ESCCTL		0x40
+
+/* ZFILE conversion in ZF0: binary */
+#define ZCBIN		1
+
+#define XON		0x11
+
+/* in the header, ZF0 is the last byte */
+#define ZF0		3
+
+#define ZM_SUBPACKET	1024
+#define ZM_WINDOW	(64 * 1024)
+#define ZM_ACK_INTERVAL	(16 * 1024)
+#define ZM_TIMEOUT	10000
+#define ZM_RETRIES	10
+/* a header and a subpacket, all escaped */
+#define ZM_MSG_MAX	(2 * (ZM_SUBPACKET + 16))
+
+enum {
+	ZS_INIT,	/* ZRQINIT sent */
+	ZS_FILE,	/* ZFILE sent */
+	ZS_DATA,
+	ZS_EOF,		/* ZEOF sent */
+	ZS_FIN,		/* ZFIN sent */
+};
+
+enum {
+	ZH_IDLE,
+	ZH_PAD,
+	ZH_FORMAT,
+	ZH_HEX,
+	ZH_BIN,
+};
+
+struct zmodem {
+	struct transfer t;
+	int state;
+	int retries;
+	const unsigned char *map;
+
+	/* from the receiver's ZRINIT */
+	bool crc32;
+	bool escctl;
+	unsigned int rxbuflen;
+
+	off_t sent;		/* position of the next data to send */
+	off_t acked;
+	off_t frame_start;	/* position of the last ZDATA */
+	bool frame_open;
+	bool wait_ack;		/* for the ZACK after ZCRCW */
+
+	/* header parser */
+	int hstate;
+	unsigned char hbuf[9];
+	int hlen;
+	int hneed;
+	bool hesc;
+	int cans;
+
+	unsigned char last;	/* last byte sent, to escape CR after '@' */
+	unsigned char out[2 * ZM_MSG_MAX];
+	int outlen;
+	int outpos;		/* out up to here is sent */
+};
+
+/* send what the port takes, the rest is sent from zm_write() */
+static int zm_flush(struct zmodem *z)
+{
+	ssize_t ret;
+
+	while (z->outpos < z->outlen) {
+		ret = ios->write(ios, z->out + z->outpos, z->outlen - z->outpos);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			ret = -errno;
+			z->outpos = z->outlen = 0;
+			return ret;
+		}
+		if (ret <= 0) {
+			transfer_want_write(&z->t, true);
+			return 0;
+		}
+		z->outpos += ret;
+	}
+
+	z->outpos = z->outlen = 0;
+
+	return 0;
+}
+
+/* start a message behind the rest the port didn't take yet */
+static void zm_begin(struct zmodem *z)
+{
+	int rest = z->outlen - z->outpos;
+
+	/*
+	 * There is room for one more message. More than that is only left
+	 * after the port took nothing for a whole timeout, then the message
+	 * is a resend replacing it.
+	 */
+	if (rest > sizeof(z->out) - ZM_MSG_MAX)
+		rest = 0;
+
+	memmove(z->out, z->out + z->outpos, rest);
+	z->outpos = 0;
+	z->outlen = rest;
+}
+
+static void zm_put_raw(struct zmodem *z, unsigned char c)
+{
+	z->out[z->outlen++] = c;
+	z->last = c;
+}
+
+static void zm_put(struct zmodem *z, unsigned char c)
+{
+	bool esc;
+
+	switch (c) {
+	case ZDLE:
+	case 0x10:
+	case 0x11:
+	case 0x13:
+	case 0x90:
+	case 0x91:
+	case 0x93:
+		esc = true;
+		break;
+	case '\r':
+	case '\r' | 0x80:
+		/* "@\r" would be a hangup for some modems */
+		esc = z->escctl || (z->last & 0x7f) == '@';
+		break;
+	default:
+		esc = z->escctl && !(c & 0x60);
+		break;
+	}
+
+	if (esc) {
+		z->out[z->outlen++] = ZDLE;
+		c ^= 0x40;
+	}
+	zm_put_raw(z, c);
+}
+
+static void zm_put_crc(struct zmodem *z, const unsigned char *buf, int len,
+		       const unsigned char *end)
+{
+	if (z->crc32) {
+		uint32_t crc = crc32_update(0xffffffff, buf, len);
+
+		if (end)
+			crc = crc32_update(crc, end, 1);
+		crc = ~crc;
+		zm_put(z, crc);
+		zm_put(z, crc >> 8);
+		zm_put(z, crc >> 16);
+		zm_put(z, crc >> 24);
+	} else {
+		uint16_t crc = crc16_ccitt(0, buf, len);
+
+		if (end)
+			crc = crc16_ccitt(crc, end, 1);
+		zm_put(z, crc >> 8);
+		zm_put(z, crc);
+	}
+}
+
+static void zm_pos_header(unsigned char hdr[4], off_t pos)
+{
+	hdr[0] = pos;
+	hdr[1] = pos >> 8;
+	hdr[2] = pos >> 16;
+	hdr[3] = pos >> 24;
+}
+
+static off_t zm_header_pos(const unsigned char *hdr)
+{
+	return hdr[0] | hdr[1] << 8 | hdr[2] << 16 | (off_t)hdr[3] << 24;
+}
+
+static void zm_hex_header(struct zmodem *z, int type, const unsigned char *hdr)
+{
+	unsigned char raw[5] = { type, hdr[0], hdr[1], hdr[2], hdr[3] };
+	uint16_t crc = crc16_ccitt(0, raw, sizeof(raw));
+
+	zm_begin(z);
+	z->outlen += sprintf((char *)z->out + z->outlen,
+			     "%c%c%c%c%02x%02x%02x%02x%02x%04x\r\x8a",
+			     ZPAD, ZPAD, ZDLE, ZHEX, type, hdr[0], hdr[1],
+			     hdr[2], hdr[3], crc);
+	if (type != ZFIN && type != ZACK)
+		z->out[z->outlen++] = XON;
+	zm_flush(z);
+}
+
+static void zm_bin_header(struct zmodem *z, int type, const unsigned char *hdr)
+{
+	unsigned char raw[5] = { type, hdr[0], hdr[1], hdr[2], hdr[3] };
+	int i;
+
+	zm_begin(z);
+	zm_put_raw(z, ZPAD);
+	zm_put_raw(z, ZDLE);
+	zm_put_raw(z, z->crc32 ? ZBIN32 : ZBIN);
+	for (i = 0; i < sizeof(raw); i++)
+		zm_put(z, raw[i]);
+	zm_put_crc(z, raw, sizeof(raw), NULL);
+}
+
+/* a data subpacket, appended to the output */
+static void zm_data(struct zmodem *z, const unsigned char *buf, int len,
+		    unsigned char end)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		zm_put(z, buf[i]);
+
+	zm_put_raw(z, ZDLE);
+	zm_put_raw(z, end);
+	zm_put_crc(z, buf, len, &end);
+
+	if (end == ZCRCW)
+		zm_put_raw(z, XON);
+}
+
+static void zm_send_zrqinit(struct zmodem *z)
+{
+	static const unsigned char zero[4];
+
+	zm_hex_header(z, ZRQINIT, zero);
+	transfer_set_timeout(&z->t, ZM_TIMEOUT);
+}
+
+static void zm_send_zfile(struct zmodem *z)
+{
+	unsigned char hdr[4] = { [ZF0] = ZCBIN };
+	unsigned char info[1024];
+	struct stat st = { 0 };
+	char *name = basename(z->t.path);
+	int len;
+
+	stat(z->t.path, &st);
+
+	/* name, size, mtime and mode in octal, serial, files and bytes left */
+	len = snprintf((char *)info, sizeof(info) - 1, "%s%c%lld %llo %o 0 1 %lld",
+		       name, 0, (long long)z->t.size,
+		       (unsigned long long)st.st_mtime, st.st_mode,
+		       (long long)z->t.size);
+	len = min(len, (int)sizeof(info) - 2) + 1;
+	info[len - 1] = 0;
+
+	zm_bin_header(z, ZFILE, hdr);
+	zm_data(z, info, len, ZCRCW);
+	zm_flush(z);
+
+	z->state = ZS_FILE;
+	transfer_set_timeout(&z->t, ZM_TIMEOUT);
+}
+
+static void zm_send_zeof(struct zmodem *z)
+{
+	unsigned char hdr[4];
+
+	zm_pos_header(hdr, z->t.size);
+	zm_bin_header(z, ZEOF, hdr);
+	zm_flush(z);
+
+	z->state = ZS_EOF;
+	transfer_set_timeout(&z->t, ZM_TIMEOUT);
+}
+
+static void zm_send_zfin(struct zmodem *z)
+{
+	static const unsigned char zero[4];
+
+	zm_hex_header(z, ZFIN, zero);
+
+	z->state = ZS_FIN;
+	transfer_set_timeout(&z->t, ZM_TIMEOUT);
+}
+
+/* (re)start sending the data at pos */
+static void zm_send_from(struct zmodem *z, off_t pos)
+{
+	z->sent = pos;
+	z->acked = pos;
+	z->t.done = pos;
+	z->frame_open = false;
+	z->wait_ack = false;
+	z->state = ZS_DATA;
+	transfer_want_write(&z->t, true);
+}
+
+static int zm_write(struct transfer *t)
+{
+	struct zmodem *z = container_of(t, struct zmodem, t);
+	unsigned char hdr[4];
+	unsigned char end;
+	off_t n;
+	int ret;
+
+	/* the rest of the last write first */
+	if (z->outlen) {
+		ret = zm_flush(z);
+		if (ret) {
+			transfer_finish(t, ret);
+			return 0;
+		}
+		if (z->outlen)
+			return 0;
+	}
+
+	if (z->state != ZS_DATA || z->wait_ack ||
+	    z->sent - z->acked >= ZM_WINDOW) {
+		/* continued when the receiver reports */
+		transfer_want_write(t, false);
+		transfer_set_timeout(t, ZM_TIMEOUT);
+		return 0;
+	}
+
+	if (!z->frame_open) {
+		zm_pos_header(hdr, z->sent);
+		zm_bin_header(z, ZDATA, hdr);
+		z->frame_open = true;
+		z->frame_start = z->sent;
+	}
+
+	n = min((off_t)ZM_SUBPACKET, t->size - z->sent);
+
+	if (z->sent + n == t->size)
+		end = ZCRCE;
+	else if (z->rxbuflen && z->sent + n - z->frame_start >= z->rxbuflen)
+		end = ZCRCW;
+	else if ((z->sent + n) / ZM_ACK_INTERVAL != z->sent / ZM_ACK_INTERVAL)
+		end = ZCRCQ;
+	else
+		end = ZCRCG;
+
+	zm_data(z, z->map + z->sent, n, end);
+	z->sent += n;
+
+	if (end == ZCRCE) {
+		z->frame_open = false;
+		transfer_want_write(t, false);
+		/* sent together with the subpacket */
+		zm_send_zeof(z);
+		return 0;
+	}
+
+	if (end == ZCRCW) {
+		z->frame_open = false;
+		z->wait_ack = true;
+	}
+
+	ret = zm_flush(z);
+	if (ret)
+		transfer_finish(t, ret);
+
+	return 0;
+}
+
+static int zm_retry(struct zmodem *z)
+{
+	if (++z->retries <= ZM_RETRIES)
+		return 0;
+
+	transfer_abort(&z->t, -EIO);
+
+	return -EIO;
+}
+
+static void zm_header(struct zmodem *z, int type, const unsigned char *hdr)
+{
+	struct transfer *t = &z->t;
+	off_t pos = zm_header_pos(hdr);
+	unsigned char reply[4];
+
+	switch (type) {
+	case ZRINIT:
+		if (z->state == ZS_INIT || z->state == ZS_FILE) {
+			z->crc32 = hdr[ZF0] & CANFC32;
+			z->escctl = hdr[ZF0] & ESCCTL;
+			z->rxbuflen = hdr[0] | hdr[1] << 8;
+			/* a receiver that can't read while writing to disk */
+			if (!z->rxbuflen && !(hdr[ZF0] & CANOVIO))
+				z->rxbuflen = ZM_SUBPACKET;
+			zm_send_zfile(z);
+		} else if (z->state == ZS_EOF) {
+			t->done = t->size;
+			zm_send_zfin(z);
+		}
+		break;
+	case ZRPOS:
+		if (z->state == ZS_INIT || z->state == ZS_FIN)
+			break;
+		if (pos > t->size) {
+			transfer_abort(t, -EPROTO);
+			break;
+		}
+		/* not the first one, something got lost */
+		if (z->state != ZS_FILE && zm_retry(z))
+			break;
+		zm_send_from(z, pos);
+		break;
+	case ZACK:
+		if (z->state != ZS_DATA || pos <= z->acked || pos > z->sent)
+			break;
+		z->acked = pos;
+		t->done = pos;
+		z->retries = 0;
+		if (z->wait_ack && pos == z->sent)
+			z->wait_ack = false;
+		transfer_set_timeout(t, 0);
+		transfer_want_write(t, true);
+		transfer_progress(t);
+		break;
+	case ZSKIP:
+		if (z->state == ZS_FILE)
+			zm_send_zfin(z);
+		break;
+	case ZCRC:
+		if (z->state == ZS_FILE) {
+			off_t len = pos && pos < t->size ? pos : t->size;
+
+			zm_pos_header(reply, ~crc32_update(0xffffffff, z->map, len));
+			zm_bin_header(z, ZCRC, reply);
+			zm_flush(z);
+		}
+		break;
+	case ZCHALLENGE:
+		zm_hex_header(z, ZACK, hdr);
+		break;
+	case ZFIN:
+		if (z->state == ZS_FIN) {
+			ios->write(ios, (const unsigned char *)"OO", 2);
+			transfer_finish(t, 0);
+		}
+		break;
+	case ZNAK:
+		if (zm_retry(z))
+			break;
+		if (z->state == ZS_INIT)
+			zm_send_zrqinit(z);
+		else if (z->state == ZS_FILE)
+			zm_send_zfile(z);
+		else if (z->state == ZS_EOF)
+			zm_send_zeof(z);
+		else if (z->state == ZS_FIN)
+			zm_send_zfin(z);
+		break;
+	case ZABORT:
+	case ZFERR:
+	case ZCAN:
+		transfer_finish(t, -ECANCELED);
+		break;
+	default:
+		break;
+	}
+}
+
+static int hexval(unsigned char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+static bool zm_header_ok(struct zmodem *z)
+{
+	const unsigned char *crc = z->hbuf + 5;
+
+	if (z->hneed == 9)
+		return ~crc32_update(0xffffffff, z->hbuf, 5) ==
+			(uint32_t)(crc[0] | crc[1] << 8 | crc[2] << 16 |
+				   (uint32_t)crc[3] << 24);
+
+	return crc16_ccitt(0, z->hbuf, 5) == (crc[0] << 8 | crc[1]);
+}
+
+/* feed a byte to the header parser, returns true for a complete header */
+static bool zm_parse(struct zmodem *z, unsigned char c)
+{
+	int v;
+
+	switch (z->hstate) {
+	case ZH_IDLE:
+		if (c == ZPAD)
+			z->hstate = ZH_PAD;
+		break;
+	case ZH_PAD:
+		if (c == ZDLE)
+			z->hstate = ZH_FORMAT;
+		else if (c != ZPAD)
+			z->hstate = ZH_IDLE;
+		break;
+	case ZH_FORMAT:
+		z->hlen = 0;
+		z->hesc = false;
+		z->hstate = ZH_BIN;
+		if (c == ZBIN) {
+			z->hneed = 7;
+		} else if (c == ZBIN32) {
+			z->hneed = 9;
+		} else if (c == ZHEX) {
+			z->hneed = 7;
+			z->hstate = ZH_HEX;
+		} else {
+			z->hstate = ZH_IDLE;
+		}
+		break;
+	case ZH_HEX:
+		v = hexval(c & 0x7f);
+		if (v < 0) {
+			z->hstate = ZH_IDLE;
+			break;
+		}
+		if (z->hlen & 1)
+			z->hbuf[z->hlen / 2] |= v;
+		else
+			z->hbuf[z->hlen / 2] = v << 4;
+		if (++z->hlen < 2 * z->hneed)
+			break;
+		z->hstate = ZH_IDLE;
+		return zm_header_ok(z);
+	case ZH_BIN:
+		if ((c & 0x7f) == XON || (c & 0x7f) == 0x13)
+			break;
+		if (!z->hesc && c == ZDLE) {
+			z->hesc = true;
+			break;
+		}
+		if (z->hesc) {
+			z->hesc = false;
+			if (c == ZRUB0)
+				c = 0x7f;
+			else if (c == ZRUB1)
+				c = 0xff;
+			else
+				c ^= 0x40;
+		}
+		z->hbuf[z->hlen++] = c;
+		if (z->hlen < z->hneed)
+			break;
+		z->hstate = ZH_IDLE;
+		return zm_header_ok(z);
+	}
+
+	return false;
+}
+
+static int zm_receive(struct transfer *t, const unsigned char *buf, int len)
+{
+	struct zmodem *z = container_of(t, struct zmodem, t);
+	int i;
+
+	for (i = 0; i < len; i++) {
+		/* a row of CANs (the same as ZDLE) outside a header aborts */
+		if (z->hstate == ZH_IDLE && buf[i] == ZDLE) {
+			if (++z->cans == 5) {
+				transfer_finish(t, -ECANCELED);
+				return i + 1;
+			}
+			continue;
+		}
+		z->cans = 0;
+
+		if (!zm_parse(z, buf[i]))
+			continue;
+
+		zm_header(z, z->hbuf[0], z->hbuf + 1);
+		if (!transfer_active())
+			return i + 1;
+	}
+
+	return len;
+}
+
+static void zm_timeout(struct transfer *t)
+{
+	struct zmodem *z = container_of(t, struct zmodem, t);
+
+	if (z->state == ZS_FIN && z->retries >= 2) {
+		/* the data is there, the receiver just didn't say goodbye */
+		transfer_finish(t, 0);
+		return;
+	}
+
+	if (zm_retry(z))
+		return;
+
+	switch (z->state) {
+	case ZS_INIT:
+		zm_send_zrqinit(z);
+		break;
+	case ZS_FILE:
+		zm_send_zfile(z);
+		break;
+	case ZS_DATA:
+		/* the ZACKs got lost, go back to what's known to be there */
+		zm_send_from(z, z->acked);
+		break;
+	case ZS_EOF:
+		zm_send_zeof(z);
+		break;
+	case ZS_FIN:
+		zm_send_zfin(z);
+		break;
+	}
+}
+
+static void zm_free(struct transfer *t)
+{
+	struct zmodem *z = container_of(t, struct zmodem, t);
+
+	if (z->map)
+		munmap((void *)z->map, t->size);
+	free(t->path);
+	free(z);
+}
+
+int zmodem_send(char *path)
+{
+	struct zmodem *z;
+	struct stat st;
+	int fd, ret;
+
+	z = calloc(1, sizeof(*z));
+	if (!z)
+		return -ENOMEM;
+
+	z->t.proto = "zmodem";
+	z->t.send = true;
+	z->t.path = strdup(path);
+	z->t.receive = zm_receive;
+	z->t.timeout = zm_timeout;
+	z->t.write = zm_write;
+	z->t.free = zm_free;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st)) {
+		ret = -errno;
+		printf("cannot open %s: %s\n", path, strerror(errno));
+		goto err;
+	}
+	z->t.size = st.st_size;
+
+	if (st.st_size) {
+		z->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (z->map == MAP_FAILED) {
+			ret = -errno;
+			z->map = NULL;
+			printf("cannot map %s: %s\n", path, strerror(errno));
+			goto err;
+		}
+		madvise((void *)z->map, st.st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	fd = -1;
+
+	ret = transfer_start(&z->t);
+	if (ret)
+		goto err;
+
+	/* start rz in case we talk to a shell */
+	ios->write(ios, (const unsigned char *)"rz\r", 3);
+	z->state = ZS_INIT;
+	zm_send_zrqinit(z);
+
+	return 0;
+err:
+	if (fd >= 0)
+		close(fd);
+	zm_free(&z->t);
+	return ret;
+}